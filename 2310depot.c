@@ -2,6 +2,7 @@
 #include <string.h>
 #include <stdlib.h>
 #include <ctype.h>
+#include <errno.h>
 #include <netdb.h>
 #include <unistd.h>
 #include <pthread.h>
@@ -9,9 +10,15 @@
 #include "2310depot.h"
 #include "comms.h"
 #include "channel.h"
-#include "queue.h"
+#include "event.h"
+#include "shard.h"
+#include "connector.h"
+#include "trace.h"
+#include "stock.h"
 
 #define LINESIZE 500
+// Starting size of each connection's read buffer (thread mode).
+#define READ_BUFFER_START 4096
 #define BOLDGREEN "\033[1m\033[32m"
 #define RESET "\033[0m"
 
@@ -24,7 +31,8 @@ Status show_message(Status s) {
     const char *messages[] = {"",
             "Usage: 2310depot name {goods qty}\n", 
             "Invalid name(s)\n",
-            "Invalid quantity\n"};
+            "Invalid quantity\n",
+            "Invalid stock file\n"};
     fputs(messages[s], stderr);
     return s;
 }
@@ -67,11 +75,13 @@ int check_int(char *string) {
  * @param argc - number of arguments supplied
  * @param argv - arguments supplied at command line.
  * @param info - depot struct to hold info
+ * @param storeGoods - 1 to store the goods given, 0 to only check them (when
+ * the inventory was recovered from the log)
  * @return 0 - parsed successfully
  *         1 - Empty name or name contains banned characters
  *         2 - Quantity parameter is < 0 or is not a number
  */
-int parse(int argc, char **argv, Depot *info) {
+int parse(int argc, char **argv, Depot *info, int storeGoods) {
     // check not empty name
     if (strlen(argv[1]) == 0) {
         return show_message(NAMEERR);
@@ -87,133 +97,603 @@ int parse(int argc, char **argv, Depot *info) {
     info->name = argv[1];
 
     /* parse items */
-    // malloc based on number of items from the commandline
-    info->items = malloc(sizeof(Item) * ((argc - 2) / 2));
-    int pos = 0;
     // loop over items (skipping program name and depot name)
+    char *itemName = NULL;
     for (int i = 2; i < argc; i++) {
         if (i % 2 == 0) {
             // parse item name (every second argv) & check illegal characters
-            Item item;
             for (int j = 0; j < strlen(argv[i]); j++) {
                 if ((argv[i][j] == ' ') || (argv[i][j] == '\n')
                         || (argv[i][j] == '\r') || (argv[i][j] == ':')) {
                     return show_message(NAMEERR);
                 }
             }
-            // store item
-            item.name = argv[i];
-            info->items[pos] = item;
+            // hold on to the name until its quantity is parsed
+            itemName = argv[i];
         } else {
             // parse item quantity.
             int countStatus = check_int(argv[i]);
             if (countStatus != 0) {
                 return show_message(QUANERR);
             }
-            // store item quantity
-            info->items[pos].count = atoi(argv[i]);
-            pos++;
+            // store item with the shard that owns it
+            int length = strlen(itemName);
+            if (storeGoods) {
+                item_add(shard_for(info, itemName, length), itemName, length,
+                        atoi(argv[i]));
+            }
         }
     }
-    info->totalItems = pos;
 
     return OK;
 }
 
 /**
- * Function to print goods and neighbours lexicographically
- * @param items - array of items to print
- * @param itemSize - size of the item array
- * @param connections - array of connections to the depot
- * @param connectionSize - size of the connection array.
- */
-void lexicographic_print(Item *items, int itemSize, Connection *connections,
-        int connectionSize) {
-    /* print items */
-    Item storage;
-    for (int i = 0; i < itemSize; ++i) {
-        for (int j = i + 1; j < itemSize; ++j) {
-            if (strcmp(items[i].name, items[j].name) > 0) {
-                // swap if not lexicographically ordered
-                storage = items[i];
-                items[i] = items[j];
-                items[j] = storage;
-            }
-        }
+ * Function to handle printing of goods and neighbours when receiving SIGHUP.
+ * Items and neighbours are kept in order as they are added, so the dump is
+ * a walk over each, and it is only written out once every lock is released.
+ * @param data - struct representing depot data.
+ */
+void sighup_print(Depot *data) {
+    char *dump;
+    size_t size;
+    FILE *out = open_memstream(&dump, &size);
+    fprintf(out, "Goods:\n");
+    // lock and unlock via mutex
+    pthread_mutex_lock(&data->dataLock);
+
+    // lock every shard so no goods are added or removed while they are
+    // gathered (counts of existing items may still change)
+    for (int i = 0; i < data->shardCount; i++) {
+        pthread_mutex_lock(&data->shards[i].lock);
     }
-    // print the items after sorting
-    for (int i = 0; i < itemSize; ++i) {
-        if (items[i].count != 0) {
-            printf("%s %d\n", items[i].name, items[i].count);
-            fflush(stdout);
-        }
+    write_items(data, "", 0, out, "%s %d\n");
+    for (int i = 0; i < data->shardCount; i++) {
+        pthread_mutex_unlock(&data->shards[i].lock);
     }
 
     /* print neighbours */
-    printf("Neighbours:\n");
+    fprintf(out, "Neighbours:\n");
+    OrderCursor cursor;
+    order_seek(&data->neighbourOrder, "", 0, &cursor);
+    const char *name;
+    int position;
+    while (order_next(&cursor, &name, &position)) {
+        fprintf(out, "%s\n", name);
+    }
+    pthread_mutex_unlock(&data->dataLock);
+
+    fclose(out);
+    fwrite(dump, 1, size, stdout);
     fflush(stdout);
-    Connection temp;
-    for (int i = 0; i < connectionSize; ++i) {
-        for (int j = i + 1; j < connectionSize; ++j) {
-            if (strcmp(connections[i].name, connections[j].name) > 0) {
-                // swap if not lexicographically ordered
-                temp = connections[i];
-                connections[i] = connections[j];
-                connections[j] = temp;
+    free(dump);
+}
+
+/**
+ * Function for thread to read messages from channel and act upon them
+ * @param data - void pointer (parsed to Shard struct)
+ * @return void pointer
+ */
+void *thread_worker(void *data) {
+    // parse Shard struct from void*
+    Shard *shard = (Shard *) data;
+    Depot *depot = shard->depot;
+    int sample = depot->config.metricsSample;
+    char name[32];
+    snprintf(name, sizeof(name), "worker%d", (int) (shard - depot->shards));
+    trace_name_thread(name);
+    while (1) {
+        // wait for message
+        wait_channel(shard->channel);
+        Message *message;
+        // the first message after waiting is always timed, then a sample
+        int sinceTimed = sample;
+        // read every message currently in the channel
+        while (read_channel(shard->channel, (void **) &message)) {
+            trace_event(message->traceId, TRACE_DEQUEUE, 0);
+            trace_current(message->traceId);
+            int timed = ++sinceTimed >= sample;
+            if (timed) {
+                sinceTimed = 0;
+            }
+            long started = 0;
+            if (timed || message->posted != 0) {
+                started = metrics_now();
+            }
+            if (message->posted != 0) {
+                record_time(&shard->metrics.wait, started - message->posted);
+            }
+            if (message->barrier) {
+                // the connection's earlier messages to other workers go first
+                wait_settled(message->origin, shard->index);
+            }
+            int kind = -1; // SIGHUP is only counted
+            // perform function of the message
+            if (message->sighup == 1) {
+                sighup_print(depot);
+            } else if (message->batch) {
+                trace_event(message->traceId, TRACE_DISPATCH, 0);
+                process_batch(depot, shard, &shard->arena, message->input,
+                        message->length, message->batch);
+                arena_reset(&shard->arena);
+                kind = METRIC_BATCH;
+            } else if (message->framed) {
+                // already decoded by the reader
+                trace_event(message->traceId, TRACE_DISPATCH, 0);
+                process_command(depot, &message->command, message->streamTo,
+                        message->streamFrom, message->socket);
+                kind = message->command.verb;
+            } else {
+                kind = process_input(depot, &shard->arena, message->input,
+                        message->length, message->streamTo,
+                        message->streamFrom, message->socket);
+                // everything parsed out of the message goes at once
+                arena_reset(&shard->arena);
             }
+            count_processed(&shard->metrics, kind,
+                    timed ? metrics_now() - started : -1);
+            trace_event(message->traceId, TRACE_COMPLETE, kind);
+            trace_current(0);
+            finish_message(shard);
+            // the message may be reused as soon as it is recycled, so keep
+            // what is still needed from it
+            Credits *credits = message->credits;
+            int barrier = message->barrier;
+            if (message->sighup != 1) {
+                recycle_message(message);
+            }
+            // let the sending connection read its next line
+            if (barrier) {
+                unblock_credit(credits);
+            }
+            release_credit(credits);
         }
     }
-    // print neighbours after sorting
-    for (int i = 0; i < connectionSize; ++i) {
-        if (connections[i].neighbourStatus == 1) {
-            printf("%s\n", connections[i].name);
-            fflush(stdout);
+}
+
+/**
+ * Function to send our IM message to a newly connected depot
+ * @param connection - ThreadData of the connection
+ */
+void send_greeting(ThreadData *connection) {
+    fprintf(connection->streamTo, "IM:%u:%s\n",
+            connection->depot->listeningPort, connection->depot->name);
+    if (connection->depot->config.frames) {
+        // depots which do not understand framing ignore this line
+        fprintf(connection->streamTo, "Frames:%d\n", FRAME_VERSION);
+    }
+    fflush(connection->streamTo);
+}
+
+/**
+ * Function to make a receive buffer for a connection
+ * @param size - number of bytes it holds
+ * @return ReadBuffer no message points into yet
+ */
+ReadBuffer *new_read_buffer(int size) {
+    ReadBuffer *buffer = malloc(sizeof(ReadBuffer) + size);
+    buffer->references = 0;
+    buffer->size = size;
+    return buffer;
+}
+
+/**
+ * Function to release a receive buffer a message pointed into, freeing it if
+ * the reader has let go of it and this was the last message to need it
+ * @param buffer - ReadBuffer to release
+ */
+static void release_buffer(ReadBuffer *buffer) {
+    if (__atomic_sub_fetch(&buffer->references, 1, __ATOMIC_ACQ_REL) == 0) {
+        free(buffer);
+    }
+}
+
+/**
+ * Function for the reader to let go of its receive buffer, freeing it if
+ * every message given a slice of it has already released it
+ * @param connection - ThreadData of the connection
+ */
+void drop_buffer(ThreadData *connection) {
+    if (__atomic_add_fetch(&connection->buffer->references,
+            connection->bufferLent, __ATOMIC_ACQ_REL) == 0) {
+        free(connection->buffer);
+    }
+    connection->buffer = NULL;
+    connection->bufferLent = 0;
+}
+
+/**
+ * Function to make room at the end of a connection's receive buffer. Bytes
+ * already taken may still be in messages the workers have not finished, so
+ * the buffer is only reused once they have all released it. Otherwise the
+ * bytes not yet taken move to a new buffer, which only grows when a single
+ * line (or frame) fills the old one.
+ * @param connection - ThreadData of the connection
+ */
+void reserve_buffer(ThreadData *connection) {
+    ReadBuffer *buffer = connection->buffer;
+    int idle = __atomic_load_n(&buffer->references, __ATOMIC_ACQUIRE)
+            + connection->bufferLent == 0;
+    if (idle) {
+        // nothing points into the buffer, so start counting again
+        __atomic_store_n(&buffer->references, 0, __ATOMIC_RELAXED);
+        connection->bufferLent = 0;
+        if (connection->bufferStart == connection->bufferUsed) {
+            connection->bufferStart = 0;
+            connection->bufferUsed = 0;
         }
     }
+    if (connection->bufferUsed < buffer->size) {
+        return;
+    }
+
+    int kept = connection->bufferUsed - connection->bufferStart;
+    int size = kept == buffer->size ? buffer->size * 2 : buffer->size;
+    if (idle && size == buffer->size) {
+        // keep the partial line, at the start of the buffer
+        memmove(buffer->data, buffer->data + connection->bufferStart, kept);
+    } else if (idle) {
+        buffer = realloc(buffer, sizeof(ReadBuffer) + size);
+        buffer->size = size;
+    } else {
+        buffer = new_read_buffer(size);
+        memcpy(buffer->data, connection->buffer->data
+                + connection->bufferStart, kept);
+        drop_buffer(connection);
+    }
+    connection->buffer = buffer;
+    connection->bufferStart = 0;
+    connection->bufferUsed = kept;
 }
 
 /**
- * Function to handle printing of goods and neighbours when receiving SIGHUP
- * @param data - struct representing depot data.
+ * Function to take a message for the worker from a connection, reusing one
+ * the worker has finished with where possible
+ * @param connection - ThreadData of the connection the message arrived on
+ * @return Message with no input yet
  */
-void sighup_print(Depot *data) {
-    printf("Goods:\n");
-    fflush(stdout);
-    // lock and unlock via mutex
-    pthread_mutex_lock(&data->dataLock);
-    lexicographic_print(data->items, data->totalItems, data->neighbours,
-            data->neighbourCount);
-    pthread_mutex_unlock(&data->dataLock);
+static Message *take_message(ThreadData *connection) {
+    if (connection->spareMessages == NULL) {
+        connection->spareMessages = __atomic_exchange_n(
+                &connection->freeMessages, NULL, __ATOMIC_ACQUIRE);
+    }
+    Message *message = connection->spareMessages;
+    if (message != NULL) {
+        connection->spareMessages = message->next;
+    } else {
+        message = calloc(1, sizeof(Message));
+        message->origin = connection;
+    }
+    message->source = NULL;
+    message->length = 0;
+
+    // fill in the message to send down channel to worker thread
+    message->streamTo = connection->streamTo;
+    message->streamFrom = connection->streamFrom;
+    message->socket = connection->socket;
+    message->sighup = 0;
+    message->credits = &connection->credits;
+    message->framed = 0;
+    message->batch = 0;
+    // only a sample of messages is timestamped for the wait histogram
+    message->posted = 0;
+    int sample = connection->depot->config.metricsSample;
+    if (++connection->sinceStamped >= sample) {
+        connection->sinceStamped = 0;
+        message->posted = metrics_now();
+    }
+    message->traceId = trace_sample(&connection->sinceTraced,
+            connection->depot->config.traceSample);
+    trace_event(message->traceId, TRACE_READ, 0);
+    return message;
+}
 
+/**
+ * Function to add bytes to the end of the message's own copy of its input
+ * @param message - Message to add to
+ * @param text - bytes to add
+ * @param length - number of bytes
+ */
+static void copy_input(Message *message, const char *text, int length) {
+    int needed = message->length + length;
+    if (message->capacity < needed) {
+        // only grow the storage when the input does not fit
+        int capacity = message->capacity > 0 ? message->capacity : LINESIZE;
+        while (capacity < needed) {
+            capacity *= 2;
+        }
+        message->storage = realloc(message->storage, capacity);
+        message->capacity = capacity;
+    }
+    memcpy(message->storage + message->length, text, length);
+    message->input = message->storage;
+    message->length = needed;
 }
 
 /**
- * Function for thread to read messages from channel and act upon them
- * @param data - void pointer (parsed to ThreadData struct)
- * @return void pointer
+ * Function to wrap a line read from a connection in a message for the
+ * worker. The line is not copied: the message points at it in the
+ * connection's buffer, which is kept until the worker recycles the message.
+ * @param connection - ThreadData of the connection the line arrived on
+ * @param line - start of the line in the connection's buffer (including its
+ * newline)
+ * @param length - number of characters in the line
+ * @return Message ready to post to the worker
  */
-void *thread_worker(void *data) {
-    // parse ThreadData struct from void*
-    ThreadData *thread = (ThreadData *) data;
+Message *new_line_message(ThreadData *connection, char *line, int length) {
+    Message *message = take_message(connection);
+    message->input = line;
+    message->length = length;
+    message->source = connection->buffer;
+    connection->bufferLent++;
+    return message;
+}
+
+/**
+ * Function to add a line to the end of a message's input. A line following
+ * straight on from the input in the same buffer only lengthens it, otherwise
+ * the input has to be copied out of the buffer.
+ * @param connection - ThreadData of the connection the line arrived on
+ * @param message - Message to add to
+ * @param line - start of the line in the connection's buffer (including its
+ * newline)
+ * @param length - number of characters in the line
+ */
+static void append_line(ThreadData *connection, Message *message, char *line,
+        int length) {
+    ReadBuffer *source = message->source;
+    if (source == NULL) {
+        copy_input(message, line, length);
+        return;
+    }
+    if (source == connection->buffer
+            && message->input + message->length == line) {
+        message->length += length;
+        return;
+    }
+    char *input = message->input;
+    int kept = message->length;
+    message->source = NULL;
+    message->length = 0;
+    copy_input(message, input, kept);
+    copy_input(message, line, length);
+    release_buffer(source);
+}
+
+/**
+ * Function to add one line of a Batch to the part of the batch for the shard
+ * owning its item. Lines other than Deliver, Withdraw and Transfer are
+ * dropped.
+ * @param connection - ThreadData of the connection the batch arrived on
+ * @param parts - Message per shard (NULL until the shard has a line)
+ * @param line - start of the line in the connection's buffer (including its
+ * newline)
+ * @param length - number of characters in the line
+ */
+void add_batch_line(ThreadData *connection, Message **parts, char *line,
+        int length) {
+    int index = line_shard(connection->depot, line, length);
+    if (index < 0) {
+        return;
+    }
+    if (parts[index] == NULL) {
+        parts[index] = new_line_message(connection, line, length);
+    } else {
+        append_line(connection, parts[index], line, length);
+    }
+    parts[index]->batch++;
+}
+
+/**
+ * Function to post every part of a Batch but the last, which is returned to
+ * be posted by the reader. The whole batch costs the connection one credit,
+ * held by the returned part.
+ * @param connection - ThreadData of the connection the batch arrived on
+ * @param parts - Message per shard (NULL if the shard has no lines)
+ * @return last part of the batch, NULL if the batch had no usable lines
+ */
+Message *finish_batch(ThreadData *connection, Message **parts) {
+    Message *last = NULL;
+    for (int i = 0; i < connection->depot->shardCount; i++) {
+        if (parts[i] == NULL) {
+            continue;
+        }
+        if (last != NULL) {
+            last->credits = NULL;
+            post_message(connection->depot, last);
+        }
+        last = parts[i];
+    }
+    return last;
+}
+
+/**
+ * Function to wrap a command decoded from a frame in a message for the worker
+ * @param connection - ThreadData of the connection the frame arrived on
+ * @param command - decoded Command (its item is in the frame reader's names,
+ * which later frames may change, so it is copied into the message)
+ * @return Message ready to post to the worker
+ */
+Message *new_frame_message(ThreadData *connection, Command *command) {
+    Message *message = take_message(connection);
+    copy_input(message, command->item.start, command->item.length);
+    message->framed = 1;
+    message->command = *command;
+    message->command.item.start = message->input;
+    return message;
+}
+
+/**
+ * Function to hand a processed message back to the connection it came from,
+ * or free it if it has none
+ * @param message - Message the worker has finished with
+ */
+void recycle_message(Message *message) {
+    if (message->source != NULL) {
+        release_buffer(message->source);
+        message->source = NULL;
+    }
+    ThreadData *origin = message->origin;
+    if (origin == NULL) {
+        free(message->storage);
+        free(message);
+        return;
+    }
+    message->next = __atomic_load_n(&origin->freeMessages, __ATOMIC_RELAXED);
+    while (!__atomic_compare_exchange_n(&origin->freeMessages, &message->next,
+            message, true, __ATOMIC_RELEASE, __ATOMIC_RELAXED)) {
+    }
+}
+
+/**
+ * Function to read more of a connection's input into its buffer, after
+ * making room for it (see reserve_buffer)
+ * @param connection - ThreadData of the connection
+ * @return 1 if more bytes were read, 0 once the stream ends (ignore is set)
+ */
+static int fill_buffer(ThreadData *connection) {
+    reserve_buffer(connection);
+    ReadBuffer *buffer = connection->buffer;
+    ssize_t got;
+    do {
+        got = read(fileno(connection->streamFrom),
+                buffer->data + connection->bufferUsed,
+                buffer->size - connection->bufferUsed);
+    } while (got < 0 && errno == EINTR);
+    if (got <= 0) {
+        connection->ignore = 1; // EOF or error from depot (disconnects)
+        return 0;
+    }
+    connection->bufferUsed += got;
+    return 1;
+}
+
+/**
+ * Function to take the next line from a connection's buffer, reading until
+ * all of it has arrived
+ * @param connection - ThreadData of the connection
+ * @param length - set to the number of characters in the line (including
+ * its newline)
+ * @return start of the line, in the buffer until the next read, NULL once
+ * the stream ends
+ */
+static char *next_line(ThreadData *connection, int *length) {
+    int scanned = 0; // bytes already known to hold no newline
     while (1) {
-        // wait for message
-        sem_wait(thread->signal);
-        Message *message;
-        // read message from the channel
-        pthread_mutex_lock(&thread->channelLock);
-        read_channel(thread->channel, (void **) &message);
-        pthread_mutex_unlock(&thread->channelLock);
+        char *line = connection->buffer->data + connection->bufferStart;
+        int available = connection->bufferUsed - connection->bufferStart;
+        char *end = memchr(line + scanned, '\n', available - scanned);
+        if (end != NULL) {
+            *length = end - line + 1;
+            connection->bufferStart += *length;
+            return line;
+        }
+        scanned = available;
+        if (!fill_buffer(connection)) {
+            return NULL; // a partial last line is dropped
+        }
+    }
+}
+
+/**
+ * Function to take the next frame from a connection's buffer, reading until
+ * all of it has arrived
+ * @param connection - ThreadData of the connection (its buffer starts with
+ * the frame's marker byte)
+ * @param command - Command to fill in if the frame holds one
+ * @return 1 if a command was decoded, 0 if not, -1 on EOF or a malformed
+ * header (the stream cannot be followed after one)
+ */
+static int next_frame(ThreadData *connection, Command *command) {
+    while (1) {
+        const unsigned char *frame = (const unsigned char *)
+                connection->buffer->data + connection->bufferStart;
+        int length;
+        int header = frame_header(frame,
+                connection->bufferUsed - connection->bufferStart, &length);
+        if (header < 0) {
+            return -1;
+        } else if (header > 0) {
+            connection->bufferStart += header + length;
+            count_received(&connection->metrics, header + length, 1);
+            return read_frame(&connection->frames, frame + header, length,
+                    command) == 1;
+        }
+        if (!fill_buffer(connection)) {
+            return -1;
+        }
+    }
+}
 
-//        printf("worker read %s\n", message->input);
-//        fflush(stdout);
+/**
+ * Function to read the lines of a Batch from a connection
+ * @param connection - ThreadData of the connection
+ * @param count - number of lines in the batch
+ * @return last part of the batch to post to the worker, NULL if the batch
+ * had no usable lines
+ */
+static Message *read_stream_batch(ThreadData *connection, int count) {
+    Message **parts = calloc(connection->depot->shardCount,
+            sizeof(Message *));
+    for (int i = 0; i < count; i++) {
+        int length;
+        char *line = next_line(connection, &length);
+        if (line == NULL) {
+            break; // keep the lines which did arrive
+        }
+        count_received(&connection->metrics, length, 1);
+        add_batch_line(connection, parts, line, length);
+    }
+    Message *last = finish_batch(connection, parts);
+    free(parts);
+    return last;
+}
 
-        // perform function of the message
-        if (message->sighup == 1) {
-            sighup_print(thread->depot);
-        } else {
-            process_input(thread->depot, message->input, message->streamTo,
-                    message->streamFrom, message->socket);
+/**
+ * Function to read the next message from a connection. Lines are split in
+ * place in the connection's buffer, and the messages posted to the worker
+ * point at them there.
+ * @param connection - ThreadData of the connection
+ * @return Message ready to post to the worker, NULL once the stream ends
+ */
+static Message *read_stream_message(ThreadData *connection) {
+    while (1) {
+        if (connection->depot->config.frames) {
+            // frames can only arrive if we offered them
+            if (connection->bufferStart == connection->bufferUsed
+                    && !fill_buffer(connection)) {
+                return NULL;
+            }
+            if ((unsigned char)
+                    connection->buffer->data[connection->bufferStart]
+                    == FRAME_MARKER) {
+                Command command;
+                int status = next_frame(connection, &command);
+                if (status < 0) {
+                    return NULL;
+                } else if (status == 0) {
+                    continue; // nothing for the worker, e.g. a name binding
+                }
+                return new_frame_message(connection, &command);
+            }
+        }
+
+        int length;
+        char *line = next_line(connection, &length);
+        if (line == NULL) {
+            return NULL; // EOF from depot (disconnects)
+        }
+        count_received(&connection->metrics, length, 1);
+        int count = parse_batch(line, length);
+        if (count < 0) {
+            return new_line_message(connection, line, length);
         }
+
+        Message *message = read_stream_batch(connection, count);
+        if (message != NULL || connection->ignore) {
+            return message;
+        }
+        // nothing in the batch for the worker, the credit is still ours
     }
 }
 
@@ -225,88 +705,106 @@ void *thread_worker(void *data) {
 void *thread_listen(void *data) {
     // parse ThreadData from void pointer
     ThreadData *depotThread = (ThreadData *) data;
+    char name[32];
+    snprintf(name, sizeof(name), "connection%d", depotThread->socket);
+    trace_name_thread(name);
     // send IM message to connected depot
-    fprintf(depotThread->streamTo, "IM:%u:%s\n",
-            depotThread->depot->listeningPort, depotThread->depot->name);
-    fflush(depotThread->streamTo);
-
-    /* read messages from the file stream */
-    char input[LINESIZE];
-    fgets(input, BUFSIZ, depotThread->streamFrom);
-    // continue until EOF from depot (disconnects)
-    while (!feof(depotThread->streamFrom)) {
-        char *dest = malloc(sizeof(char) * (strlen(input)));
-        dest = strncpy(dest, input, strlen(input));
-
-        // create message to send down channel to worker thread
-        Message *message = malloc(sizeof(Message));
-        message->input = dest;
-        message->streamTo = depotThread->streamTo;
-        message->streamFrom = depotThread->streamFrom;
-        message->socket = depotThread->socket;
-
-        bool output = false;
-        while (!output) { // stop once message successfully written
-            // properly lock & unlock mutex.
-            pthread_mutex_lock(&depotThread->channelLock);
-            output = write_channel(depotThread->channel, message);
-            pthread_mutex_unlock(&depotThread->channelLock);
+    send_greeting(depotThread);
+
+    /* read messages from the socket */
+    depotThread->buffer = new_read_buffer(READ_BUFFER_START);
+    while (1) {
+        // wait for the worker to catch up before reading from the socket
+        acquire_credit(&depotThread->credits);
+        Message *message = read_stream_message(depotThread);
+        if (message == NULL) {
+            break;
         }
-        // signal that a message is ready
-        sem_post(depotThread->signal);
-        fgets(input, BUFSIZ, depotThread->streamFrom);
+        post_message(depotThread->depot, message);
     }
+    // the connection is kept, but nothing reads it again
+    drop_buffer(depotThread);
+    __atomic_store_n(&depotThread->metrics.closed, 1, __ATOMIC_RELAXED);
     return NULL;
 }
 
 /**
- * Function to handle incoming connections on the listening port
+ * Function to accept connections from one listening socket until it fails
  * @param info - Depot struct holding related data.
- * @return 0 once
+ * @param server - listening socket to accept from
  */
-int listening(Depot *info) {
-    // place connections in queue.
-    if (listen(info->server, SOMAXCONN)) {
-        return 0;
-    }
-
-    // accept connection
+static void accept_connections(Depot *info, int server) {
     int connectionFd;
     struct sockaddr_in peerAddr;
     socklen_t addrSize = sizeof(peerAddr);
-    while (connectionFd = accept(info->server, (struct sockaddr *) &peerAddr,
-            &addrSize), connectionFd >= 0) {
-        // get streams
-        int dupedFd = dup(connectionFd);
-        FILE *streamTo = fdopen(connectionFd, "w");
-        FILE *streamFrom = fdopen(dupedFd, "r");
-
-        // prevent same port connection (mutex as sharing memory with worker)
-        pthread_mutex_lock(&info->dataLock);
-        for (int i = 0; i < info->neighbourCount; i++) {
-            if (info->neighbours[i].addr == ntohs(peerAddr.sin_port)) {
+    while (1) {
+        connectionFd = accept(server, (struct sockaddr *) &peerAddr,
+                &addrSize);
+        if (connectionFd < 0) {
+            // a client giving up before it is accepted is no reason to stop
+            if (errno == EINTR || errno == ECONNABORTED) {
                 continue;
             }
+            return;
         }
+        // start reading from the connection
+        serve_connection(info, connectionFd);
+    }
+}
 
-        // spin up listening thread for the connection
-        ThreadData *val = malloc(sizeof(ThreadData));
-        val->depot = info;
-        val->streamTo = streamTo;
-        val->streamFrom = streamFrom;
-        val->channel = info->channel;
-        val->signal = info->signal;
-        val->channelLock = info->channelLock;
-        val->socket = connectionFd;
-        pthread_mutex_unlock(&info->dataLock);
+/**
+ * Function for thread to accept connections from its own listening socket
+ * @param data - void pointer (parsed to Acceptor struct)
+ * @return void pointer
+ */
+void *thread_accept(void *data) {
+    Acceptor *acceptor = (Acceptor *) data;
+    accept_connections(acceptor->depot, acceptor->server);
+    free(acceptor);
+    return NULL;
+}
 
+/**
+ * Function to handle incoming connections on the listening port
+ * @param info - Depot struct holding related data.
+ * @return 0 once
+ */
+int listening(Depot *info) {
+    if (info->serverCount == 0) {
+        return 0;
+    }
+    // every socket but the first gets a thread of its own
+    for (int i = 1; i < info->serverCount; i++) {
+        Acceptor *acceptor = malloc(sizeof(Acceptor));
+        acceptor->depot = info;
+        acceptor->server = info->servers[i];
         pthread_t tid;
-        pthread_create(&tid, 0, thread_listen, (void *) val);
-        //pthread_join(tid, NULL);
+        pthread_create(&tid, 0, thread_accept, (void *) acceptor);
     }
+    accept_connections(info, info->servers[0]);
     return 0;
 }
 
+/**
+ * Function to open a socket and listen on it
+ * @param address - address to bind to (port 0 for any free port)
+ * @param share - 1 to let other sockets listen on the same port
+ * @return fd of the socket, -1 if it cannot listen
+ */
+static int open_listener(struct sockaddr *address, int share) {
+    int serv = socket(AF_INET, SOCK_STREAM, 0); // 0 == use default protocol
+    int on = 1;
+    if (share) {
+        setsockopt(serv, SOL_SOCKET, SO_REUSEPORT, &on, sizeof(on));
+    }
+    if (bind(serv, address, sizeof(struct sockaddr_in))
+            || listen(serv, SOMAXCONN)) {
+        close(serv);
+        return -1;
+    }
+    return serv;
+}
+
 /**
  * Function to setup port to listen on.
  * @param info - Depot struct holding related data.
@@ -325,21 +823,38 @@ void setup_listen(Depot *info) {
         freeaddrinfo(addrInfo);
     }
 
-    // create a socket and bind it to a port
-    int serv = socket(AF_INET, SOCK_STREAM, 0); // 0 == use default protocol
-    bind(serv, (struct sockaddr *) addrInfo->ai_addr, sizeof(struct sockaddr));
+    // create a socket, bind it to a port and listen on it
+    int acceptors = info->config.acceptors;
+    info->servers = malloc(sizeof(int) * acceptors);
+    info->serverCount = 0;
+    int serv = open_listener(addrInfo->ai_addr, acceptors > 1);
 
     // parse the port from related structs
     struct sockaddr_in addr;
     memset(&addr, 0, sizeof(struct sockaddr_in));
     socklen_t len = sizeof(struct sockaddr_in);
-    getsockname(serv, (struct sockaddr *) &addr, &len);
+    if (serv >= 0) {
+        getsockname(serv, (struct sockaddr *) &addr, &len);
+        info->servers[info->serverCount++] = serv;
+    }
+
+    // the other acceptors' sockets share the port, and the kernel spreads
+    // new connections across them
+    ((struct sockaddr_in *) addrInfo->ai_addr)->sin_port = addr.sin_port;
+    for (int i = 1; i < acceptors && serv >= 0; i++) {
+        int shared = open_listener(addrInfo->ai_addr, 1);
+        if (shared < 0) {
+            break; // make do with the sockets already listening
+        }
+        info->servers[info->serverCount++] = shared;
+    }
+    freeaddrinfo(addrInfo);
 
-    // print the port to stdout & save the data
+    // print the port to stdout & save the data (only once every socket is
+    // listening, so it can be connected to straight away)
     printf("%u\n", ntohs(addr.sin_port));
     fflush(stdout);
     info->listeningPort = ntohs(addr.sin_port);
-    info->server = serv;
 
     /* block SIGPIPE */
     signal(SIGPIPE, SIG_IGN);
@@ -350,38 +865,55 @@ void setup_listen(Depot *info) {
  * @param info - Depot struct holding related data.
  */
 void allocate_memory(Depot *info) {
-    // initialise deferred command array
-    info->deferred = (Deferred *) malloc(1 * sizeof(Deferred *));
-    info->defLength = 1;
-    info->defCount = 0;
+    // initialise deferred command store
+    init_deferred(&info->deferred);
+    pthread_mutex_init(&info->deferredLock, NULL);
 
     // initialise neighbour array
     info->neighbours = malloc(500 * sizeof(Connection));
     info->neighbourCount = 0;
     info->neighbourLength = 500;
+    init_order(&info->neighbourOrder);
+    init_neighbour_index(&info->neighbourIndex);
 }
 
 /**
- * Function to add a deferred command
- * @param arr - array of deferred commands
- * @param numElements - number of elements in the deferred command array
- * @param pos - int position to add to
- * @param cmd - Deferred struct containing command to defer.
+ * Function to hand a message to the worker thread
+ * @param info - Depot struct holding related data.
+ * @param message - Message to process
  */
-void add_deferred(Deferred **arr, int *numElements, int *pos, Deferred *cmd) {
-    Deferred *temp;
-    int tempLength = *numElements + 1;
+void post_message(Depot *info, Message *message) {
+    Shard *shard = route_message(info, message);
+    if (message->barrier) {
+        // stop reading the connection until this message has been processed
+        block_credit(message->credits);
+    }
+    trace_event(message->traceId, TRACE_ENQUEUE, 0);
+    // the channel grows as required, so the write always succeeds
+    unsigned long position = write_channel(shard->channel, message);
+    if (message->origin != NULL) {
+        message->origin->posted[shard->index] = position;
+    }
+}
 
-    /* increment size of list and store element */
-    temp = realloc(*arr, tempLength * sizeof(Deferred));
-    temp[*pos] = *cmd;
-    *pos += 1;
-    *arr = temp;
-    *numElements = tempLength;
+/**
+ * Function to write the trace of sampled messages to the trace file
+ * @param info - Depot struct holding related data.
+ */
+static void write_trace_file(Depot *info) {
+    FILE *out = fopen(info->config.traceFile, "w");
+    if (out == NULL) {
+        fprintf(stderr, "Trace: cannot write %s\n", info->config.traceFile);
+        return;
+    }
+    int events = write_trace(out);
+    fclose(out);
+    fprintf(stderr, "Trace: %d events to %s\n", events,
+            info->config.traceFile);
 }
 
 /**
- * Function for thread to wait for SIGHUP signal
+ * Function for thread to wait for SIGHUP (and SIGUSR1/SIGUSR2) signals
  * @param info - Depot struct holding related data.
  * @return void pointer
  */
@@ -392,21 +924,37 @@ void *sigmund(void *info) {
     // create message to send down channel for SIGHUP
     Message *message = malloc(sizeof(Message));
     message->sighup = 1;
+    message->credits = NULL;
+    message->barrier = 0;
+    message->origin = NULL;
+    message->posted = 0;
+    message->traceId = 0;
 
-    // set signal to listen for - SIGHUP
+    // set signals to listen for - SIGHUP, SIGUSR1 and SIGUSR2
     sigset_t set;
     sigemptyset(&set);
     sigaddset(&set, SIGHUP);
+    sigaddset(&set, SIGUSR1);
+    sigaddset(&set, SIGUSR2);
     int num;
     while (!sigwait(&set, &num)) {  // block here until a signal arrives
-        bool output = false;
-        // send output down channel (lock appropriately)
-        while (!output) {
-            pthread_mutex_lock(&data->channelLock);
-            output = write_channel(data->channel, message);
-            pthread_mutex_unlock(&data->channelLock);
-            sem_post(data->signal);
+        if (num == SIGUSR1) {
+            // flow counters are atomic, so report them straight away
+            flow_report(&data->flow, queued_messages(data), stderr);
+            report_neighbours(data, stderr);
+            if (data->wal != NULL) {
+                wal_report(data->wal, stderr);
+            }
+            fprintf(stderr, "Metrics:\n");
+            write_metrics(data, stderr, "%s %lu\n");
+            continue;
         }
+        if (num == SIGUSR2) {
+            write_trace_file(data);
+            continue;
+        }
+        // send output down channel
+        post_message(data, message);
     }
     return 0;
 }
@@ -418,50 +966,75 @@ void *sigmund(void *info) {
  * @return 0 - normal exit
  *         2 - Empty name or name contains banned characters
  *         3 - Quantity parameter is <0 or not a number
+ *         4 - Stock file cannot be read or is corrupt
  */
 int start_up(int argc, char **argv) {
     Depot info;
 
-    // allocate space for deferred & neighbour lists
+    // allocate space for deferred & neighbour lists, and the item shards
+    load_config(&info.config);
+    if (info.config.traceSample > 0) {
+        init_trace(info.config.traceEvents);
+    }
     allocate_memory(&info);
+    init_shards(&info);
+    memset(&info.flow, 0, sizeof(FlowStats));
+
+    // load the state left by an earlier run, if changes are logged
+    info.wal = NULL;
+    int recovered;
+    Wal *wal = recover_wal(&info, &recovered);
 
     // parse args from commandline
-    int parseStatus = parse(argc, argv, &info);
+    int parseStatus = parse(argc, argv, &info, !recovered);
     if (parseStatus != 0) {
         return parseStatus;
     }
+    // load the stock file too, unless the goods were recovered
+    if (info.config.stockFile != NULL && !recovered) {
+        int stockStatus = load_stock(&info, info.config.stockFile);
+        if (stockStatus != 0) {
+            return stockStatus;
+        }
+    }
 
-    // create mutex for data and semaphore
+    // create mutex for data
     pthread_mutex_t mutex;
     pthread_mutex_init(&mutex, NULL);
     info.dataLock = mutex;
-    sem_t signal;
-    sem_init(&signal, 0, 0);
-    info.signal = &signal;
-
-    // create channel & mutex for channel
-    struct Channel *channel = new_channel();
-    info.channel = channel;
-    pthread_mutex_t channelLock;
-    pthread_mutex_init(&channelLock, NULL);
-    info.channelLock = channelLock;
-
-    // create thread to listen for SIGHUP signal
+
+    // create thread to listen for SIGHUP, SIGUSR1 & SIGUSR2 signals
     pthread_t tid;
     sigset_t set;
     sigemptyset(&set);
     sigaddset(&set, SIGHUP);
+    sigaddset(&set, SIGUSR1);
+    sigaddset(&set, SIGUSR2);
     pthread_sigmask(SIG_BLOCK, &set, 0);
     pthread_create(&tid, 0, sigmund, (void *) &info);
 
-    // create worker thread for processing messages
-    pthread_t tidWorker;
-    ThreadData *worker = malloc(sizeof(ThreadData));
-    worker->depot = &info;
-    worker->channel = info.channel;
-    worker->signal = info.signal;
-    worker->channelLock = info.channelLock;
-    pthread_create(&tidWorker, 0, thread_worker, (void *) worker);
+    // start logging changes before any can be made
+    if (wal != NULL) {
+        start_wal(&info, wal);
+    }
+
+    // start the threads writing Delivers, before there are neighbours
+    start_outbox_writers(&info.outboxes, info.config.writers,
+            info.config.flushMicros);
+
+    // create thread to make outgoing connections
+    start_connector(&info);
+
+    // create worker threads for processing messages, one per shard
+    for (int i = 0; i < info.shardCount; i++) {
+        pthread_t tidWorker;
+        pthread_create(&tidWorker, 0, thread_worker, (void *) &info.shards[i]);
+    }
+
+    // start I/O threads if connections are multiplexed with epoll
+    if (info.config.eventLoop) {
+        start_event_loops(&info);
+    }
 
     // setup listening port
     setup_listen(&info);
@@ -479,6 +1052,7 @@ int start_up(int argc, char **argv) {
  *         1 - Incorrect number of arguments
  *         2 - Empty name or name contains banned characters
  *         3 - Quantity parameter is < 0 or is not a number
+ *         4 - Stock file cannot be read or is corrupt
  */
 int main(int argc, char **argv) {
     if ((argc % 2) != 0 || argc < 2) { // check correct number of args
@@ -5,7 +5,19 @@
 #include <netdb.h>
 #include <unistd.h>
 #include "channel.h"
-#include <semaphore.h>
+#include "config.h"
+#include "flow.h"
+#include "inventory.h"
+#include "arena.h"
+#include "parse.h"
+#include "frame.h"
+#include "deferred.h"
+#include "order.h"
+#include "neighbour.h"
+#include "outbox.h"
+#include "wal.h"
+#include "metrics.h"
+#include <pthread.h>
 
 #ifndef DEPOT_H
 #define DEPOT_H
@@ -15,37 +27,10 @@ typedef enum {
     OK = 0,
     INCORRARGS = 1,
     NAMEERR = 2,
-    QUANERR = 3
+    QUANERR = 3,
+    STOCKERR = 4
 } Status;
 
-// enum for msgs
-typedef enum {
-    CONNECT = 0,
-    IM = 1,
-    DELIVER = 2,
-    WITHDRAW = 3,
-    TRANSFER = 4,
-    DEFD = 5,
-    DEFW = 6,
-    DEFT = 7,
-    EXE = 8
-} Command;
-
-// struct for items
-typedef struct {
-    char *name;
-    int count;
-} Item;
-
-// struct for deferred
-typedef struct {
-    int key;
-    Item *item;
-    char *location;
-    Command command;
-    char *input;
-} Deferred;
-
 // struct for connection
 typedef struct {
     char *name;
@@ -54,15 +39,37 @@ typedef struct {
     FILE *streamTo;
     FILE *streamFrom;
     int neighbourStatus; // 0 for attempted, 1 for confirmed via IM
+    Outbox *outbox; // Delivers waiting to be written to the neighbour
 } Connection;
 
 
-// struct for the depot
+struct EventLoop;
+struct Connector;
+struct Depot;
+struct ThreadData;
+
+// struct for a worker and the partition of items it owns
 typedef struct {
+    struct Depot *depot;
+    int index;
+    struct Channel *channel; // messages for this worker
+    Inventory inventory;
+    pthread_mutex_t lock; // held while items are read or changed
+    Arena arena; // scratch memory for the message being processed
+    WorkerMetrics metrics; // what the worker has processed, and how fast
+    // messages the worker has finished with, in channel order
+    unsigned long finished;
+    int finishWaiters; // threads waiting for finished to grow
+    int finishSequence; // futex word, bumped when finished grows for them
+} Shard;
+
+// struct for the depot
+typedef struct Depot {
     char *name;
-    Item *items;
-    int totalItems;
-    int server;
+    Shard *shards; // one per worker, items are partitioned by name
+    int shardCount;
+    int *servers; // listening sockets, one per acceptor, all on one port
+    int serverCount;
     uint listeningPort;
 
     Connection *attempts;
@@ -72,41 +79,104 @@ typedef struct {
     Connection *neighbours;
     int neighbourLength;
     int neighbourCount;
+    // names of confirmed neighbours in order (values are their positions)
+    Order neighbourOrder;
+    NeighbourIndex neighbourIndex; // neighbours by name and by port
 
     pthread_mutex_t dataLock;
-    sem_t *signal;
 
-    struct Channel *channel;
-    pthread_mutex_t channelLock;
+    FlowStats flow;
+
+    Config config;
+    struct EventLoop *loops; // epoll I/O threads (event loop mode only)
+    unsigned int nextLoop; // loop to hand the next connection to
+    struct Connector *connector; // makes outgoing connections for Connect
+    OutboxPool outboxes; // threads writing Delivers to the neighbours
 
+    DeferredStore deferred; // deferred commands, grouped by key
+    pthread_mutex_t deferredLock; // held while deferred commands change
+    Wal *wal; // log of changes (NULL unless DEPOT_WAL is set)
 
-    Deferred *deferred; // int will point to list of def for that key
-    int defLength;
-    int defCount;
+    // every connection accepted or made (for metrics, under dataLock)
+    struct ThreadData **connections;
+    int connectionCount;
+    int connectionCapacity;
 } Depot;
 
+// struct for an acceptor thread
+typedef struct Acceptor {
+    Depot *depot;
+    int server; // listening socket it accepts from
+} Acceptor;
+
+struct Message;
+
+// struct for the bytes read from a connection. Messages posted to the
+// workers point into it, so it is only written over (or freed) once they
+// have all released it.
+typedef struct ReadBuffer {
+    // messages which have released the buffer, counted down from zero; the
+    // reader adds the messages it handed out when it lets go of the buffer
+    int references;
+    int size; // bytes in data
+    char data[];
+} ReadBuffer;
+
 // struct for listening thread
-typedef struct {
+typedef struct ThreadData {
     Depot *depot;
     FILE *streamTo;
     FILE *streamFrom;
-    struct Channel *channel;
     pthread_mutex_t lock;
-    pthread_mutex_t channelLock;
-    sem_t *signal;
     int socket; // fd for socket
+    Credits credits; // flow control towards the worker
     int ignore; // ignore further messages
+    ReadBuffer *buffer; // bytes read from the connection
+    int bufferStart; // first byte not yet taken
+    int bufferUsed;
+    int bufferLent; // messages given a slice of the buffer
+
+    // event loop mode only
+    struct EventLoop *loop; // loop the connection is watched by
+    int paused; // 1 while out of credit
     int address; // which address did it arrive from
+
+    // messages handed back by workers once processed (pushed lock-free)
+    struct Message *freeMessages;
+    // messages taken from freeMessages, owned by the reading thread
+    struct Message *spareMessages;
+    unsigned int sinceStamped; // messages posted since one was timestamped
+    unsigned int sinceTraced; // messages posted since one was traced
+    // for each shard, the channel writes up to the last message we posted to
+    // it (only written by the reading thread)
+    unsigned long *posted;
+    // names bound by the peer's frames (only used if we offered framing)
+    FrameReader frames;
+    ConnectionMetrics metrics; // what has been received
 } ThreadData;
 
 // struct for message down channel
-typedef struct {
-    char *input;
+typedef struct Message {
+    char *input; // in source, or in storage if it had to be copied
+    int length; // characters in input
+    ReadBuffer *source; // receive buffer input points into (NULL if none)
+    char *storage; // bytes owned by the message
+    int capacity; // bytes allocated for storage
     FILE *streamTo;
     FILE *streamFrom;
     int socket;
     int sighup; //whether to print sighup
     int address; // address of depot
+    Credits *credits; // credit to return once processed (NULL if none)
+    int barrier; // 1 if the connection waits for this message to finish
+    int framed; // 1 if command holds a decoded frame (input is its item)
+    int batch; // number of lines in input if it is (part of) a Batch
+    Command command;
+    ThreadData *origin; // connection to recycle to (NULL to free instead)
+    // when it was posted to the worker (see metrics_now), 0 if not sampled
+    long posted;
+    unsigned int traceId; // id the message is traced under, 0 if not traced
+    struct Message *next; // link while on a free list
 } Message;
 
 
@@ -114,10 +184,29 @@ Status show_message(Status s);
 
 void *thread_listen(void *data);
 
+void post_message(Depot *info, Message *message);
+
+void send_greeting(ThreadData *connection);
+
+Message *new_line_message(ThreadData *connection, char *line, int length);
+
+Message *new_frame_message(ThreadData *connection, Command *command);
+
+void add_batch_line(ThreadData *connection, Message **parts, char *line,
+        int length);
+
+Message *finish_batch(ThreadData *connection, Message **parts);
+
+void recycle_message(Message *message);
+
+ReadBuffer *new_read_buffer(int size);
+
+void reserve_buffer(ThreadData *connection);
+
+void drop_buffer(ThreadData *connection);
+
 int check_int(char *string);
 
 void sighup_print(Depot *data);
 
-void add_deferred(Deferred **arr, int *numElements, int *pos, Deferred *cmd);
-
 #endif
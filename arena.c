@@ -0,0 +1,95 @@
+#include <stdlib.h>
+#include <string.h>
+#include "arena.h"
+
+// Alignment of every allocation.
+#define ARENA_ALIGN 16
+
+/**
+ * Function to allocate a new chunk
+ * @param size - usable bytes in the chunk
+ * @return ArenaChunk not linked to anything
+ */
+static ArenaChunk *new_chunk(size_t size) {
+    ArenaChunk *chunk = malloc(sizeof(ArenaChunk) + size);
+    chunk->next = NULL;
+    chunk->size = size;
+    return chunk;
+}
+
+/**
+ * Function to create an arena
+ * @param arena - Arena struct to initialise
+ * @param size - bytes in the first chunk (enough for a typical message)
+ */
+void init_arena(Arena *arena, size_t size) {
+    arena->first = new_chunk(size);
+    arena->current = arena->first;
+    arena->used = 0;
+}
+
+/**
+ * Function to free every chunk of an arena
+ * @param arena - Arena struct to destroy
+ */
+void destroy_arena(Arena *arena) {
+    ArenaChunk *chunk = arena->first;
+    while (chunk != NULL) {
+        ArenaChunk *next = chunk->next;
+        free(chunk);
+        chunk = next;
+    }
+    arena->first = NULL;
+    arena->current = NULL;
+}
+
+/**
+ * Function to allocate memory from the arena
+ * @param arena - Arena to allocate from
+ * @param size - number of bytes wanted
+ * @return memory valid until the arena is next reset
+ */
+void *arena_alloc(Arena *arena, size_t size) {
+    size = (size + ARENA_ALIGN - 1) & ~((size_t) ARENA_ALIGN - 1);
+    while (arena->used + size > arena->current->size) {
+        ArenaChunk *next = arena->current->next;
+        if (next == NULL || next->size < size) {
+            // no kept chunk is big enough, splice in a new one
+            ArenaChunk *chunk = new_chunk(size > arena->first->size
+                    ? size : arena->first->size);
+            chunk->next = next;
+            arena->current->next = chunk;
+            next = chunk;
+        }
+        arena->current = next;
+        arena->used = 0;
+    }
+
+    void *output = arena->current->data + arena->used;
+    arena->used += size;
+    return output;
+}
+
+/**
+ * Function to copy part of a string into the arena
+ * @param arena - Arena to allocate from
+ * @param string - characters to copy
+ * @param length - number of characters to copy
+ * @return terminated copy valid until the arena is next reset
+ */
+char *arena_strndup(Arena *arena, const char *string, size_t length) {
+    char *output = arena_alloc(arena, length + 1);
+    memcpy(output, string, length);
+    output[length] = '\0';
+    return output;
+}
+
+/**
+ * Function to release everything allocated from the arena, in O(1). Chunks
+ * are kept for reuse.
+ * @param arena - Arena to reset
+ */
+void arena_reset(Arena *arena) {
+    arena->current = arena->first;
+    arena->used = 0;
+}
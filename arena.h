@@ -0,0 +1,37 @@
+#ifndef ARENA_H
+#define ARENA_H
+
+#include <stddef.h>
+
+// struct for one block of arena memory
+typedef struct ArenaChunk {
+    struct ArenaChunk *next;
+    size_t size;
+    char data[];
+} ArenaChunk;
+
+/*
+ * A bump allocator for memory which only lives as long as one message is
+ * being processed. Allocations are never freed individually - the whole
+ * arena is reset at once, keeping its chunks for the next message, so a
+ * steady stream of messages makes no heap calls. Not threadsafe: each worker
+ * has its own arena.
+ */
+typedef struct {
+    ArenaChunk *first;
+    ArenaChunk *current;
+    // bytes used in the current chunk
+    size_t used;
+} Arena;
+
+void init_arena(Arena *arena, size_t size);
+
+void destroy_arena(Arena *arena);
+
+void *arena_alloc(Arena *arena, size_t size);
+
+char *arena_strndup(Arena *arena, const char *string, size_t length);
+
+void arena_reset(Arena *arena);
+
+#endif
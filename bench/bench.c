@@ -0,0 +1,63 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+#include "bench.h"
+
+/**
+ * Function to get the current time in seconds
+ * @return monotonic time in seconds
+ */
+double bench_now(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+/**
+ * Function to compare two measurements for qsort
+ * @param a - first measurement
+ * @param b - second measurement
+ * @return negative, zero or positive as a is less than, equal to or greater
+ * than b
+ */
+static int compare_doubles(const void *a, const void *b) {
+    double x = *(const double *) a;
+    double y = *(const double *) b;
+    return (x > y) - (x < y);
+}
+
+/**
+ * Function to take a measurement BENCH_REPEATS times, so one run disturbed
+ * by the rest of the machine does not move the result
+ * @param measure - function taking the measurement
+ * @param argument - passed to measure
+ * @return the median measurement
+ */
+double bench_median(double (*measure)(void *), void *argument) {
+    double results[BENCH_REPEATS];
+    for (int i = 0; i < BENCH_REPEATS; i++) {
+        results[i] = measure(argument);
+    }
+    qsort(results, BENCH_REPEATS, sizeof(double), compare_doubles);
+    return results[BENCH_REPEATS / 2];
+}
+
+/**
+ * Function to print the line describing the columns of the results
+ */
+void bench_header(void) {
+    printf("# benchmark\tcase\tmetric\tvalue\n");
+}
+
+/**
+ * Function to print one result
+ * @param benchmark - name of the benchmark
+ * @param label - what was measured (e.g. the size of the structure)
+ * @param metric - unit of the value, such as ns/op or msgs/sec
+ * @param value - the result
+ */
+void bench_report(const char *benchmark, const char *label,
+        const char *metric, double value) {
+    printf("%s\t%s\t%s\t%.1f\n", benchmark, label, metric, value);
+    fflush(stdout);
+}
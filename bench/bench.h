@@ -0,0 +1,22 @@
+#ifndef BENCH_H
+#define BENCH_H
+
+// Times each measurement is taken, the median being reported.
+#define BENCH_REPEATS 5
+
+/*
+ * Shared by the microbenchmarks, so every one reports in the same form: a
+ * line per result of "benchmark<TAB>case<TAB>metric<TAB>value", which
+ * `make bench-run` gathers. Lines starting with '#' are comments.
+ */
+
+double bench_now(void);
+
+double bench_median(double (*measure)(void *), void *argument);
+
+void bench_header(void);
+
+void bench_report(const char *benchmark, const char *label,
+        const char *metric, double value);
+
+#endif
@@ -0,0 +1,134 @@
+#include "bench.h"
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <pthread.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+// Threads connecting at once during a storm.
+#define STORM_CLIENTS 32
+// Connections each client makes by default. A depot keeps the streams of
+// closed connections open, so its repeated storms must stay well inside its
+// limit on open files.
+#define STORM_CONNECTIONS 20
+
+// struct for a storm against one depot
+typedef struct {
+    int port;
+    int perClient; // connections each client makes
+} Storm;
+
+/**
+ * Function to connect to a depot and read its greeting
+ * @param port - port the depot listens on
+ * @return 1 if the depot greeted the connection, 0 if not
+ */
+static int greeted(int port) {
+    struct sockaddr_in address;
+    memset(&address, 0, sizeof(address));
+    address.sin_family = AF_INET;
+    address.sin_port = htons(port);
+    address.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    int fd = socket(AF_INET, SOCK_STREAM, 0);
+    // close with a reset, so storms do not use up ports left in TIME_WAIT
+    struct linger abort = {1, 0};
+    setsockopt(fd, SOL_SOCKET, SO_LINGER, &abort, sizeof(abort));
+    char greeting[256];
+    int ready = connect(fd, (struct sockaddr *) &address, sizeof(address))
+            == 0 && read(fd, greeting, sizeof(greeting)) > 0;
+    close(fd);
+    return ready;
+}
+
+/**
+ * Function for a client thread to make its share of the storm
+ * @param data - void pointer (parsed to Storm struct)
+ * @return void pointer
+ */
+static void *client(void *data) {
+    Storm *storm = (Storm *) data;
+    for (int i = 0; i < storm->perClient; i++) {
+        if (!greeted(storm->port)) {
+            fprintf(stderr, "connection %d was refused\n", i);
+            exit(1);
+        }
+    }
+    return NULL;
+}
+
+/**
+ * Function to time a storm of connections, every client at once
+ * @param argument - void pointer (parsed to Storm struct)
+ * @return connections greeted per second
+ */
+static double time_storm(void *argument) {
+    Storm *storm = (Storm *) argument;
+    pthread_t clients[STORM_CLIENTS];
+    double start = bench_now();
+    for (int i = 0; i < STORM_CLIENTS; i++) {
+        pthread_create(&clients[i], 0, client, storm);
+    }
+    for (int i = 0; i < STORM_CLIENTS; i++) {
+        pthread_join(clients[i], NULL);
+    }
+    return STORM_CLIENTS * storm->perClient / (bench_now() - start);
+}
+
+/**
+ * Function to start a depot with a number of acceptors
+ * @param binary - path of the depot executable
+ * @param acceptors - value of DEPOT_ACCEPTORS
+ * @param port - set to the depot's listening port
+ * @return the depot's process id
+ */
+static pid_t start_depot(const char *binary, int acceptors, int *port) {
+    char value[16];
+    snprintf(value, sizeof(value), "%d", acceptors);
+    setenv("DEPOT_ACCEPTORS", value, 1);
+    int pipeFds[2];
+    if (pipe(pipeFds) != 0) {
+        exit(1);
+    }
+    pid_t pid = fork();
+    if (pid == 0) {
+        dup2(pipeFds[1], STDOUT_FILENO);
+        close(pipeFds[0]);
+        execl(binary, binary, "Bench", (char *) NULL);
+        _exit(1);
+    }
+    close(pipeFds[1]);
+    FILE *out = fdopen(pipeFds[0], "r");
+    if (fscanf(out, "%d", port) != 1) {
+        fprintf(stderr, "could not start %s\n", binary);
+        exit(1);
+    }
+    fclose(out);
+    return pid;
+}
+
+int main(int argc, char **argv) {
+    const char *binary = argc > 1 ? argv[1] : "./2310depot";
+    int perClient = argc > 2 ? atoi(argv[2])
+            : STORM_CONNECTIONS;
+    int maxAcceptors = argc > 3 ? atoi(argv[3]) : 8;
+
+    bench_header();
+    printf("# %d clients, %d connections each\n", STORM_CLIENTS, perClient);
+    for (int acceptors = 1; acceptors <= maxAcceptors; acceptors *= 2) {
+        Storm storm;
+        storm.perClient = perClient;
+        pid_t pid = start_depot(binary, acceptors, &storm.port);
+        char label[32];
+        snprintf(label, sizeof(label), "acceptors=%d", acceptors);
+        bench_report("accept", label, "conn/s", bench_median(time_storm,
+                &storm));
+        kill(pid, SIGKILL);
+        waitpid(pid, NULL, 0);
+    }
+    return 0;
+}
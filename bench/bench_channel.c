@@ -0,0 +1,78 @@
+#include "../channel.h"
+#include "bench.h"
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+
+// Total messages pushed through the channel for each producer count.
+#define TOTAL_MESSAGES 4000000
+
+// struct for each producer thread
+typedef struct {
+    struct Channel *channel;
+    long count;
+} Producer;
+
+/**
+ * Function for a producer to write its share of messages
+ * @param data - void pointer (parsed to Producer struct)
+ * @return void pointer
+ */
+static void *produce(void *data) {
+    Producer *producer = (Producer *) data;
+    for (long i = 1; i <= producer->count; i++) {
+        write_channel(producer->channel, (void *) i);
+    }
+    return NULL;
+}
+
+/**
+ * Function to time TOTAL_MESSAGES passing through one channel
+ * @param argument - void pointer (parsed to the number of producer threads)
+ * @return messages per second seen by the consumer
+ */
+static double run(void *argument) {
+    int producers = *(int *) argument;
+    struct Channel *channel = new_channel();
+    pthread_t *tids = malloc(sizeof(pthread_t) * producers);
+    Producer *args = malloc(sizeof(Producer) * producers);
+    long perProducer = TOTAL_MESSAGES / producers;
+
+    double start = bench_now();
+    for (int i = 0; i < producers; i++) {
+        args[i].channel = channel;
+        args[i].count = perProducer;
+        pthread_create(&tids[i], NULL, produce, &args[i]);
+    }
+
+    // consume everything, sleeping whenever the channel runs dry
+    long received = 0;
+    void *data;
+    while (received < perProducer * producers) {
+        wait_channel(channel);
+        while (read_channel(channel, &data)) {
+            received++;
+        }
+    }
+    double elapsed = bench_now() - start;
+
+    for (int i = 0; i < producers; i++) {
+        pthread_join(tids[i], NULL);
+    }
+    destroy_channel(channel, NULL);
+    free(tids);
+    free(args);
+    return received / elapsed;
+}
+
+int main(int argc, char **argv) {
+    int maxProducers = argc > 1 ? atoi(argv[1]) : 64;
+    bench_header();
+    for (int producers = 1; producers <= maxProducers; producers *= 2) {
+        char label[32];
+        snprintf(label, sizeof(label), "producers=%d", producers);
+        bench_report("channel", label, "msgs/sec",
+                bench_median(run, &producers));
+    }
+    return 0;
+}
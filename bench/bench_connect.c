@@ -0,0 +1,257 @@
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <pthread.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <sys/time.h>
+#include <time.h>
+#include <unistd.h>
+
+// Ports which accept no more connections (their backlog is full).
+#define SLOW_PORTS 8
+// Ports with nothing listening on them.
+#define DEAD_PORTS 8
+// Pause between the Connects sent while probing, in microseconds.
+#define CONNECT_GAP 500
+// Seconds a probe may take before the depot counts as stalled.
+#define PROBE_TIMEOUT 5
+
+// struct for the thread sending Connects while the probes run
+typedef struct {
+    int socket;
+    int *ports;
+    int portCount;
+    volatile int running;
+    long sent;
+} Flooder;
+
+/**
+ * Function to get the current time in seconds
+ * @return monotonic time in seconds
+ */
+static double now(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+/**
+ * Function to open a listening socket on a free port of localhost
+ * @param backlog - listen backlog
+ * @param port - set to the port chosen
+ * @return FD of the socket
+ */
+static int listen_anywhere(int backlog, int *port) {
+    struct sockaddr_in address;
+    socklen_t length = sizeof(address);
+    memset(&address, 0, sizeof(address));
+    address.sin_family = AF_INET;
+    address.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    int fd = socket(AF_INET, SOCK_STREAM, 0);
+    bind(fd, (struct sockaddr *) &address, sizeof(address));
+    listen(fd, backlog);
+    getsockname(fd, (struct sockaddr *) &address, &length);
+    *port = ntohs(address.sin_port);
+    return fd;
+}
+
+/**
+ * Function to connect to a port of localhost
+ * @param port - port to connect to
+ * @param flags - extra socket type flags (such as SOCK_NONBLOCK)
+ * @return FD of the socket
+ */
+static int connect_to(int port, int flags) {
+    struct sockaddr_in address;
+    memset(&address, 0, sizeof(address));
+    address.sin_family = AF_INET;
+    address.sin_port = htons(port);
+    address.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    int fd = socket(AF_INET, SOCK_STREAM | flags, 0);
+    connect(fd, (struct sockaddr *) &address, sizeof(address));
+    return fd;
+}
+
+/**
+ * Function to make a port which never finishes a handshake: it listens, but
+ * its accept queue is filled and never drained, so new SYNs are dropped
+ * @return the port
+ */
+static int slow_port(void) {
+    int port;
+    listen_anywhere(0, &port);
+    for (int i = 0; i < 2; i++) {
+        connect_to(port, SOCK_NONBLOCK);
+    }
+    usleep(10000); // let the handshakes fill the queue
+    return port;
+}
+
+/**
+ * Function to find a port with nothing listening on it
+ * @return the port
+ */
+static int dead_port(void) {
+    int port;
+    close(listen_anywhere(1, &port));
+    return port;
+}
+
+/**
+ * Function to start a depot and connect to it
+ * @param binary - path of the depot executable
+ * @param pid - set to the depot's process id
+ * @param port - set to the depot's listening port
+ * @return FD of a socket connected to the depot (greeting already read)
+ */
+static int start_depot(const char *binary, pid_t *pid, int *port) {
+    int pipeFds[2];
+    if (pipe(pipeFds) != 0) {
+        exit(1);
+    }
+    *pid = fork();
+    if (*pid == 0) {
+        dup2(pipeFds[1], STDOUT_FILENO);
+        close(pipeFds[0]);
+        execl(binary, binary, "Bench", (char *) NULL);
+        _exit(1);
+    }
+    close(pipeFds[1]);
+    FILE *out = fdopen(pipeFds[0], "r");
+    if (fscanf(out, "%d", port) != 1) {
+        fprintf(stderr, "could not start %s\n", binary);
+        exit(1);
+    }
+
+    int fd = connect_to(*port, 0);
+    char greeting[256];
+    if (read(fd, greeting, sizeof(greeting)) <= 0) {
+        exit(1);
+    }
+    return fd;
+}
+
+/**
+ * Function for the flooding thread to keep sending Connects to slow and
+ * dead ports
+ * @param data - void pointer (parsed to Flooder struct)
+ * @return void pointer
+ */
+static void *flood(void *data) {
+    Flooder *flooder = (Flooder *) data;
+    char line[32];
+    while (flooder->running) {
+        int port = flooder->ports[flooder->sent % flooder->portCount];
+        int length = snprintf(line, sizeof(line), "Connect:%d\n", port);
+        if (write(flooder->socket, line, length) != length) {
+            break;
+        }
+        flooder->sent++;
+        usleep(CONNECT_GAP);
+    }
+    return NULL;
+}
+
+/**
+ * Function to compare two doubles for qsort
+ * @param a - first double
+ * @param b - second double
+ * @return negative, zero or positive as a is less, equal or greater
+ */
+static int compare(const void *a, const void *b) {
+    double x = *(const double *) a;
+    double y = *(const double *) b;
+    return (x > y) - (x < y);
+}
+
+/**
+ * Function to time Delivers, each followed by a List so the worker's reply
+ * shows when it was processed
+ * @param fd - socket connected to the depot
+ * @param probes - number of Delivers to time
+ * @param latencies - filled with the latency of each probe, in seconds
+ * @return number of probes answered (less than probes if the depot stalled)
+ */
+static int probe(int fd, int probes, double *latencies) {
+    const char request[] = "Deliver:1:probe\nList:probe\n";
+    char reply[256];
+    for (int i = 0; i < probes; i++) {
+        double start = now();
+        if (write(fd, request, sizeof(request) - 1) < 0) {
+            return i;
+        }
+        // the reply is "Listed:1" then the item's line
+        int newlines = 0;
+        while (newlines < 2) {
+            ssize_t got = read(fd, reply, sizeof(reply));
+            if (got <= 0) {
+                return i; // timed out
+            }
+            for (int j = 0; j < got; j++) {
+                newlines += reply[j] == '\n';
+            }
+        }
+        latencies[i] = now() - start;
+    }
+    return probes;
+}
+
+/**
+ * Function to print the spread of a run's latencies
+ * @param label - name of the run
+ * @param latencies - latency of each answered probe, in seconds
+ * @param answered - number of answered probes
+ * @param probes - number of probes sent
+ */
+static void report(const char *label, double *latencies, int answered,
+        int probes) {
+    if (answered == 0) {
+        printf("%-16s %10s %10s %10s %8d\n", label, "-", "-", "-", probes);
+        return;
+    }
+    qsort(latencies, answered, sizeof(double), compare);
+    printf("%-16s %10.1f %10.1f %10.1f %8d\n", label,
+            latencies[answered / 2] * 1e6,
+            latencies[answered * 99 / 100] * 1e6,
+            latencies[answered - 1] * 1e6, probes - answered);
+}
+
+int main(int argc, char **argv) {
+    const char *binary = argc > 1 ? argv[1] : "./2310depot";
+    int probes = argc > 2 ? atoi(argv[2]) : 2000;
+    signal(SIGPIPE, SIG_IGN);
+
+    pid_t pid;
+    int port;
+    int fd = start_depot(binary, &pid, &port);
+    struct timeval timeout = {PROBE_TIMEOUT, 0};
+    setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+    double *latencies = malloc(sizeof(double) * probes);
+
+    printf("%-16s %10s %10s %10s %8s\n", "run", "p50 us", "p99 us",
+            "max us", "stalled");
+    report("idle", latencies, probe(fd, probes, latencies), probes);
+
+    int ports[SLOW_PORTS + DEAD_PORTS];
+    for (int i = 0; i < SLOW_PORTS; i++) {
+        ports[i] = slow_port();
+    }
+    for (int i = 0; i < DEAD_PORTS; i++) {
+        ports[SLOW_PORTS + i] = dead_port();
+    }
+    Flooder flooder = {connect_to(port, 0), ports, SLOW_PORTS + DEAD_PORTS,
+            1, 0};
+    pthread_t tid;
+    pthread_create(&tid, NULL, flood, &flooder);
+    report("with Connects", latencies, probe(fd, probes, latencies), probes);
+    flooder.running = 0;
+    pthread_join(tid, NULL);
+    printf("%ld Connects sent\n", flooder.sent);
+
+    kill(pid, SIGKILL);
+    free(latencies);
+    return 0;
+}
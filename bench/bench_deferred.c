@@ -0,0 +1,141 @@
+#include "../deferred.h"
+#include "../inventory.h"
+#include "bench.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+// Commands deferred under each key.
+#define PER_KEY 4
+// Most keys deferred or executed per run.
+#define OPERATIONS 200000
+// Distinct items the commands are spread over.
+#define ITEMS 1000
+// Stride through the keys (prime, so it visits count distinct keys).
+#define KEY_STRIDE 7919
+
+// struct for a store holding a number of keys, as Execute finds it
+typedef struct {
+    DeferredStore store;
+    Inventory inventory;
+    int keys;
+    char (*names)[24];
+    unsigned int seed;
+} Backlog;
+
+/**
+ * Function to defer PER_KEY Deliver and Withdraw commands under a key
+ * @param backlog - Backlog to add to
+ * @param key - deferral key
+ */
+static void defer_key(Backlog *backlog, int key) {
+    for (int i = 0; i < PER_KEY; i++) {
+        int item = rand_r(&backlog->seed) % ITEMS;
+        Deferred command;
+        command.verb = (i & 1) ? WITHDRAW : DELIVER;
+        command.quantity = 1;
+        command.shard = 0;
+        command.names = backlog->names[item];
+        command.item.start = backlog->names[item];
+        command.item.length = strlen(backlog->names[item]);
+        command.target.start = NULL;
+        command.target.length = 0;
+        add_deferred(&backlog->store, key, &command);
+    }
+}
+
+/**
+ * Function to time Execute's work with the store holding every key: taking
+ * a key's commands and applying them to the inventory. The keys taken are
+ * deferred again afterwards (untimed), so the store keeps its size.
+ * @param data - void pointer (parsed to Backlog struct)
+ * @return nanoseconds per key executed
+ */
+static double time_execute(void *data) {
+    Backlog *backlog = (Backlog *) data;
+    int count = backlog->keys < OPERATIONS ? backlog->keys : OPERATIONS;
+    // visit keys in a scattered order, as Executes arrive
+    long step = KEY_STRIDE;
+    double start = bench_now();
+    for (int i = 0; i < count; i++) {
+        int key = (int) (i * step % backlog->keys);
+        Deferred *commands;
+        int taken = take_deferred(&backlog->store, key, &commands);
+        for (int j = 0; j < taken; j++) {
+            inventory_adjust(&backlog->inventory, commands[j].item.start,
+                    commands[j].item.length, commands[j].verb == DELIVER
+                    ? commands[j].quantity : -commands[j].quantity);
+        }
+        free(commands);
+    }
+    double elapsed = bench_now() - start;
+    for (int i = 0; i < count; i++) {
+        defer_key(backlog, (int) (i * step % backlog->keys));
+    }
+    return elapsed * 1e9 / count;
+}
+
+/**
+ * Function to time deferring commands under new keys with the store holding
+ * every key. The new keys are taken afterwards (untimed).
+ * @param data - void pointer (parsed to Backlog struct)
+ * @return nanoseconds per command deferred
+ */
+static double time_defer(void *data) {
+    Backlog *backlog = (Backlog *) data;
+    int count = OPERATIONS / PER_KEY;
+    double start = bench_now();
+    for (int i = 0; i < count; i++) {
+        defer_key(backlog, backlog->keys + i);
+    }
+    double elapsed = bench_now() - start;
+    for (int i = 0; i < count; i++) {
+        Deferred *commands;
+        take_deferred(&backlog->store, backlog->keys + i, &commands);
+        free(commands);
+    }
+    return elapsed * 1e9 / (count * PER_KEY);
+}
+
+/**
+ * Function to free a store and every command left in it
+ * @param store - DeferredStore to free
+ */
+static void free_store(DeferredStore *store) {
+    for (int i = 0; i < store->capacity; i++) {
+        free(store->groups[i].commands);
+    }
+    free(store->groups);
+}
+
+int main(int argc, char **argv) {
+    int maxKeys = argc > 1 ? atoi(argv[1]) : 1000000;
+    char (*names)[24] = malloc(sizeof(*names) * ITEMS);
+    for (int i = 0; i < ITEMS; i++) {
+        snprintf(names[i], sizeof(names[i]), "pallet-%d", i);
+    }
+
+    bench_header();
+    for (int keys = 1000; keys <= maxKeys; keys *= 10) {
+        Backlog backlog;
+        init_deferred(&backlog.store);
+        init_inventory(&backlog.inventory);
+        backlog.keys = keys;
+        backlog.names = names;
+        backlog.seed = 2310;
+        for (int key = 0; key < keys; key++) {
+            defer_key(&backlog, key);
+        }
+
+        char label[32];
+        snprintf(label, sizeof(label), "keys=%d", keys);
+        bench_report("deferred.execute", label, "ns/key",
+                bench_median(time_execute, &backlog));
+        bench_report("deferred.defer", label, "ns/command",
+                bench_median(time_defer, &backlog));
+        destroy_inventory(&backlog.inventory);
+        free_store(&backlog.store);
+    }
+    free(names);
+    return 0;
+}
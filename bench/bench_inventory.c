@@ -0,0 +1,186 @@
+#include "../inventory.h"
+#include "bench.h"
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+
+// Operations timed at each catalogue size.
+#define OPERATIONS 4000000
+// Items updated by the threads sharing one inventory.
+#define SHARED_ITEMS 10000
+// Most threads sharing one inventory.
+#define MAX_THREADS 8
+
+// struct for a catalogue being timed
+typedef struct {
+    Inventory inventory;
+    char (*names)[24];
+    int *lengths;
+    int items;
+    unsigned int seed;
+    pthread_mutex_t lock; // taken for changes the inventory cannot make alone
+    int threads; // threads updating the catalogue at once
+    int lockFree; // 1 to update existing items with inventory_try_adjust
+} Catalogue;
+
+/**
+ * Function to time Deliver/Withdraw style updates on existing items
+ * @param data - void pointer (parsed to Catalogue struct)
+ * @return nanoseconds per update
+ */
+static double time_updates(void *data) {
+    Catalogue *catalogue = (Catalogue *) data;
+    // random updates which never hit zero
+    double start = bench_now();
+    for (int i = 0; i < OPERATIONS; i++) {
+        int pick = rand_r(&catalogue->seed) % catalogue->items;
+        inventory_adjust(&catalogue->inventory, catalogue->names[pick],
+                catalogue->lengths[pick], (i & 1) ? -1 : 2);
+    }
+    return (bench_now() - start) * 1e9 / OPERATIONS;
+}
+
+/**
+ * Function to time churn: items dropping to zero (reclaiming the slot) and
+ * coming back
+ * @param data - void pointer (parsed to Catalogue struct)
+ * @return nanoseconds per update
+ */
+static double time_churn(void *data) {
+    Catalogue *catalogue = (Catalogue *) data;
+    Inventory *inventory = &catalogue->inventory;
+    double start = bench_now();
+    for (int i = 0; i < OPERATIONS / 2; i++) {
+        int pick = rand_r(&catalogue->seed) % catalogue->items;
+        const char *name = catalogue->names[pick];
+        int length = catalogue->lengths[pick];
+        int count = inventory_count(inventory, inventory_find(inventory, name,
+                length));
+        inventory_adjust(inventory, name, length, -count);
+        inventory_adjust(inventory, name, length, count);
+    }
+    return (bench_now() - start) * 1e9 / OPERATIONS;
+}
+
+/**
+ * Function for one of several threads to update existing items
+ * @param data - void pointer (parsed to Catalogue struct)
+ * @return void pointer
+ */
+static void *update_shared(void *data) {
+    Catalogue *catalogue = (Catalogue *) data;
+    unsigned int seed = (unsigned int) pthread_self();
+    for (int i = 0; i < OPERATIONS / catalogue->threads; i++) {
+        int pick = rand_r(&seed) % catalogue->items;
+        int delta = (i & 1) ? -1 : 2;
+        if (catalogue->lockFree && inventory_try_adjust(
+                &catalogue->inventory, catalogue->names[pick],
+                catalogue->lengths[pick], delta)) {
+            continue;
+        }
+        pthread_mutex_lock(&catalogue->lock);
+        inventory_adjust(&catalogue->inventory, catalogue->names[pick],
+                catalogue->lengths[pick], delta);
+        pthread_mutex_unlock(&catalogue->lock);
+    }
+    return NULL;
+}
+
+/**
+ * Function to time several threads updating existing items at once
+ * @param data - void pointer (parsed to Catalogue struct)
+ * @return nanoseconds per update (wall time over all threads)
+ */
+static double time_shared(void *data) {
+    Catalogue *catalogue = (Catalogue *) data;
+    pthread_t tids[MAX_THREADS];
+    double start = bench_now();
+    for (int i = 0; i < catalogue->threads; i++) {
+        pthread_create(&tids[i], NULL, update_shared, catalogue);
+    }
+    for (int i = 0; i < catalogue->threads; i++) {
+        pthread_join(tids[i], NULL);
+    }
+    return (bench_now() - start) * 1e9 / OPERATIONS;
+}
+
+/**
+ * Function to build a catalogue of items, each stored with a count of one
+ * @param catalogue - Catalogue to fill in
+ * @param items - number of distinct items in the catalogue
+ */
+static void build(Catalogue *catalogue, int items) {
+    init_inventory(&catalogue->inventory);
+    catalogue->items = items;
+    catalogue->seed = 2310;
+    pthread_mutex_init(&catalogue->lock, NULL);
+
+    // pre-build names so formatting is not timed
+    catalogue->names = malloc(sizeof(*catalogue->names) * items);
+    catalogue->lengths = malloc(sizeof(int) * items);
+    for (int i = 0; i < items; i++) {
+        catalogue->lengths[i] = snprintf(catalogue->names[i],
+                sizeof(catalogue->names[i]), "pallet-%d", i);
+        inventory_adjust(&catalogue->inventory, catalogue->names[i],
+                catalogue->lengths[i], 1);
+    }
+}
+
+/**
+ * Function to free a catalogue
+ * @param catalogue - Catalogue to free
+ */
+static void destroy(Catalogue *catalogue) {
+    destroy_inventory(&catalogue->inventory);
+    pthread_mutex_destroy(&catalogue->lock);
+    free(catalogue->names);
+    free(catalogue->lengths);
+}
+
+/**
+ * Function to time updates and churn at one catalogue size
+ * @param items - number of distinct items in the catalogue
+ */
+static void run(int items) {
+    Catalogue catalogue;
+    build(&catalogue, items);
+
+    char label[32];
+    snprintf(label, sizeof(label), "items=%d", items);
+    bench_report("inventory.update", label, "ns/op",
+            bench_median(time_updates, &catalogue));
+    bench_report("inventory.churn", label, "ns/op",
+            bench_median(time_churn, &catalogue));
+    destroy(&catalogue);
+}
+
+/**
+ * Function to time threads sharing one inventory, with every update under
+ * a lock and with existing items updated lock-free
+ */
+static void run_shared(void) {
+    Catalogue catalogue;
+    build(&catalogue, SHARED_ITEMS);
+    for (int threads = 1; threads <= MAX_THREADS; threads *= 2) {
+        char label[32];
+        snprintf(label, sizeof(label), "threads=%d", threads);
+        catalogue.threads = threads;
+        catalogue.lockFree = 0;
+        bench_report("inventory.locked", label, "ns/op",
+                bench_median(time_shared, &catalogue));
+        catalogue.lockFree = 1;
+        bench_report("inventory.lockfree", label, "ns/op",
+                bench_median(time_shared, &catalogue));
+    }
+    destroy(&catalogue);
+}
+
+int main(int argc, char **argv) {
+    int maxItems = argc > 1 ? atoi(argv[1]) : 1000000;
+    bench_header();
+    for (int items = 1000; items <= maxItems; items *= 10) {
+        run(items);
+    }
+    run_shared();
+    return 0;
+}
@@ -0,0 +1,93 @@
+#include "../2310depot.h"
+#include "../shard.h"
+#include "bench.h"
+#include <stdio.h>
+#include <stdlib.h>
+
+// Items listed (over however many runs that takes) per measurement.
+#define LISTED 4000000
+
+// struct for the depot being listed, and what to list
+typedef struct {
+    Depot depot;
+    FILE *out;
+    const char *prefix;
+    int length;
+    int items; // items listed by each run
+} Listing;
+
+/**
+ * Function to time write_items, which answers List and the SIGHUP dump by
+ * merging each shard's items in order
+ * @param data - void pointer (parsed to Listing struct)
+ * @return nanoseconds per item listed
+ */
+static double time_list(void *data) {
+    Listing *listing = (Listing *) data;
+    int runs = LISTED / listing->items + 1;
+    long written = 0;
+    double start = bench_now();
+    for (int i = 0; i < runs; i++) {
+        written += write_items(&listing->depot, listing->prefix,
+                listing->length, listing->out, "Item:%s:%d\n");
+    }
+    double elapsed = bench_now() - start;
+    return elapsed * 1e9 / (written > 0 ? written : 1);
+}
+
+/**
+ * Function to time listing every item, and the items under one prefix, of a
+ * depot with its items split over some shards
+ * @param items - number of items
+ * @param shards - number of shards (workers)
+ * @param out - stream to list to
+ */
+static void run(int items, int shards, FILE *out) {
+    Listing listing;
+    memset(&listing, 0, sizeof(listing));
+    listing.depot.shardCount = shards;
+    listing.depot.shards = calloc(shards, sizeof(Shard));
+    for (int i = 0; i < shards; i++) {
+        init_inventory(&listing.depot.shards[i].inventory);
+    }
+    // names are added in a random order (the inventory copies them)
+    char name[24];
+    unsigned int seed = 2310;
+    for (int i = 0; i < items; i++) {
+        int length = snprintf(name, sizeof(name), "pallet-%d", rand_r(&seed));
+        inventory_adjust(&shard_for(&listing.depot, name, length)->inventory,
+                name, length, 1 + i % 7);
+    }
+    listing.out = out;
+
+    char label[48];
+    snprintf(label, sizeof(label), "items=%d,shards=%d", items, shards);
+    listing.prefix = "";
+    listing.length = 0;
+    listing.items = items;
+    bench_report("list.all", label, "ns/item",
+            bench_median(time_list, &listing));
+    // about a tenth of the names start with each digit
+    listing.prefix = "pallet-1";
+    listing.length = 8;
+    listing.items = items / 9 + 1;
+    bench_report("list.prefix", label, "ns/item",
+            bench_median(time_list, &listing));
+
+    for (int i = 0; i < shards; i++) {
+        destroy_inventory(&listing.depot.shards[i].inventory);
+    }
+    free(listing.depot.shards);
+}
+
+int main(int argc, char **argv) {
+    int maxItems = argc > 1 ? atoi(argv[1]) : 1000000;
+    FILE *out = fopen("/dev/null", "w");
+    bench_header();
+    for (int items = 1000; items <= maxItems; items *= 10) {
+        run(items, 1, out);
+        run(items, 4, out);
+    }
+    fclose(out);
+    return 0;
+}
@@ -0,0 +1,100 @@
+#include "../parse.h"
+#include "bench.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+// Lines parsed per run.
+#define LINES 20000000
+
+// A mix of the traffic a depot sees, most of it Deliver and Withdraw.
+static const char *mix[] = {
+    "Deliver:12:pallet-3041\n",
+    "Withdraw:3:pallet-17\n",
+    "Deliver:1:crate\n",
+    "Withdraw:250:pallet-3041\n",
+    "Transfer:4:crate:Brisbane\n",
+    "Defer:42:Deliver:10:pallet-9\n",
+    "Execute:42\n",
+    "Deliver:bad:crate\n"
+};
+
+// The lines of the mix timed on their own, by what they exercise.
+static const struct {
+    const char *label;
+    int line;
+} cases[] = {
+    {"deliver", 0}, {"withdraw", 1}, {"transfer", 4}, {"defer", 5},
+    {"execute", 6}, {"malformed", 7}
+};
+
+// struct for the lines one run parses
+typedef struct {
+    const char **lines;
+    int *lengths;
+    int kinds; // lines are parsed in turn
+    long count;
+    long good; // well formed lines seen (so the parse is not optimised away)
+} Run;
+
+/**
+ * Function to time parse_command over a set of lines
+ * @param data - void pointer (parsed to Run struct)
+ * @return nanoseconds per line
+ */
+static double time_parse(void *data) {
+    Run *run = (Run *) data;
+    Arena arena;
+    init_arena(&arena, 4096);
+    Command command;
+    double start = bench_now();
+    for (long i = 0; i < run->count; i++) {
+        int pick = i % run->kinds;
+        run->good += parse_command(&arena, run->lines[pick],
+                run->lengths[pick], &command) == 0;
+        arena_reset(&arena);
+    }
+    double elapsed = bench_now() - start;
+    destroy_arena(&arena);
+    return elapsed * 1e9 / run->count;
+}
+
+/**
+ * Function to time parse_batch, which every line is checked with first
+ * @param data - void pointer (parsed to Run struct)
+ * @return nanoseconds per line
+ */
+static double time_batch(void *data) {
+    Run *run = (Run *) data;
+    double start = bench_now();
+    for (long i = 0; i < run->count; i++) {
+        int pick = i % run->kinds;
+        run->good += parse_batch(run->lines[pick], run->lengths[pick]) >= 0;
+    }
+    return (bench_now() - start) * 1e9 / run->count;
+}
+
+int main(int argc, char **argv) {
+    long lines = argc > 1 ? atol(argv[1]) : LINES;
+    int kinds = sizeof(mix) / sizeof(mix[0]);
+    int lengths[sizeof(mix) / sizeof(mix[0])];
+    for (int i = 0; i < kinds; i++) {
+        lengths[i] = strlen(mix[i]);
+    }
+
+    bench_header();
+    Run run = {mix, lengths, kinds, lines, 0};
+    bench_report("parse", "mix", "ns/line", bench_median(time_parse, &run));
+    for (int i = 0; i < (int) (sizeof(cases) / sizeof(cases[0])); i++) {
+        Run single = {&mix[cases[i].line], &lengths[cases[i].line], 1,
+                lines / kinds, 0};
+        bench_report("parse", cases[i].label, "ns/line",
+                bench_median(time_parse, &single));
+        run.good += single.good;
+    }
+    bench_report("parse_batch", "mix", "ns/line",
+            bench_median(time_batch, &run));
+    // keep the parse from being optimised away
+    fprintf(stderr, "%ld well formed\n", run.good);
+    return 0;
+}
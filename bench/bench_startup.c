@@ -0,0 +1,163 @@
+#include "../stock.h"
+#include "bench.h"
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+// Smallest catalogue loaded (each run is ten times the last).
+#define FIRST_ITEMS 10000
+
+// struct for one startup being timed
+typedef struct {
+    const char *binary;
+    const char *stock; // stock file, NULL for none
+} Startup;
+
+/**
+ * Function to write a varint (as frame.h encodes them)
+ * @param out - stream to write to
+ * @param value - number to write
+ */
+static void write_varint(FILE *out, unsigned int value) {
+    while (value >= 0x80) {
+        fputc((value & 0x7F) | 0x80, out);
+        value >>= 7;
+    }
+    fputc(value, out);
+}
+
+/**
+ * Function to write a catalogue to a stock file
+ * @param path - path of the file
+ * @param items - number of distinct items
+ * @param binary - 1 for the binary form, 0 for text
+ */
+static void write_stock(const char *path, int items, int binary) {
+    FILE *out = fopen(path, "w");
+    if (out == NULL) {
+        perror(path);
+        exit(1);
+    }
+    if (binary) {
+        fwrite(STOCK_MAGIC, 1, STOCK_MAGIC_LENGTH, out);
+        fputc(STOCK_VERSION, out);
+        write_varint(out, items);
+    }
+    char name[32];
+    for (int i = 0; i < items; i++) {
+        int length = snprintf(name, sizeof(name), "pallet-%d", i);
+        if (binary) {
+            write_varint(out, length);
+            fwrite(name, 1, length, out);
+            write_varint(out, i % 1000 + 1);
+        } else {
+            fprintf(out, "%s %d\n", name, i % 1000 + 1);
+        }
+    }
+    fclose(out);
+}
+
+/**
+ * Function to try to read a depot's greeting
+ * @param port - port the depot listens on
+ * @return 1 once the depot has accepted and greeted a connection, 0 if it is
+ * not listening yet
+ */
+static int greeted(int port) {
+    struct sockaddr_in address;
+    memset(&address, 0, sizeof(address));
+    address.sin_family = AF_INET;
+    address.sin_port = htons(port);
+    address.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    int fd = socket(AF_INET, SOCK_STREAM, 0);
+    char greeting[256];
+    int ready = connect(fd, (struct sockaddr *) &address, sizeof(address))
+            == 0 && read(fd, greeting, sizeof(greeting)) > 0;
+    close(fd);
+    return ready;
+}
+
+/**
+ * Function to time a depot from being started until it greets a connection
+ * @param argument - void pointer (parsed to Startup struct)
+ * @return milliseconds taken
+ */
+static double time_startup(void *argument) {
+    Startup *startup = (Startup *) argument;
+    if (startup->stock != NULL) {
+        setenv("DEPOT_STOCK", startup->stock, 1);
+    } else {
+        unsetenv("DEPOT_STOCK");
+    }
+    int pipeFds[2];
+    if (pipe(pipeFds) != 0) {
+        exit(1);
+    }
+
+    double start = bench_now();
+    pid_t pid = fork();
+    if (pid == 0) {
+        dup2(pipeFds[1], STDOUT_FILENO);
+        close(pipeFds[0]);
+        execl(startup->binary, startup->binary, "Bench", (char *) NULL);
+        _exit(1);
+    }
+    close(pipeFds[1]);
+    FILE *out = fdopen(pipeFds[0], "r");
+    int port;
+    if (fscanf(out, "%d", &port) != 1) {
+        fprintf(stderr, "could not start %s\n", startup->binary);
+        exit(1);
+    }
+    while (!greeted(port)) {
+        usleep(100);
+    }
+    double elapsed = bench_now() - start;
+
+    kill(pid, SIGKILL);
+    waitpid(pid, NULL, 0);
+    fclose(out);
+    return elapsed * 1e3;
+}
+
+int main(int argc, char **argv) {
+    const char *binary = argc > 1 ? argv[1] : "./2310depot";
+    int maxItems = argc > 2 ? atoi(argv[2]) : 1000000;
+    char text[] = "/tmp/bench_stock.XXXXXX";
+    char packed[] = "/tmp/bench_stock.XXXXXX";
+    int textFd = mkstemp(text);
+    int packedFd = mkstemp(packed);
+    if (textFd < 0 || packedFd < 0) {
+        perror("mkstemp");
+        return 1;
+    }
+    close(textFd);
+    close(packedFd);
+
+    bench_header();
+    Startup startup = {binary, NULL};
+    bench_report("startup", "empty", "ms", bench_median(time_startup,
+            &startup));
+    for (int items = FIRST_ITEMS; items <= maxItems; items *= 10) {
+        write_stock(text, items, 0);
+        write_stock(packed, items, 1);
+        char label[32];
+        snprintf(label, sizeof(label), "text,items=%d", items);
+        startup.stock = text;
+        bench_report("startup", label, "ms", bench_median(time_startup,
+                &startup));
+        snprintf(label, sizeof(label), "binary,items=%d", items);
+        startup.stock = packed;
+        bench_report("startup", label, "ms", bench_median(time_startup,
+                &startup));
+    }
+    unlink(text);
+    unlink(packed);
+    return 0;
+}
@@ -0,0 +1,200 @@
+#include <arpa/inet.h>
+#include <dirent.h>
+#include <netinet/in.h>
+#include <pthread.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/wait.h>
+#include <time.h>
+#include <unistd.h>
+
+// Connections sending Delivers at once.
+#define CONNECTIONS 4
+// Distinct items the Delivers are spread over.
+#define ITEMS 1000
+
+// struct for each sending thread
+typedef struct {
+    int port;
+    long lines;
+} Sender;
+
+/**
+ * Function to get the current time in seconds
+ * @return monotonic time in seconds
+ */
+static double now(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+/**
+ * Function to connect to a port of localhost and read the depot's greeting
+ * @param port - port to connect to
+ * @return FD of the socket
+ */
+static int connect_to(int port) {
+    struct sockaddr_in address;
+    memset(&address, 0, sizeof(address));
+    address.sin_family = AF_INET;
+    address.sin_port = htons(port);
+    address.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    int fd = socket(AF_INET, SOCK_STREAM, 0);
+    char greeting[256];
+    if (connect(fd, (struct sockaddr *) &address, sizeof(address)) != 0
+            || read(fd, greeting, sizeof(greeting)) <= 0) {
+        perror("connect");
+        exit(1);
+    }
+    return fd;
+}
+
+/**
+ * Function to start a depot
+ * @param binary - path of the depot executable
+ * @param port - set to the depot's listening port
+ * @return the depot's process id
+ */
+static pid_t start_depot(const char *binary, int *port) {
+    int pipeFds[2];
+    if (pipe(pipeFds) != 0) {
+        exit(1);
+    }
+    pid_t pid = fork();
+    if (pid == 0) {
+        dup2(pipeFds[1], STDOUT_FILENO);
+        close(pipeFds[0]);
+        execl(binary, binary, "Bench", (char *) NULL);
+        _exit(1);
+    }
+    close(pipeFds[1]);
+    FILE *out = fdopen(pipeFds[0], "r");
+    if (fscanf(out, "%d", port) != 1) {
+        fprintf(stderr, "could not start %s\n", binary);
+        exit(1);
+    }
+    return pid;
+}
+
+/**
+ * Function for a sender to send its Delivers, then wait until the depot has
+ * applied them (its reply to a List comes after them)
+ * @param data - void pointer (parsed to Sender struct)
+ * @return void pointer
+ */
+static void *send_lines(void *data) {
+    Sender *sender = (Sender *) data;
+    int fd = connect_to(sender->port);
+    char *block = malloc(64 * 1024);
+    int used = 0;
+    for (long i = 0; i < sender->lines; i++) {
+        used += sprintf(block + used, "Deliver:1:item%ld\n", i % ITEMS);
+        if (used > 64 * 1024 - 64 || i == sender->lines - 1) {
+            if (write(fd, block, used) != used) {
+                break;
+            }
+            used = 0;
+        }
+    }
+    const char list[] = "List:none\n";
+    char reply[64];
+    if (write(fd, list, sizeof(list) - 1) < 0
+            || read(fd, reply, sizeof(reply)) <= 0) {
+        perror("list");
+    }
+    free(block);
+    close(fd);
+    return NULL;
+}
+
+/**
+ * Function to time a depot applying Delivers from several connections
+ * @param binary - path of the depot executable
+ * @param lines - total number of Delivers
+ * @return Delivers applied per second
+ */
+static double run(const char *binary, long lines) {
+    int port;
+    pid_t pid = start_depot(binary, &port);
+    pthread_t tids[CONNECTIONS];
+    Sender senders[CONNECTIONS];
+
+    double start = now();
+    for (int i = 0; i < CONNECTIONS; i++) {
+        senders[i].port = port;
+        senders[i].lines = lines / CONNECTIONS;
+        pthread_create(&tids[i], NULL, send_lines, &senders[i]);
+    }
+    for (int i = 0; i < CONNECTIONS; i++) {
+        pthread_join(tids[i], NULL);
+    }
+    double elapsed = now() - start;
+
+    kill(pid, SIGKILL);
+    waitpid(pid, NULL, 0);
+    return lines / CONNECTIONS * CONNECTIONS / elapsed;
+}
+
+/**
+ * Function to delete a log directory and the files in it
+ * @param path - path of the directory
+ */
+static void remove_directory(const char *path) {
+    DIR *directory = opendir(path);
+    if (directory == NULL) {
+        return;
+    }
+    struct dirent *entry;
+    char file[512];
+    while ((entry = readdir(directory)) != NULL) {
+        if (entry->d_name[0] != '.') {
+            snprintf(file, sizeof(file), "%s/%s", path, entry->d_name);
+            unlink(file);
+        }
+    }
+    closedir(directory);
+    rmdir(path);
+}
+
+int main(int argc, char **argv) {
+    const char *binary = argc > 1 ? argv[1] : "./2310depot";
+    long lines = argc > 2 ? atol(argv[2]) : 2000000;
+    char directory[] = "/tmp/bench_wal.XXXXXX";
+    if (mkdtemp(directory) == NULL) {
+        perror("mkdtemp");
+        return 1;
+    }
+    // every line must reach the worker the List is answered by
+    setenv("DEPOT_WORKERS", "1", 1);
+
+    printf("%-24s %15s %10s\n", "mode", "delivers/sec", "overhead");
+    unsetenv("DEPOT_WAL");
+    double memory = run(binary, lines);
+    printf("%-24s %15.0f %10s\n", "in memory", memory, "-");
+    fflush(stdout);
+
+    // (label, DEPOT_WAL_BATCH, DEPOT_WAL_US)
+    const char *modes[][3] = {
+        {"wal (default policy)", "512", "2000"},
+        {"wal batch 64", "64", "2000"},
+        {"wal batch 1", "1", "0"},
+    };
+    setenv("DEPOT_WAL", directory, 1);
+    for (int i = 0; i < (int) (sizeof(modes) / sizeof(modes[0])); i++) {
+        setenv("DEPOT_WAL_BATCH", modes[i][1], 1);
+        setenv("DEPOT_WAL_US", modes[i][2], 1);
+        double rate = run(binary, lines);
+        printf("%-24s %15.0f %9.1f%%\n", modes[i][0], rate,
+                (memory - rate) / memory * 100);
+        fflush(stdout);
+        remove_directory(directory);
+        mkdir(directory, 0700);
+    }
+    remove_directory(directory);
+    return 0;
+}
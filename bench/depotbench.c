@@ -0,0 +1,773 @@
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <pthread.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <sys/time.h>
+#include <sys/wait.h>
+#include <time.h>
+#include <unistd.h>
+
+// Most depots which can be launched or attached to.
+#define MAX_DEPOTS 64
+// Most probes a connection may have waiting for their reply.
+#define PROBE_WINDOW 4096
+// Operations written at once when running as fast as possible.
+#define CHUNK_OPS 256
+// Longest line an operation is written as.
+#define OP_LINE 128
+// Seconds a connection waits for the reply to a probe before giving up.
+#define REPLY_TIMEOUT 10
+// Line which acknowledges everything sent before it (no item starts with ~,
+// so the reply is always "Listed:0").
+#define PROBE_LINE "List:~\n"
+
+// kinds of operation in the mix
+typedef enum {
+    OP_DELIVER = 0,
+    OP_WITHDRAW = 1,
+    OP_TRANSFER = 2,
+    OP_DEFER = 3,
+    OP_EXECUTE = 4,
+    OP_KINDS = 5
+} OpKind;
+
+static const char *opNames[OP_KINDS] = {
+    "deliver", "withdraw", "transfer", "defer", "execute"
+};
+
+// struct for a depot under load
+typedef struct {
+    int port;
+    char name[64];
+    pid_t pid; // 0 if attached to rather than launched
+    int neighbours[MAX_DEPOTS]; // indexes of the depots it is connected to
+    int neighbourCount;
+} Target;
+
+// struct for the options of a run
+typedef struct {
+    const char *binary;
+    int depotCount;
+    const char *topology;
+    int connections; // per depot
+    int weights[OP_KINDS];
+    double rate; // operations per second over every connection, 0 for max
+    double seconds;
+    int items;
+    int probeEvery;
+    // probes a connection may have waiting before it stops sending, so a
+    // run as fast as possible measures the depot rather than its backlog
+    int window;
+    unsigned int seed;
+} Options;
+
+// struct for one connection: a writer sending operations and probes, and a
+// reader timing the replies to the probes
+typedef struct {
+    int index;
+    int fd;
+    Target *target;
+    Target *targets;
+    Options *options;
+    double rate; // operations per second on this connection (0 for max)
+
+    // when each waiting probe's operations were due, in nanoseconds (written
+    // by the writer, read by the reader)
+    long probeTimes[PROBE_WINDOW];
+    unsigned long probesSent;
+    unsigned long probesAnswered;
+    int finished; // 1 once the writer has sent its last probe
+
+    long counts[OP_KINDS];
+    long *latencies; // replies timed by the reader, in nanoseconds
+    long latencyCount;
+    long latencyCapacity;
+    long lastReply; // when the last reply arrived
+    int failed;
+} Client;
+
+/**
+ * Function to get the current time
+ * @return monotonic time in nanoseconds
+ */
+static long now_nanos(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000000L + ts.tv_nsec;
+}
+
+/**
+ * Function to sleep until a time
+ * @param nanos - monotonic time to wake at, in nanoseconds
+ */
+static void sleep_until(long nanos) {
+    struct timespec ts;
+    ts.tv_sec = nanos / 1000000000L;
+    ts.tv_nsec = nanos % 1000000000L;
+    while (clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &ts, NULL) != 0) {
+    }
+}
+
+/**
+ * Function to pick the next pseudo-random number (xorshift, so runs with the
+ * same seed send the same operations)
+ * @param state - generator state (non-zero)
+ * @return next number
+ */
+static unsigned int next_random(unsigned int *state) {
+    unsigned int x = *state;
+    x ^= x << 13;
+    x ^= x >> 17;
+    x ^= x << 5;
+    *state = x;
+    return x;
+}
+
+/**
+ * Function to connect to a port of localhost and read the depot's greeting
+ * @param port - port to connect to
+ * @param name - set to the depot's name (from its IM), if not NULL
+ * @return FD of the socket, -1 if the depot could not be reached
+ */
+static int connect_to(int port, char *name) {
+    struct sockaddr_in address;
+    memset(&address, 0, sizeof(address));
+    address.sin_family = AF_INET;
+    address.sin_port = htons(port);
+    address.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    int fd = socket(AF_INET, SOCK_STREAM, 0);
+    if (connect(fd, (struct sockaddr *) &address, sizeof(address)) != 0) {
+        close(fd);
+        return -1;
+    }
+    struct timeval timeout = {REPLY_TIMEOUT, 0};
+    setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+    // a probe waited on must not sit in the socket waiting for an ACK
+    int noDelay = 1;
+    setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &noDelay, sizeof(noDelay));
+
+    // read the IM one byte at a time, so nothing after it is consumed
+    char greeting[128];
+    int used = 0;
+    while (used < (int) sizeof(greeting) - 1) {
+        if (read(fd, greeting + used, 1) != 1) {
+            close(fd);
+            return -1;
+        }
+        if (greeting[used++] == '\n') {
+            break;
+        }
+    }
+    greeting[used] = '\0';
+    unsigned int imPort;
+    if (name != NULL && sscanf(greeting, "IM:%u:%63[^\n]", &imPort,
+            name) != 2) {
+        name[0] = '\0';
+    }
+    return fd;
+}
+
+/**
+ * Function to write all of a buffer to a socket
+ * @param fd - socket to write to
+ * @param data - bytes to write
+ * @param length - number of bytes
+ * @return 0 on success, -1 if the socket failed
+ */
+static int write_all(int fd, const char *data, int length) {
+    while (length > 0) {
+        ssize_t written = write(fd, data, length);
+        if (written <= 0) {
+            return -1;
+        }
+        data += written;
+        length -= written;
+    }
+    return 0;
+}
+
+/**
+ * Function to start a depot
+ * @param binary - path of the depot executable
+ * @param name - name to give it
+ * @param pid - set to the depot's process id
+ * @return the depot's port, or -1 if it did not start
+ */
+static int launch_depot(const char *binary, const char *name, pid_t *pid) {
+    int pipeFds[2];
+    if (pipe(pipeFds) != 0) {
+        return -1;
+    }
+    *pid = fork();
+    if (*pid == 0) {
+        dup2(pipeFds[1], STDOUT_FILENO);
+        close(pipeFds[0]);
+        execl(binary, binary, name, (char *) NULL);
+        _exit(1);
+    }
+    close(pipeFds[1]);
+    // keep the read end open, the depot writes its SIGHUP dumps there
+    FILE *out = fdopen(pipeFds[0], "r");
+    int port;
+    if (fscanf(out, "%d", &port) != 1) {
+        return -1;
+    }
+    return port;
+}
+
+/**
+ * Function to fill in the depots to load, launching them if needed
+ * @param options - Options of the run
+ * @param ports - ports to attach to (NULL to launch depots instead)
+ * @param targets - Target per depot to fill in
+ * @return 0 on success, -1 if a depot could not be started or reached
+ */
+static int start_targets(Options *options, int *ports, Target *targets) {
+    memset(targets, 0, sizeof(Target) * options->depotCount);
+    for (int i = 0; i < options->depotCount; i++) {
+        if (ports == NULL) {
+            snprintf(targets[i].name, sizeof(targets[i].name), "bench%d", i);
+            targets[i].port = launch_depot(options->binary, targets[i].name,
+                    &targets[i].pid);
+        } else {
+            targets[i].port = ports[i];
+        }
+        if (targets[i].port < 0) {
+            fprintf(stderr, "could not start %s\n", options->binary);
+            return -1;
+        }
+    }
+    for (int i = 0; i < options->depotCount; i++) {
+        int fd = connect_to(targets[i].port, targets[i].name);
+        if (fd < 0) {
+            fprintf(stderr, "could not reach port %d\n", targets[i].port);
+            return -1;
+        }
+        close(fd);
+    }
+    return 0;
+}
+
+/**
+ * Function to check whether a topology joins two depots
+ * @param topology - chain, ring, star, mesh or none
+ * @param count - number of depots
+ * @param from - index of the depot sending the Connect
+ * @param to - index of the depot connected to (greater than from)
+ * @return 1 if from should connect to to
+ */
+static int joined(const char *topology, int count, int from, int to) {
+    if (strcmp(topology, "chain") == 0) {
+        return to == from + 1;
+    } else if (strcmp(topology, "ring") == 0) {
+        return to == from + 1 || (from == 0 && to == count - 1 && count > 2);
+    } else if (strcmp(topology, "star") == 0) {
+        return from == 0;
+    } else if (strcmp(topology, "mesh") == 0) {
+        return 1;
+    }
+    return 0;
+}
+
+/**
+ * Function to connect the depots to each other with Connect (they exchange
+ * IMs themselves), and wait for them to do so
+ * @param options - Options of the run
+ * @param targets - Target per depot
+ * @return number of links made
+ */
+static int wire_topology(Options *options, Target *targets) {
+    int links = 0;
+    for (int from = 0; from < options->depotCount; from++) {
+        char commands[MAX_DEPOTS * 32];
+        int used = 0;
+        for (int to = from + 1; to < options->depotCount; to++) {
+            if (!joined(options->topology, options->depotCount, from, to)) {
+                continue;
+            }
+            used += sprintf(commands + used, "Connect:%d\n", targets[to].port);
+            targets[from].neighbours[targets[from].neighbourCount++] = to;
+            targets[to].neighbours[targets[to].neighbourCount++] = from;
+            links++;
+        }
+        if (used == 0) {
+            continue;
+        }
+        int fd = connect_to(targets[from].port, NULL);
+        // the reply to the probe comes once the Connects have been handled
+        char reply[64];
+        if (fd < 0 || write_all(fd, commands, used) != 0
+                || write_all(fd, PROBE_LINE, strlen(PROBE_LINE)) != 0
+                || read(fd, reply, sizeof(reply)) <= 0) {
+            fprintf(stderr, "could not wire depot %d\n", from);
+        }
+        close(fd);
+    }
+    if (links > 0) {
+        // Connects are made in the background, then IMs are exchanged
+        usleep(300000);
+    }
+    return links;
+}
+
+/**
+ * Function to parse an operation mix such as "deliver=60,transfer=40"
+ * @param text - mix to parse
+ * @param weights - weight per OpKind to fill in (kinds not named get 0)
+ * @return 0 on success, -1 if the mix is malformed
+ */
+static int parse_mix(const char *text, int *weights) {
+    char *copy = strdup(text);
+    int total = 0;
+    memset(weights, 0, sizeof(int) * OP_KINDS);
+    for (char *part = strtok(copy, ","); part != NULL;
+            part = strtok(NULL, ",")) {
+        char *equals = strchr(part, '=');
+        int kind = -1;
+        for (int i = 0; equals != NULL && i < OP_KINDS; i++) {
+            if (strncmp(part, opNames[i], equals - part) == 0
+                    && (int) strlen(opNames[i]) == equals - part) {
+                kind = i;
+            }
+        }
+        if (kind < 0 || atoi(equals + 1) < 0) {
+            free(copy);
+            return -1;
+        }
+        weights[kind] = atoi(equals + 1);
+        total += weights[kind];
+    }
+    free(copy);
+    return total > 0 ? 0 : -1;
+}
+
+/**
+ * Function to write the next operation of the mix
+ * @param client - Client sending it
+ * @param random - generator state
+ * @param openKey - deferral key Defers are added to (moved on by Execute)
+ * @param line - buffer for the line (OP_LINE bytes)
+ * @return number of characters written
+ */
+static int next_op(Client *client, unsigned int *random, int *openKey,
+        char *line) {
+    Options *options = client->options;
+    int total = 0;
+    for (int i = 0; i < OP_KINDS; i++) {
+        total += options->weights[i];
+    }
+    int pick = next_random(random) % total;
+    int kind = 0;
+    while (pick >= options->weights[kind]) {
+        pick -= options->weights[kind++];
+    }
+    int item = next_random(random) % options->items;
+    Target *target = client->target;
+    if (kind == OP_TRANSFER && target->neighbourCount == 0) {
+        kind = OP_DELIVER; // nowhere to send it
+    }
+    client->counts[kind]++;
+
+    switch (kind) {
+        case OP_WITHDRAW:
+            return sprintf(line, "Withdraw:1:item%d\n", item);
+        case OP_TRANSFER: {
+            Target *to = &client->targets[target->neighbours[
+                    next_random(random) % target->neighbourCount]];
+            return sprintf(line, "Transfer:1:item%d:%s\n", item, to->name);
+        }
+        case OP_DEFER:
+            return sprintf(line, "Defer:%d:Deliver:1:item%d\n", *openKey,
+                    item);
+        case OP_EXECUTE: {
+            int key = *openKey;
+            // keys are kept apart by the connection's index
+            *openKey += options->connections * options->depotCount;
+            return sprintf(line, "Execute:%d\n", key);
+        }
+        default:
+            return sprintf(line, "Deliver:1:item%d\n", item);
+    }
+}
+
+/**
+ * Function for a reader to time the reply to each probe
+ * @param data - void pointer (parsed to Client struct)
+ * @return void pointer
+ */
+static void *read_replies(void *data) {
+    Client *client = (Client *) data;
+    FILE *from = fdopen(dup(client->fd), "r");
+    char line[256];
+    while (1) {
+        // the last probe is counted before the writer finishes
+        int finished = __atomic_load_n(&client->finished, __ATOMIC_ACQUIRE);
+        if (finished && client->probesAnswered == __atomic_load_n(
+                &client->probesSent, __ATOMIC_ACQUIRE)) {
+            break;
+        }
+        if (fgets(line, sizeof(line), from) == NULL) {
+            client->failed = 1;
+            break;
+        }
+        if (strncmp(line, "Listed:", 7) != 0) {
+            continue; // the depot's greeting, or a Frames offer
+        }
+        long arrived = now_nanos();
+        long due = client->probeTimes[client->probesAnswered % PROBE_WINDOW];
+        if (client->latencyCount == client->latencyCapacity) {
+            client->latencyCapacity = client->latencyCapacity * 2 + 1024;
+            client->latencies = realloc(client->latencies,
+                    sizeof(long) * client->latencyCapacity);
+        }
+        client->latencies[client->latencyCount++] = arrived - due;
+        client->lastReply = arrived;
+        __atomic_store_n(&client->probesAnswered, client->probesAnswered + 1,
+                __ATOMIC_RELEASE);
+    }
+    fclose(from);
+    return NULL;
+}
+
+/**
+ * Function to add a probe to the end of a block of operations. If the
+ * connection already has its window of probes waiting, the block is written
+ * and the writer waits for a reply first.
+ * @param client - Client sending it
+ * @param block - block being built
+ * @param used - bytes used in the block
+ * @param due - when the operations it acknowledges were due, or -1 for when
+ * the probe is written
+ * @return bytes used in the block after the probe
+ */
+static int add_probe(Client *client, char *block, int used, long due) {
+    if (client->probesSent - __atomic_load_n(&client->probesAnswered,
+            __ATOMIC_ACQUIRE) >= client->options->window) {
+        if (write_all(client->fd, block, used) != 0) {
+            client->failed = 1;
+        }
+        used = 0;
+        while (client->probesSent - __atomic_load_n(&client->probesAnswered,
+                __ATOMIC_ACQUIRE) >= client->options->window
+                && !client->failed) {
+            usleep(20);
+        }
+    }
+    if (due < 0) {
+        due = now_nanos();
+    }
+    client->probeTimes[client->probesSent % PROBE_WINDOW] = due;
+    __atomic_store_n(&client->probesSent, client->probesSent + 1,
+            __ATOMIC_RELEASE);
+    memcpy(block + used, PROBE_LINE, strlen(PROBE_LINE));
+    return used + strlen(PROBE_LINE);
+}
+
+/**
+ * Function for a writer to send operations until the run ends. At a fixed
+ * rate each operation is due at a set time and latency is measured from
+ * then (so a depot which falls behind is charged for the wait); otherwise
+ * operations are written in blocks as fast as the socket takes them.
+ * @param data - void pointer (parsed to Client struct)
+ * @return void pointer
+ */
+static void *send_ops(void *data) {
+    Client *client = (Client *) data;
+    Options *options = client->options;
+    unsigned int random = options->seed * 2654435761u + client->index + 1;
+    int openKey = client->index;
+    char *block = malloc(CHUNK_OPS * (OP_LINE + sizeof(PROBE_LINE)));
+    long start = now_nanos();
+    long end = start + (long) (options->seconds * 1e9);
+    long sent = 0;
+
+    while (!client->failed) {
+        long now = now_nanos();
+        if (now >= end) {
+            break;
+        }
+        long due = CHUNK_OPS;
+        if (client->rate > 0) {
+            long next = start + (long) (sent * 1e9 / client->rate);
+            if (next > now) {
+                sleep_until(next < end ? next : end);
+                continue;
+            }
+            // everything due by now goes in one write
+            due = (long) ((now - start) * client->rate / 1e9) + 1 - sent;
+            due = due > CHUNK_OPS ? CHUNK_OPS : due;
+        }
+
+        int used = 0;
+        for (long i = 0; i < due; i++) {
+            used += next_op(client, &random, &openKey, block + used);
+            sent++;
+            if (sent % options->probeEvery == 0) {
+                long dueAt = client->rate > 0
+                        ? start + (long) ((sent - 1) * 1e9 / client->rate)
+                        : -1;
+                used = add_probe(client, block, used, dueAt);
+            }
+        }
+        if (write_all(client->fd, block, used) != 0) {
+            client->failed = 1;
+        }
+    }
+    // one last probe, so the run ends once everything sent is applied
+    int used = add_probe(client, block, 0, -1);
+    __atomic_store_n(&client->finished, 1, __ATOMIC_RELEASE);
+    if (!client->failed && write_all(client->fd, block, used) != 0) {
+        client->failed = 1;
+    }
+    free(block);
+    return NULL;
+}
+
+/**
+ * Function to compare two latencies for qsort
+ * @param a - first latency
+ * @param b - second latency
+ * @return negative, zero or positive as a is less than, equal to or greater
+ * than b
+ */
+static int compare_longs(const void *a, const void *b) {
+    long x = *(const long *) a;
+    long y = *(const long *) b;
+    return (x > y) - (x < y);
+}
+
+/**
+ * Function to find a percentile of sorted latencies
+ * @param sorted - latencies in ascending order
+ * @param count - number of latencies
+ * @param fraction - percentile wanted, between 0 and 1
+ * @return the latency in microseconds
+ */
+static double percentile(long *sorted, long count, double fraction) {
+    long index = (long) (fraction * count + 0.999999) - 1;
+    index = index < 0 ? 0 : (index >= count ? count - 1 : index);
+    return sorted[index] / 1000.0;
+}
+
+/**
+ * Function to print how to run the benchmark
+ * @param program - name the benchmark was run as
+ */
+static void usage(const char *program) {
+    fprintf(stderr, "Usage: %s [-d depot] [-n depots | -a port,port...] "
+            "[-t chain|ring|star|mesh|none]\n"
+            "\t[-c connections per depot] [-m deliver=n,withdraw=n,"
+            "transfer=n,defer=n,execute=n]\n"
+            "\t[-r ops/sec (0 for max)] [-s seconds] [-k items] "
+            "[-p ops per probe]\n\t[-w probes in flight] [-S seed]\n",
+            program);
+    exit(1);
+}
+
+/**
+ * Function to read the options of a run from the command line
+ * @param argc - number of arguments
+ * @param argv - arguments
+ * @param options - Options to fill in
+ * @param ports - ports to attach to (left alone if none are given)
+ * @return 1 if ports were given to attach to, 0 otherwise
+ */
+static int parse_options(int argc, char **argv, Options *options, int *ports) {
+    options->binary = "./2310depot";
+    options->depotCount = 2;
+    options->topology = "chain";
+    options->connections = 4;
+    parse_mix("deliver=60,withdraw=20,transfer=10,defer=5,execute=5",
+            options->weights);
+    options->rate = 0;
+    options->seconds = 5;
+    options->items = 1000;
+    options->probeEvery = 64;
+    options->window = 16;
+    options->seed = 1;
+
+    int attach = 0;
+    int option;
+    while ((option = getopt(argc, argv, "d:n:a:t:c:m:r:s:k:p:w:S:")) != -1) {
+        switch (option) {
+            case 'd':
+                options->binary = optarg;
+                break;
+            case 'n':
+                options->depotCount = atoi(optarg);
+                break;
+            case 'a':
+                options->depotCount = 0;
+                for (char *port = strtok(optarg, ","); port != NULL
+                        && options->depotCount < MAX_DEPOTS;
+                        port = strtok(NULL, ",")) {
+                    ports[options->depotCount++] = atoi(port);
+                }
+                attach = 1;
+                break;
+            case 't':
+                options->topology = optarg;
+                break;
+            case 'c':
+                options->connections = atoi(optarg);
+                break;
+            case 'm':
+                if (parse_mix(optarg, options->weights) != 0) {
+                    usage(argv[0]);
+                }
+                break;
+            case 'r':
+                options->rate = atof(optarg);
+                break;
+            case 's':
+                options->seconds = atof(optarg);
+                break;
+            case 'k':
+                options->items = atoi(optarg);
+                break;
+            case 'p':
+                options->probeEvery = atoi(optarg);
+                break;
+            case 'w':
+                options->window = atoi(optarg);
+                break;
+            case 'S':
+                options->seed = strtoul(optarg, NULL, 10);
+                break;
+            default:
+                usage(argv[0]);
+        }
+    }
+    if (options->depotCount < 1 || options->depotCount > MAX_DEPOTS
+            || options->connections < 1 || options->items < 1
+            || options->probeEvery < 1 || options->window < 1
+            || options->window > PROBE_WINDOW || options->seconds <= 0
+            || options->rate < 0) {
+        usage(argv[0]);
+    }
+    return attach;
+}
+
+/**
+ * Function to print what was sent and how long the replies took
+ * @param options - Options of the run
+ * @param clients - every Client
+ * @param clientCount - number of clients
+ * @param links - number of links between depots
+ * @param elapsed - seconds from the start until the last reply
+ */
+static void report(Options *options, Client *clients, int clientCount,
+        int links, double elapsed) {
+    long counts[OP_KINDS] = {0};
+    long total = 0;
+    long latencyCount = 0;
+    int failed = 0;
+    for (int i = 0; i < clientCount; i++) {
+        for (int kind = 0; kind < OP_KINDS; kind++) {
+            counts[kind] += clients[i].counts[kind];
+            total += clients[i].counts[kind];
+        }
+        latencyCount += clients[i].latencyCount;
+        failed += clients[i].failed;
+    }
+    long *latencies = malloc(sizeof(long) * (latencyCount + 1));
+    long used = 0;
+    for (int i = 0; i < clientCount; i++) {
+        memcpy(latencies + used, clients[i].latencies,
+                sizeof(long) * clients[i].latencyCount);
+        used += clients[i].latencyCount;
+    }
+    qsort(latencies, latencyCount, sizeof(long), compare_longs);
+
+    printf("depots %d (%s, %d links), connections %d, ", options->depotCount,
+            options->topology, links, clientCount);
+    if (options->rate > 0) {
+        printf("rate %.0f ops/sec, ", options->rate);
+    } else {
+        printf("rate max, ");
+    }
+    printf("%.1fs\n", options->seconds);
+    printf("%-10s %12s %14s\n", "op", "count", "ops/sec");
+    for (int kind = 0; kind < OP_KINDS; kind++) {
+        printf("%-10s %12ld %14.0f\n", opNames[kind], counts[kind],
+                counts[kind] / elapsed);
+    }
+    printf("%-10s %12ld %14.0f\n", "total", total, total / elapsed);
+    if (latencyCount > 0) {
+        printf("latency (us, %ld probes): p50 %.1f p99 %.1f p999 %.1f "
+                "max %.1f\n", latencyCount,
+                percentile(latencies, latencyCount, 0.5),
+                percentile(latencies, latencyCount, 0.99),
+                percentile(latencies, latencyCount, 0.999),
+                latencies[latencyCount - 1] / 1000.0);
+    }
+    if (failed) {
+        printf("%d connections failed before the run ended\n", failed);
+    }
+    free(latencies);
+}
+
+int main(int argc, char **argv) {
+    Options options;
+    int ports[MAX_DEPOTS];
+    int attach = parse_options(argc, argv, &options, ports);
+    signal(SIGPIPE, SIG_IGN);
+
+    Target targets[MAX_DEPOTS];
+    int status = 1;
+    if (start_targets(&options, attach ? ports : NULL, targets) != 0) {
+        goto stop;
+    }
+    int links = wire_topology(&options, targets);
+
+    // connections are spread evenly over the depots
+    int clientCount = options.connections * options.depotCount;
+    Client *clients = calloc(clientCount, sizeof(Client));
+    for (int i = 0; i < clientCount; i++) {
+        clients[i].index = i;
+        clients[i].target = &targets[i % options.depotCount];
+        clients[i].targets = targets;
+        clients[i].options = &options;
+        clients[i].rate = options.rate / clientCount;
+        clients[i].fd = connect_to(clients[i].target->port, NULL);
+        if (clients[i].fd < 0) {
+            fprintf(stderr, "could not reach port %d\n",
+                    clients[i].target->port);
+            goto stop;
+        }
+    }
+
+    pthread_t *writers = malloc(sizeof(pthread_t) * clientCount);
+    pthread_t *readers = malloc(sizeof(pthread_t) * clientCount);
+    long start = now_nanos();
+    for (int i = 0; i < clientCount; i++) {
+        pthread_create(&readers[i], NULL, read_replies, &clients[i]);
+        pthread_create(&writers[i], NULL, send_ops, &clients[i]);
+    }
+    long last = start;
+    for (int i = 0; i < clientCount; i++) {
+        pthread_join(writers[i], NULL);
+        pthread_join(readers[i], NULL);
+        last = clients[i].lastReply > last ? clients[i].lastReply : last;
+        close(clients[i].fd);
+    }
+    if (last == start) {
+        last = now_nanos(); // no replies at all
+    }
+    report(&options, clients, clientCount, links, (last - start) / 1e9);
+    status = 0;
+
+stop:
+    for (int i = 0; i < options.depotCount; i++) {
+        if (!attach && targets[i].pid > 0) {
+            kill(targets[i].pid, SIGKILL);
+            waitpid(targets[i].pid, NULL, 0);
+        }
+    }
+    return status;
+}
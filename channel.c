@@ -1,17 +1,29 @@
 #include "channel.h"
-#include "queue.h"
+#include "epoch.h"
+#include "futex.h"
 #include <stdlib.h>
 
+/**
+ * Function to allocate an empty segment
+ * @return struct Segment with every slot empty
+ */
+static struct Segment *new_segment(void) {
+    return calloc(1, sizeof(struct Segment));
+}
+
 /**
  * Function to create a channel for thread safe communication
  * @return struct Channel - the new channel
  */
 struct Channel *new_channel(void) {
     // malloc space
-    struct Channel *output = malloc(sizeof(struct Channel));
+    struct Channel *output = calloc(1, sizeof(struct Channel));
 
-    // create a new queue
-    output->inner = new_queue();
+    // start with a single segment shared by reader and writers
+    output->head = new_segment();
+    output->tail = output->head;
+    output->readIndex = 0;
+    output->sleeping = 0;
 
     return output;
 }
@@ -19,24 +31,115 @@ struct Channel *new_channel(void) {
 /**
  * Function to destroy a channel
  * @param channel - struct Channel to destroy
- * @param clean - function pointer to clean up elements within the queue
+ * @param clean - function pointer to clean up elements within the channel
  */
 void destroy_channel(struct Channel *channel, void (*clean)(void *)) {
-    destroy_queue(&channel->inner, clean);
+    void *data;
+    // remove all data
+    while (read_channel(channel, &data)) {
+        if (clean != NULL) {
+            clean(data);
+        }
+    }
+
+    struct Segment *segment = channel->head;
+    while (segment != NULL) {
+        struct Segment *next = segment->next;
+        free(segment);
+        segment = next;
+    }
+    free(channel);
+}
+
+/**
+ * Function to claim a slot and store data in it
+ * @param channel - struct Channel to write to
+ * @param data - void * data to write into the channel
+ * @return position of the slot claimed (from the start of the channel)
+ */
+static unsigned long claim_slot(struct Channel *channel, void *data) {
+    while (1) {
+        struct Segment *tail = __atomic_load_n(&channel->tail,
+                __ATOMIC_ACQUIRE);
+        unsigned int index = __atomic_fetch_add(&tail->claimed, 1,
+                __ATOMIC_ACQ_REL);
+        if (index < CHANNEL_SEGMENT) {
+            __atomic_store_n(&tail->slots[index], data, __ATOMIC_RELEASE);
+            return tail->base + index;
+        }
+
+        // segment full, link a new one (pre-filled with our data)
+        struct Segment *next = __atomic_load_n(&tail->next, __ATOMIC_ACQUIRE);
+        if (next == NULL) {
+            struct Segment *fresh = new_segment();
+            fresh->slots[0] = data;
+            fresh->claimed = 1;
+            fresh->base = tail->base + CHANNEL_SEGMENT;
+            if (__atomic_compare_exchange_n(&tail->next, &next, fresh, false,
+                    __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE)) {
+                __atomic_compare_exchange_n(&channel->tail, &tail, fresh,
+                        false, __ATOMIC_ACQ_REL, __ATOMIC_RELAXED);
+                return fresh->base;
+            }
+            // another writer linked first, next now holds its segment
+            free(fresh);
+        }
+        // help move the tail along before retrying
+        __atomic_compare_exchange_n(&channel->tail, &tail, next, false,
+                __ATOMIC_ACQ_REL, __ATOMIC_RELAXED);
+    }
 }
 
 /**
  * Function to write to the channel
  * @param channel - struct Channel to write to
  * @param data - void * data to write into the channel
- * @return false if unsuccessful
- *         true if successful
+ * @return 0 if data is NULL
+ *         writes up to and including this one if successful
  */
-bool write_channel(struct Channel *channel, void *data) {
-    // attempt to write to the queue
-    bool output = write_queue(&channel->inner, data);
+unsigned long write_channel(struct Channel *channel, void *data) {
+    if (data == NULL) {
+        return 0; // NULL marks an empty slot
+    }
 
-    return output;
+    // segments may be retired by the reader while we hold a pointer to one
+    epoch_enter();
+    unsigned long position = claim_slot(channel, data);
+    epoch_exit();
+
+    // wake the reader if it has gone (or is going) to sleep
+    __atomic_thread_fence(__ATOMIC_SEQ_CST);
+    if (__atomic_load_n(&channel->sleeping, __ATOMIC_RELAXED)
+            && __atomic_exchange_n(&channel->sleeping, 0, __ATOMIC_ACQ_REL)) {
+        futex_wake(&channel->sleeping, 1);
+    }
+
+    return position + 1;
+}
+
+/**
+ * Function to move the reader onto the next segment, if one has been linked
+ * @param channel - struct Channel being read from
+ * @return false if the current segment is the last one
+ *         true if the reader moved to a new segment
+ */
+static bool advance_segment(struct Channel *channel) {
+    struct Segment *old = channel->head;
+    struct Segment *next = __atomic_load_n(&old->next, __ATOMIC_ACQUIRE);
+    if (next == NULL) {
+        return false;
+    }
+
+    // make sure no new writer can pick up the old segment, then retire it
+    struct Segment *expected = old;
+    __atomic_compare_exchange_n(&channel->tail, &expected, next, false,
+            __ATOMIC_ACQ_REL, __ATOMIC_RELAXED);
+    channel->head = next;
+    channel->readIndex = 0;
+    epoch_retire(old, free);
+    epoch_collect();
+
+    return true;
 }
 
 /**
@@ -47,8 +150,69 @@ bool write_channel(struct Channel *channel, void *data) {
  *         true if read successful
  */
 bool read_channel(struct Channel *channel, void **out) {
-    // attempt to write
-    bool output = read_queue(&channel->inner, out);
+    if (channel->readIndex == CHANNEL_SEGMENT && !advance_segment(channel)) {
+        return false;
+    }
 
-    return output;
+    // a NULL slot is either empty or claimed but not yet written
+    void **slot = &channel->head->slots[channel->readIndex];
+    void *data = __atomic_load_n(slot, __ATOMIC_ACQUIRE);
+    if (data == NULL) {
+        return false;
+    }
+
+    *out = data;
+    channel->readIndex++;
+    __atomic_store_n(&channel->reads, channel->reads + 1, __ATOMIC_RELAXED);
+    return true;
+}
+
+/**
+ * Function to estimate the number of pieces of data in the channel
+ * @param channel - struct Channel to check
+ * @return writes claimed less reads made
+ */
+unsigned long channel_depth(struct Channel *channel) {
+    unsigned long reads = __atomic_load_n(&channel->reads, __ATOMIC_ACQUIRE);
+    epoch_enter();
+    struct Segment *tail = __atomic_load_n(&channel->tail, __ATOMIC_ACQUIRE);
+    unsigned int claimed = __atomic_load_n(&tail->claimed, __ATOMIC_RELAXED);
+    unsigned long writes = tail->base + (claimed < CHANNEL_SEGMENT ? claimed
+            : CHANNEL_SEGMENT);
+    epoch_exit();
+    return writes > reads ? writes - reads : 0;
+}
+
+/**
+ * Function to check (without reading) whether the channel has data
+ * @param channel - struct Channel to check
+ * @return true if a read may succeed
+ */
+static bool channel_ready(struct Channel *channel) {
+    if (channel->readIndex == CHANNEL_SEGMENT) {
+        return __atomic_load_n(&channel->head->next, __ATOMIC_ACQUIRE) != NULL;
+    }
+    return __atomic_load_n(&channel->head->slots[channel->readIndex],
+            __ATOMIC_ACQUIRE) != NULL;
+}
+
+/**
+ * Function to block the reader until data arrives in the channel
+ * @param channel - struct Channel to wait on
+ */
+void wait_channel(struct Channel *channel) {
+    if (channel_ready(channel)) {
+        return;
+    }
+
+    // announce that we are going to sleep, then check again so a writer
+    // either sees the announcement or we see its data
+    __atomic_store_n(&channel->sleeping, 1, __ATOMIC_SEQ_CST);
+    __atomic_thread_fence(__ATOMIC_SEQ_CST);
+    if (channel_ready(channel)) {
+        __atomic_store_n(&channel->sleeping, 0, __ATOMIC_RELAXED);
+        return;
+    }
+    futex_wait(&channel->sleeping, 1);
+    __atomic_store_n(&channel->sleeping, 0, __ATOMIC_RELAXED);
 }
@@ -1,15 +1,39 @@
 #ifndef _CHANNEL_H_
 #define _CHANNEL_H_
 
-#include "queue.h"
 #include <stdbool.h>
 
+// Number of slots in each segment of a channel.
+#define CHANNEL_SEGMENT 1024
+
+/*
+ * A fixed size block of slots. Channels grow by linking new segments onto the
+ * end, rather than by failing when full.
+ */
+struct Segment {
+    void *slots[CHANNEL_SEGMENT];
+    // Number of slots claimed by writers (may run past CHANNEL_SEGMENT).
+    unsigned int claimed;
+    // Number of slots in the segments before this one.
+    unsigned long base;
+    struct Segment *next;
+};
+
 /*
- * A threadsafe channel. Data can be written to the channel or read from the
- * channel at different times, by different threads - safely.
+ * A threadsafe multi-producer, single-consumer channel. Any number of threads
+ * may write to the channel at once without taking a lock, while exactly one
+ * thread reads from it.
  */
 struct Channel {
-    struct Queue inner;
+    // Segment currently being written to (shared between writers).
+    struct Segment *tail __attribute__((aligned(64)));
+    // Segment and slot currently being read from (owned by the reader).
+    struct Segment *head __attribute__((aligned(64)));
+    unsigned int readIndex;
+    // Number of reads so far (read by other threads without locking).
+    unsigned long reads;
+    // Futex word, 1 while the reader is (about to be) asleep.
+    int sleeping __attribute__((aligned(64)));
 };
 
 /*
@@ -26,20 +50,35 @@ struct Channel *new_channel(void);
 void destroy_channel(struct Channel *channel, void (*clean)(void *));
 
 /*
- * Attempts to write a piece of data to the channel. Takes as arguments a
- * pointer to the channel, and the data being written. Returns true if the
- * attempt was successful, and false if the channel was full and unable to be
- * written to.
+ * Writes a piece of data to the channel, and wakes the reader if it is
+ * waiting. Takes as arguments a pointer to the channel, and the (non-NULL)
+ * data being written. The channel grows as required, so this only fails if
+ * data is NULL. Returns the number of pieces written to the channel up to
+ * and including this one (so it has been read once that many reads have been
+ * made), or 0 on failure.
  */
-bool write_channel(struct Channel *channel, void *data);
+unsigned long write_channel(struct Channel *channel, void *data);
 
 /*
  * Attempts to read a piece of data from the channel. Takes as arguments a
  * pointer to the channel, and a pointer to where the data should be stored on
  * a successful channel. On success, returns true and sets *output to the read
  * data. On failure (due to empty channel), returns false and does not touch
- * *output.
+ * *output. Must only be called by the channel's single reader.
  */
 bool read_channel(struct Channel *channel, void **output);
 
+/*
+ * Returns (roughly) how many pieces of data are waiting in the channel. May
+ * be called by any thread; the answer can be out of date by the time it is
+ * returned, and may count writes which are claimed but not yet stored.
+ */
+unsigned long channel_depth(struct Channel *channel);
+
+/*
+ * Blocks the reader until the channel (probably) has data in it. May return
+ * spuriously, so callers should read in a loop until read_channel fails.
+ */
+void wait_channel(struct Channel *channel);
+
 #endif // _CHANNEL_H_
@@ -1,75 +1,86 @@
 #include <pthread.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
 #include "2310depot.h"
 #include "comms.h"
 #include "channel.h"
-#include <ctype.h>
+#include "event.h"
+#include "shard.h"
+#include "arena.h"
+#include "parse.h"
+#include "epoch.h"
+#include "connector.h"
+#include "trace.h"
 
 /**
- * increase the size of the item array
- * @param info - Depot struct holding related data.
- * @param items - pointer to array of items
- * @param currentSize - size of the array of items
+ * Function to log a change to an item's count, if changes are being logged.
+ * The lock of the shard owning the item must be held.
+ * @param shard - Shard owning the item.
+ * @param name - item name (need not be terminated)
+ * @param length - number of characters in the name
+ * @param delta - amount the count changed by
  */
-void grow_item_array(Depot *info, Item **items, int currentSize) {
-    // increase item size and realloc
-    int totalSize = currentSize + 1;
-    Item *temp = (Item *) realloc(*items, (totalSize * sizeof(Item)));
-
-    // set item array
-    if (temp == NULL) {
-        return;
-    } else {
-        *items = temp;
+static void log_adjust(Shard *shard, const char *name, int length,
+        int delta) {
+    Wal *wal = shard->depot->wal;
+    if (wal != NULL) {
+        wal_lock(wal);
+        wal_adjust(wal, name, length, delta);
+        wal_unlock(wal);
     }
+}
 
-    info->totalItems = totalSize;
+/**
+ * Function to change the count of an item the shard already holds without
+ * taking its lock. Changes are only made this way when they are not logged,
+ * as a logged change must not slip in while a snapshot of the state is taken.
+ * @param shard - Shard owning the item.
+ * @param name - item name (need not be terminated)
+ * @param length - number of characters in the name
+ * @param delta - amount to add to the count (negative to take away)
+ * @return 1 if the count was changed, 0 if the lock is needed
+ */
+static int try_adjust(Shard *shard, const char *name, int length,
+        int delta) {
+    return shard->depot->wal == NULL
+            && inventory_try_adjust(&shard->inventory, name, length, delta);
 }
 
 /**
  * Add item to the array of stored depot items
- * @param info - Depot struct holding related data.
- * @param new - Item struct to store.
+ * @param shard - Shard owning the item.
+ * @param name - item name (need not be terminated)
+ * @param length - number of characters in the name
+ * @param count - quantity to add
  */
-void item_add(Depot *info, Item *new) {
-    // determine if item present in the array
-    int found = 0;
-    for (int i = 0; i < info->totalItems; i++) {
-        if (strcmp(info->items[i].name, new->name) == 0) {
-            found = 1;
-            // if present, increase count
-            info->items[i].count += new->count;
-        }
-    }
-
-    // if not found, add a new entry
-    if (found == 0) {
-        grow_item_array(info, &info->items, info->totalItems);
-        info->items[info->totalItems - 1] = *new;
+void item_add(Shard *shard, const char *name, int length, int count) {
+    if (try_adjust(shard, name, length, count)) {
+        return;
     }
-
+    pthread_mutex_lock(&shard->lock);
+    // increase the count, adding the item if not already present
+    inventory_adjust(&shard->inventory, name, length, count);
+    log_adjust(shard, name, length, count);
+    pthread_mutex_unlock(&shard->lock);
 }
 
 /**
  * Function to remove item from array of stored items
- * @param info - Depot struct holding related data.
- * @param remove - Item struct to remove
+ * @param shard - Shard owning the item.
+ * @param name - item name (need not be terminated)
+ * @param length - number of characters in the name
+ * @param count - quantity to remove
  */
-void item_remove(Depot *info, Item *remove) {
-    // determine if item present in the array
-    int found = 0;
-    for (int i = 0; i < info->totalItems; i++) {
-        if (strcmp(info->items[i].name, remove->name) == 0) {
-            found = 1;
-            // if found, decrease the amout
-            info->items[i].count -= remove->count;
-        }
-    }
-
-    // if not found, set count to negative and add to list
-    if (found == 0) {
-        remove->count = remove->count * -1;
-        item_add(info, remove);
+void item_remove(Shard *shard, const char *name, int length, int count) {
+    if (try_adjust(shard, name, length, -count)) {
+        return;
     }
+    pthread_mutex_lock(&shard->lock);
+    // decrease the count (if not present, it is stored as negative)
+    inventory_adjust(&shard->inventory, name, length, -count);
+    log_adjust(shard, name, length, -count);
+    pthread_mutex_unlock(&shard->lock);
 }
 
 /**
@@ -84,7 +95,7 @@ void add_connection(Connection **list, Connection *connection, int *pos,
     /* increment size of list and store element */
     const int tempLength = *numElements * 2;
     Connection *temp = (Connection *) realloc(*list,
-            tempLength * sizeof(Deferred));
+            tempLength * sizeof(Connection));
     temp[*pos] = *connection;
     *pos += 1;
     *list = temp;
@@ -110,6 +121,14 @@ void record_neighbour(Depot *info, char *name, int port, FILE *in, FILE *out,
     server->neighbourStatus = status;
     server->streamTo = in;
     server->streamFrom = out;
+    // text until the neighbour offers framing
+    server->outbox = new_outbox(&info->outboxes, in);
+
+    // keep the names in order for SIGHUP, and index the neighbour
+    if (status == 1) {
+        order_insert(&info->neighbourOrder, name, info->neighbourCount);
+    }
+    index_neighbour(&info->neighbourIndex, name, port, info->neighbourCount);
 
     // store neighbour, reallocate if required
     if (info->neighbourCount < info->neighbourLength - 1) {
@@ -120,720 +139,666 @@ void record_neighbour(Depot *info, char *name, int port, FILE *in, FILE *out,
                 &info->neighbourLength);
     }
     pthread_mutex_unlock(&info->dataLock);
+    free(server); // copied into the array
 }
 
 /**
- * Function to spin up a listening thread for a port
+ * Function to set up the per-connection state for a socket
  * @param info - Depot struct to contain info
  * @param fileDescriptor - FD opened for the socket
+ * @return ThreadData for the connection
  */
-void spin_listening_thread(Depot *info, int fileDescriptor) {
+ThreadData *new_connection(Depot *info, int fileDescriptor) {
     // create file streams for communication to/from connection
     int dupFd = dup(fileDescriptor);
     FILE *to = fdopen(fileDescriptor, "w");
     FILE *from = fdopen(dupFd, "r");
 
-    // spin up listening thread
-    pthread_t tid;
-    ThreadData *val = malloc(sizeof(ThreadData));
+    // Delivers are gathered by the outbox, so send small writes straight away
+    int noDelay = 1;
+    setsockopt(fileDescriptor, IPPROTO_TCP, TCP_NODELAY, &noDelay,
+            sizeof(noDelay));
+
+    ThreadData *val = calloc(1, sizeof(ThreadData));
     val->depot = info;
     val->streamTo = to;
     val->streamFrom = from;
-    val->channel = info->channel;
-    val->signal = info->signal;
-    pthread_create(&tid, 0, thread_listen, (void *) val);
+    val->socket = fileDescriptor;
+    val->posted = calloc(info->shardCount, sizeof(unsigned long));
+    init_credits(&val->credits, info->config.credits, &info->flow);
+
+    // connections are never freed, so the list only grows
+    pthread_mutex_lock(&info->dataLock);
+    if (info->connectionCount == info->connectionCapacity) {
+        info->connectionCapacity = info->connectionCapacity == 0 ? 16
+                : info->connectionCapacity * 2;
+        info->connections = realloc(info->connections,
+                sizeof(ThreadData *) * info->connectionCapacity);
+    }
+    info->connections[info->connectionCount++] = val;
+    pthread_mutex_unlock(&info->dataLock);
+    return val;
 }
 
 /**
- * Function to handle the connection of the depot to other depots
- * @param info - Depot struct holding related data.
- * @param input - string of command to perform.
+ * Function to spin up a listening thread for a connection
+ * @param info - Depot struct to contain info
+ * @param connection - ThreadData of the connection to read from
  */
-void depot_connect(Depot *info, char *input) {
-    // ensure sting format is ok
-    strtok(input, "\n"); // remove extra newlines
-    input += 7; // remove CONNECT part of input
-    if (input[0] != ':') {
-        return;
-    }
-    input++;
+void spin_listening_thread(Depot *info, ThreadData *connection) {
+    pthread_t tid;
+    pthread_create(&tid, 0, thread_listen, (void *) connection);
+    pthread_detach(tid);
+}
 
-    // check format of port & ensure no duplicate connections
-    if (check_int(input) != 0) {
-        return;
-    }
-    int portInt = atoi(input);
-    if (portInt == info->listeningPort) {
-        return; // prevent connection to self
+/**
+ * Function to start reading messages from a newly opened socket, either on
+ * its own thread or on one of the event loops.
+ * @param info - Depot struct to contain info
+ * @param fileDescriptor - FD opened for the socket
+ */
+void serve_connection(Depot *info, int fileDescriptor) {
+    ThreadData *connection = new_connection(info, fileDescriptor);
+    if (info->config.eventLoop) {
+        send_greeting(connection);
+        watch_connection(info, connection);
+    } else {
+        spin_listening_thread(info, connection);
     }
+}
+
+/**
+ * Function to check whether a port is already one of our neighbours
+ * @param info - Depot struct holding related data.
+ * @param port - integer port to look for
+ * @return 1 if a neighbour uses the port, 0 otherwise
+ */
+static int known_port(Depot *info, int port) {
     pthread_mutex_lock(&info->dataLock);
-    for (int i = 0; i < info->neighbourCount; i++) {
-        if (info->neighbours[i].addr == atoi(input)) {
-            return; // prevent connection to neighbour twice
-        }
-    }
+    int found = neighbour_by_port(&info->neighbourIndex, port) >= 0;
     pthread_mutex_unlock(&info->dataLock);
+    return found;
+}
 
-    // connect to port.
-    struct addrinfo *addressInfo = 0;
-    struct addrinfo settings;
-    memset(&settings, 0, sizeof(struct addrinfo));
-    settings.ai_family = AF_INET; // IPv4 connection
-    settings.ai_socktype = SOCK_STREAM; // connect peer to peer
-
-    // attempt to parse address info
-    if (getaddrinfo("localhost", input, &settings, &addressInfo)) {
-        freeaddrinfo(addressInfo);
-        return;   // could not work out the address
-    }
-
-    // create socket and connect to the port
-    // use default protocol
-    int fileDescriptor = socket(AF_INET, SOCK_STREAM, 0);
-    if (connect(fileDescriptor, (struct sockaddr *) addressInfo->ai_addr,
-            sizeof(struct sockaddr))) {
-        return;
+/**
+ * Function to find a neighbour which has sent its IM, with dataLock held
+ * @param info - Depot struct holding related data.
+ * @param name - Slice holding the neighbour's name
+ * @param found - set to a copy of the neighbour's record
+ * @return 0 if found, -1 if there is no such neighbour
+ */
+static int find_neighbour_locked(Depot *info, Slice name, Connection *found) {
+    int position = neighbour_by_name(&info->neighbourIndex, name.start,
+            name.length);
+    if (position < 0) {
+        return -1;
     }
+    *found = info->neighbours[position]; // successfully found
+    return 0;
+}
 
-    // create listening thread
-    spin_listening_thread(info, fileDescriptor);
+/**
+ * Function to find a neighbour which has sent its IM
+ * @param info - Depot struct holding related data.
+ * @param name - Slice holding the neighbour's name
+ * @param found - set to a copy of the neighbour's record
+ * @return 0 if found, -1 if there is no such neighbour
+ */
+static int find_neighbour(Depot *info, Slice name, Connection *found) {
+    // other workers may be recording neighbours at the same time
+    pthread_mutex_lock(&info->dataLock);
+    int status = find_neighbour_locked(info, name, found);
+    pthread_mutex_unlock(&info->dataLock);
+    return status;
 }
 
 /**
- * Function to check if illegal character / bad formatting in command
- * @param input - string of command to perform.
- * @param msg - ENUM representing type of command sent
- * @return 0 - formatting is error free
- *         -1 - bad formatting
+ * Function to print the outbound counters of every neighbour
+ * @param info - Depot struct holding related data.
+ * @param out - stream to print to
  */
-int check_illegal_char(char *input, Command msg) {
-    int counter = 0;
-    // loop over all characters and check formatting
-    for (int i = 0; i < strlen(input); i++) {
-        if (input[i] == ':') {
-            counter++;
-        }
-        if (input[i] == '\r' || input[i] == ' ') {
-            return -1;
-        }
-        if (i < strlen(input) - 2) { //todo ok?
-            if (input[i] == '\n') {
-                return -1;
-            }
-        }
+void report_neighbours(Depot *info, FILE *out) {
+    pthread_mutex_lock(&info->dataLock);
+    for (int i = 0; i < info->neighbourCount; i++) {
+        outbox_report(info->neighbours[i].outbox, info->neighbours[i].name,
+                out);
     }
+    pthread_mutex_unlock(&info->dataLock);
+}
 
-    /* check for appropraite number of ':' symbols depending on message type */
-    if (msg == IM || msg == DELIVER || msg == WITHDRAW) {
-        if (counter != 2) {
-            return -1;
-        }
-    }
-    if (msg == TRANSFER) {
-        if (counter != 3) {
-            return -1;
-        }
-    }
-    if (msg == DEFD || msg == DEFW) { // deferred deliver / withdraw
-        if (counter != 4) {
-            return -1;
-        }
+/**
+ * Function to send a Deliver to a neighbour, framed if the neighbour accepts
+ * frames. It is only queued; the writer of its outbox sends it.
+ * @param neighbour - Connection record of the neighbour
+ * @param item - Slice holding the item name
+ * @param quantity - quantity to deliver
+ */
+static void send_deliver(Connection *neighbour, Slice item, int quantity) {
+    outbox_deliver(neighbour->outbox, item.start, item.length, quantity);
+    trace_mark(TRACE_WRITE, DELIVER);
+}
+
+/**
+ * Function to handle the connection of the depot to other depots
+ * @param info - Depot struct holding related data.
+ * @param command - parsed Connect command
+ */
+void depot_connect(Depot *info, Command *command) {
+    if (command->port == info->listeningPort) {
+        return; // prevent connection to self
     }
-    if (msg == DEFT) { // deferred transfer
-        if (counter != 5) {
-            return -1;
-        }
+    if (known_port(info, command->port)) {
+        return; // prevent connection to neighbour twice
     }
 
-    return 0;
+    // the connector thread waits for the handshake, not the worker
+    connect_later(info, command->port);
 }
 
 /**
  * Function to handle the reception of the IM message
  * @param info - Depot struct holding related data.
- * @param input - string of command to perform.
+ * @param command - parsed IM command
  * @param in - File stream into the server
  * @param out - File stream out of the server
  * return - 0 : successful connection
  *          -1 : bad IM, disconnect
  */
-int depot_im(Depot *info, char *input, FILE *in, FILE *out) {
-    strtok(input, "\n"); // remove extra newlines
-    int checked = check_illegal_char(input, IM);
-    if (checked != 0) {
-        return -1;
+int depot_im(Depot *info, Command *command, FILE *in, FILE *out) {
+    if (known_port(info, command->port)) {
+        return -1; // prevent connection to neighbour twice
     }
 
-    /* check formatting of the message */
-    input += 2; // remove IM part
-    if (input[0] != ':') {
-        return -1; // check ':' placement
-    }
-    input++;
+    // record the connection (the name outlives the message, so it is kept
+    // on the heap)
+    char *serverName = strndup(command->target.start, command->target.length);
+    record_neighbour(info, serverName, command->port, in, out, 1);
+    return 0;
+}
 
-    int numberDigits = 0;
-    while (input[numberDigits] != ':') {
-        numberDigits++; // count the number of digits in the port
-    }
-    char *portOrig = malloc(sizeof(char) * numberDigits);
-    strncpy(portOrig, input, numberDigits);
-    for (int i = 0; i < numberDigits; i++) {
-        if (!isdigit(portOrig[i])) { // check that port is in fact a number
-            return -1;
-        }
-    }
-    int port = atoi(portOrig); // convert port to int
-    if (port < 0 || port > 65535) { // prevent illegal ports
-        return -1;
+/**
+ * Function to handle a neighbour offering binary framing. If we offer it too,
+ * Deliver messages sent to the neighbour are framed from now on.
+ * @param info - Depot struct holding related data.
+ * @param command - parsed Frames command
+ * @param in - File stream into the neighbour
+ */
+void depot_frames(Depot *info, Command *command, FILE *in) {
+    if (!info->config.frames || command->key != FRAME_VERSION) {
+        return; // keep to text
     }
 
-    // check port not already present
     pthread_mutex_lock(&info->dataLock);
     for (int i = 0; i < info->neighbourCount; i++) {
-        if (info->neighbours[i].addr == atoi(input)) {
-            return -1; // prevent connection to neighbour twice
+        Connection *neighbour = &info->neighbours[i];
+        if (neighbour->streamTo == in) {
+            outbox_use_frames(neighbour->outbox);
         }
     }
     pthread_mutex_unlock(&info->dataLock);
-
-    input += numberDigits;  // move to next part of message
-    if (input[0] != ':') {
-        return -1;
-    }
-    input++;
-
-    // record what is last, the server name - record the connection.
-    char *serverName = malloc(sizeof(char) * strlen(input));
-    strcpy(serverName, input);
-    record_neighbour(info, serverName, port, in, out, 1);
-    return 0;
 }
 
 /**
- * Function to control the delivery
+ * Function to reply to a List with every item whose name starts with its
+ * prefix, in lexicographic order: a "Listed:n" line, then n lines of
+ * "Item:name:count".
  * @param info - Depot struct holding related data.
- * @param inputOrig - string of command to perform.
- * @param itemName - string of item name
- * @param quantity - integer of quantity of item
- * @param key - deferral key
+ * @param command - parsed List command
+ * @param in - File stream to the connection which asked
  */
-void control_deliver(Depot *info, char *inputOrig, char *itemName,
-        int quantity, int key) {
-    // check quantity and item name for formatting & create item struct
-    if (quantity <= 0) {
-        return;
-    }
-    if (strlen(itemName) == 0) {
-        return;
-    }
-    Item *new = malloc(sizeof(Item));
-    new->name = itemName;
-    new->count = quantity;
+void depot_list(Depot *info, Command *command, FILE *in) {
+    char *items;
+    size_t size;
+    FILE *out = open_memstream(&items, &size);
+
+    // lock every shard so no items are added or removed while they are
+    // gathered (counts of existing items may still change)
+    for (int i = 0; i < info->shardCount; i++) {
+        pthread_mutex_lock(&info->shards[i].lock);
+    }
+    int count = write_items(info, command->item.start, command->item.length,
+            out, "Item:%s:%d\n");
+    for (int i = 0; i < info->shardCount; i++) {
+        pthread_mutex_unlock(&info->shards[i].lock);
+    }
+    fclose(out);
+
+    flockfile(in);
+    fprintf(in, "Listed:%d\n", count);
+    fwrite(items, 1, size, in);
+    fflush(in);
+    funlockfile(in);
+    trace_mark(TRACE_WRITE, LIST);
+    free(items);
+}
 
-    if (key == -1) {
-        // add item directly to stores (non defer)
-        item_add(info, new);
+/**
+ * Function to reply to a Query. The reply to "Query:item" is
+ * "Item:item:count", and the reply to "Query:*" is the same as to "List:".
+ * Counts are read from the live inventories inside an epoch critical
+ * section, so no lock is taken and writers are never held up. The Query was
+ * routed behind the connection's earlier messages (see route_message), so
+ * the reply includes their changes.
+ * @param info - Depot struct holding related data.
+ * @param command - parsed Query command
+ * @param in - File stream to the connection which asked
+ */
+void depot_query(Depot *info, Command *command, FILE *in) {
+    Slice item = command->item;
+    char *reply;
+    size_t size;
+    FILE *out = open_memstream(&reply, &size);
+    int listed = -1;
+    epoch_enter();
+    if (item.length == 1 && item.start[0] == '*') {
+        listed = write_items(info, "", 0, out, "Item:%s:%d\n");
     } else {
-        // defer delivering of item
-        Deferred *cmd = malloc(sizeof(Deferred));
-        cmd->key = key;
-        cmd->command = DELIVER;
-        cmd->item = new;
-        cmd->input = inputOrig;
-        add_deferred(&info->deferred, &info->defLength, &info->defCount, cmd);
-    }
+        Inventory *inventory = &shard_for(info, item.start,
+                item.length)->inventory;
+        int slot = inventory_find(inventory, item.start, item.length);
+        fprintf(out, "Item:%.*s:%d\n", item.length, item.start, slot < 0 ? 0
+                : inventory_read(inventory, slot, item.start, item.length));
+    }
+    epoch_exit();
+    fclose(out);
+
+    flockfile(in);
+    if (listed >= 0) {
+        fprintf(in, "Listed:%d\n", listed);
+    }
+    fwrite(reply, 1, size, in);
+    fflush(in);
+    funlockfile(in);
+    free(reply);
 }
 
 /**
- * Function to handle the deliver message
+ * Function to reply to a Stats request with "Stats:n" followed by n lines of
+ * "Stat:name:value" (see write_metrics)
  * @param info - Depot struct holding related data.
- * @param input - string of command to perform.
- * @param key - integer for key if deferring the message
+ * @param in - File stream to the connection which asked
  */
-void depot_deliver(Depot *info, char *input, int key) {
-    // save the original message string
-    char *inputOrig = malloc(sizeof(char) * strlen(input));
-    strcpy(inputOrig, input);
-    if (key == -1) {
-        strtok(input, "\n"); // remove extra newlines if new message
-    }
-    // check for illegal characters
-    int checked = check_illegal_char(input, DELIVER);
-    if (checked != 0) {
-        return;
-    }
-
-    /* check message format */
-    input += 7; // remove DELIVER part of message
-    if (input[0] != ':') {
-        return; // check for ':' symbol
-    }
-    input++;
-    int numberDigits = 0;
-    while (input[numberDigits] != ':') {
-        numberDigits++;
-    }
-    // check quantity portion of message is an integer
-    char *quanOrig = malloc(sizeof(char) * numberDigits);
-    strncpy(quanOrig, input, numberDigits);
-    for (int i = 0; i < numberDigits; i++) {
-        if (!isdigit(quanOrig[i])) {
-            return;
-        }
-    }
-    int quantity = atoi(quanOrig);
-
-    // move to next part of message & check format
-    input += numberDigits;
-    if (input[0] != ':') {
-        return;
-    }
-    input++;
-
-    // save the item's name (final part of message)
-    char *itemName = malloc(sizeof(char) * strlen(input));
-    strcpy(itemName, input);
-
-    // continue delivery
-    control_deliver(info, inputOrig, itemName, quantity, key);
+void depot_stats(Depot *info, FILE *in) {
+    char *stats;
+    size_t size;
+    FILE *out = open_memstream(&stats, &size);
+    int count = write_metrics(info, out, "Stat:%s:%lu\n");
+    fclose(out);
+
+    flockfile(in);
+    fprintf(in, "Stats:%d\n", count);
+    fwrite(stats, 1, size, in);
+    fflush(in);
+    funlockfile(in);
+    free(stats);
 }
 
 /**
- * Function to control the delivery
+ * Function to store a deferred command. The command outlives the message it
+ * arrived in, so its names are copied out of the message.
  * @param info - Depot struct holding related data.
- * @param inputOrig - string of command to perform.
- * @param itemName - string of item name
- * @param quantity - integer of quantity of item
  * @param key - deferral key
+ * @param command - parsed Deliver, Withdraw or Transfer to defer
  */
-void control_withdraw(Depot *info, char *inputOrig, char *itemName,
-        int quantity, int key) {
-    // check format of quantity & item name
-    if (quantity <= 0) {
-        return;
-    }
-    if (strlen(itemName) == 0) {
-        return;
-    }
-    Item *new = malloc(sizeof(Item));
-    new->name = itemName;
-    new->count = quantity;
+void keep_deferred(Depot *info, int key, Command *command) {
+    Deferred cmd;
+    cmd.verb = command->verb;
+    cmd.quantity = command->quantity;
+    cmd.shard = shard_index(info, command->item.start, command->item.length);
+
+    int targetLength = command->verb == TRANSFER ? command->target.length : 0;
+    cmd.names = malloc(command->item.length + targetLength);
+    memcpy(cmd.names, command->item.start, command->item.length);
+    memcpy(cmd.names + command->item.length, command->target.start,
+            targetLength);
+    cmd.item.start = cmd.names;
+    cmd.item.length = command->item.length;
+    cmd.target.start = cmd.names + command->item.length;
+    cmd.target.length = targetLength;
+    add_deferred(&info->deferred, key, &cmd);
+}
 
-    if (key == -1) {
-        // remove item instantly
-        item_remove(info, new);
-    } else {
-        // defer withdraw of item
-        Deferred *cmd = malloc(sizeof(Deferred));
-        cmd->key = key;
-        cmd->command = WITHDRAW;
-        cmd->item = new;
-        cmd->input = inputOrig;
-        add_deferred(&info->deferred, &info->defLength, &info->defCount, cmd);
-    }
+/**
+ * Function to handle the deliver message
+ * @param info - Depot struct holding related data.
+ * @param command - parsed Deliver command
+ */
+void depot_deliver(Depot *info, Command *command) {
+    // add item directly to stores
+    Slice item = command->item;
+    item_add(shard_for(info, item.start, item.length), item.start,
+            item.length, command->quantity);
 }
 
 /**
  * Function to handle the withdrawing of an item.
  * @param info - Depot struct holding related data.
- * @param input - string of command to perform.
- * @param key - integer for key if deferring the message
+ * @param command - parsed Withdraw command
  */
-void depot_withdraw(Depot *info, char *input, int key) {
-    // save original message
-    char *inputOrig = malloc(sizeof(char) * strlen(input));
-    strcpy(inputOrig, input);
-    if (key == -1) {
-        strtok(input, "\n"); // remove extra newlines if new message
-    }
-
-    // check presence of illegal characters
-    int checked = check_illegal_char(input, WITHDRAW);
-    if (checked != 0) {
-        return;
-    }
-    input += 8; // remove the CONNECT part of message and check ':' symbol
-    if (input[0] != ':') {
-        return;
-    }
-    input++;
-
-    // check the quantity of the item to withdraw
-    int numberDigits = 0;
-    while (input[numberDigits] != ':') {
-        numberDigits++;
-    }
-    char *quanOrig = malloc(sizeof(char) * numberDigits);
-    strncpy(quanOrig, input, numberDigits);
-    for (int i = 0; i < numberDigits; i++) {
-        if (!isdigit(quanOrig[i])) { // check that quantity is a number
-            return;
-        }
-    }
-    int quantity = atoi(quanOrig); // convert quantity from sting to int
-
-    input += numberDigits; // move to the item part of the message
-    if (input[0] != ':') {
-        return; // check placement of ':' symbol
-    }
-    input++;
-    char *itemName = malloc(sizeof(char) * strlen(input)); // save name
-    strcpy(itemName, input);
-
-    // continue withdraw
-    control_withdraw(info, inputOrig, itemName, quantity, key);
+void depot_withdraw(Depot *info, Command *command) {
+    // remove item instantly
+    Slice item = command->item;
+    item_remove(shard_for(info, item.start, item.length), item.start,
+            item.length, command->quantity);
 }
 
 /**
- * Function to control transfer of items between two depots.
+ * Function to handle the transfer of items from one depot to another.
  * @param info - Depot struct holding related data.
- * @param input - string of input message
- * @param inputOrig - string of command to perform.
- * @param itemName - string of item name
- * @param itemLength - integer length of name of item
- * @param quantity - integer of quantity of item
- * @param key - deferral key
+ * @param command - parsed Transfer command
  */
-void control_transfer(Depot *info, char *input, char *inputOrig,
-        char *itemName, int itemLength, int quantity, int key) {
-    input += itemLength; // move to next section (remove item name from string)
-    if (input[0] != ':') {
-        return; // check positioning of ':' symbol
-    }
-    input++;
-    // store the server name
-    char *serverName = malloc(sizeof(char) * strlen(input));
-    strcpy(serverName, input);
-
-    // check quantity, item name and server name formatting.
-    if (quantity <= 0) {
-        return;
-    } else if (strlen(itemName) == 0 || strlen(serverName) == 0) {
-        return;
-    }
-
+void depot_transfer(Depot *info, Command *command) {
     // check if depot present so delivery can occur
-    FILE *stream = NULL;
-    for (int i = 0; i < info->neighbourCount; i++) {
-        if (info->neighbours[i].name != NULL) {
-            if (strcmp(info->neighbours[i].name, serverName) == 0) {
-                stream = info->neighbours[i].streamTo; // successfully found
-                break;
-            }
-        }
-    }
-    if (stream == NULL) {
+    Connection neighbour;
+    if (find_neighbour(info, command->target, &neighbour) != 0) {
         return; // haven't found depot supplied in message
     }
 
-    // remove from this depot, and send message to add to other depot.
-    Item *item = malloc(sizeof(Item));
-    item->name = itemName;
-    item->count = quantity;
-    if (key == -1) {
-        // withdraw from this depot and add to other depot via Deliver message
-        item_remove(info, item);
-        fprintf(stream, "Deliver:%d:%s\n", item->count, item->name);
-        fflush(stream);
-    } else {
-        // defer transferring of items
-        Deferred *cmd = malloc(sizeof(Deferred));
-        cmd->key = key;
-        cmd->command = TRANSFER;
-        cmd->item = item;
-        cmd->location = serverName;
-        cmd->input = inputOrig;
-        add_deferred(&info->deferred, &info->defLength, &info->defCount, cmd);
-    }
+    // withdraw from this depot and add to other depot via Deliver message
+    Slice item = command->item;
+    item_remove(shard_for(info, item.start, item.length), item.start,
+            item.length, command->quantity);
+    send_deliver(&neighbour, item, command->quantity);
 }
 
 /**
- * Function to handle the transfer of items from one depot to another.
+ * Function to handle the deferral of a message
  * @param info - Depot struct holding related data.
- * @param input - string of command to perform.
- * @param key - integer for key if deferring the message
- * @return
+ * @param command - parsed Defer command
  */
-void depot_transfer(Depot *info, char *input, int key) {
-    // save original string message
-    char *inputOrig = malloc(sizeof(char) * strlen(input));
-    strcpy(inputOrig, input);
-    if (key == -1) {
-        strtok(input, "\n"); // remove extra newlines if deferred message
+void defer(Depot *info, Command *command) {
+    Command *deferred = command->deferred;
+    Connection neighbour;
+    if (deferred->verb == TRANSFER
+            && find_neighbour(info, deferred->target, &neighbour) != 0) {
+        return; // only transfers to a known depot are kept
     }
 
-    // check presence of illegal characters
-    int checked = check_illegal_char(input, TRANSFER);
-    if (checked != 0) {
+    // store details of the message with it's key
+    pthread_mutex_lock(&info->deferredLock);
+    keep_deferred(info, command->key, deferred);
+    if (info->wal != NULL) {
+        wal_lock(info->wal);
+        wal_defer(info->wal, command->key, deferred->verb, deferred->quantity,
+                deferred->item, deferred->target);
+        wal_unlock(info->wal);
+    }
+    pthread_mutex_unlock(&info->deferredLock);
+}
+
+/**
+ * Control execution of deferred messages. The stored commands were checked
+ * when they were deferred, so they are applied directly, in the order they
+ * were deferred, and the Deliver messages generated by Transfers are flushed
+ * once at the end. The commands are taken and applied under deferredLock and
+ * the lock of every shard they touch, and logged in one go, so neither a
+ * commit nor a snapshot can fall between taking them and their effects.
+ * @param info - struct of Depot info
+ * @param key - integer key to execute deferred messages with
+ */
+void control_execute(Depot *info, int key) {
+    Deferred *commands;
+    pthread_mutex_lock(&info->deferredLock);
+    int count = take_deferred(&info->deferred, key, &commands);
+    if (count == 0) {
+        pthread_mutex_unlock(&info->deferredLock);
         return;
     }
-    // move to next part of message (remove TRANSFER section)
-    input += 8;
-    if (input[0] != ':') {
-        return; // check presence of ':' symbol
-    }
-    input++;
 
-    // check number of digits for quantity of item to transfer
-    int numberDigits = 0;
-    while (input[numberDigits] != ':') {
-        numberDigits++;
-    }
-    char *quanOrig = malloc(sizeof(char) * numberDigits);
-    strncpy(quanOrig, input, numberDigits);
-    for (int i = 0; i < numberDigits; i++) {
-        if (!isdigit(quanOrig[i])) { // check if quantity is an integer
-            return;
+    // look up every Transfer's destination in one go
+    Connection *targets = NULL;
+    for (int i = 0; i < count; i++) {
+        if (commands[i].verb != TRANSFER) {
+            continue;
+        }
+        if (targets == NULL) {
+            targets = malloc(sizeof(Connection) * count);
+            pthread_mutex_lock(&info->dataLock);
+        }
+        if (find_neighbour_locked(info, commands[i].target,
+                &targets[i]) != 0) {
+            commands[i].verb = UNKNOWN; // depot has gone, ignored
         }
     }
-    int quantity = atoi(quanOrig); // convert string quantity to integer
-
-    input += numberDigits; // remove quantity section of message
-    if (input[0] != ':') {
-        return; // check positioning of ':' symbol
+    if (targets != NULL) {
+        pthread_mutex_unlock(&info->dataLock);
     }
-    input++;
 
-    // record length of item name & store item name
-    int itemLength = 0;
-    while (input[itemLength] != ':') {
-        itemLength++;
+    // each shard's lock is taken once, in order, for all of its items
+    char *touched = calloc(info->shardCount, sizeof(char));
+    int applied = 0;
+    for (int i = 0; i < count; i++) {
+        if (commands[i].verb != UNKNOWN) {
+            touched[commands[i].shard] = 1;
+            applied++;
+        }
     }
-    char *itemName = malloc(sizeof(char) * itemLength);
-    strncpy(itemName, input, itemLength);
-
-    control_transfer(info, input, inputOrig, itemName, itemLength,
-            quantity, key);
-}
-
-/**
- * Function to handle the deferral of a message
- * @param info - Depot struct holding related data.
- * @param input - string of command to perform.
- */
-void defer(Depot *info, char *input) {
-    strtok(input, "\n"); // remove extra newlines
-    // store original input string
-    char *inputOrig = malloc(sizeof(char) * strlen(input));
-    strcpy(inputOrig, input);
-
-    input += 5; // remove starting portion of msg
-    if (input[0] != ':') {
-        return; // check formatting
-    }
-    input++;
-
-    // get key from the message
-    int numberDigits = 0;
-    while (input[numberDigits] != ':') {
-        numberDigits++;
-    }
-    char *keyOrig = malloc(sizeof(char) * numberDigits);
-    strncpy(keyOrig, input, numberDigits);
-    for (int i = 0; i < numberDigits; i++) {
-        if (!isdigit(keyOrig[i])) {
-            return; // check that key is an unsigned int
+    for (int s = 0; s < info->shardCount; s++) {
+        if (touched[s]) {
+            pthread_mutex_lock(&info->shards[s].lock);
         }
     }
-    int key = atoi(keyOrig); // convert string to integer
-
-    // move to next part of the string (remove key section)
-    input += numberDigits;
-    if (input[0] != ':') {
-        return; // check formatting of ':'
+    if (info->wal != NULL) {
+        wal_lock(info->wal);
+        wal_execute(info->wal, key, applied);
     }
-    input++;
-
-    // get message to perform (deliver, withdraw, transfer)
-    int numberLetters = 0;
-    while (input[numberLetters] != ':') {
-        numberLetters++;
+    for (int i = 0; i < count; i++) {
+        Deferred *command = &commands[i];
+        if (command->verb == UNKNOWN) {
+            continue;
+        }
+        int delta = command->verb == DELIVER
+                ? command->quantity : -command->quantity;
+        inventory_adjust(&info->shards[command->shard].inventory,
+                command->item.start, command->item.length, delta);
+        if (info->wal != NULL) {
+            wal_adjust(info->wal, command->item.start, command->item.length,
+                    delta);
+        }
     }
-    char *order = malloc(sizeof(char) * numberLetters);
-    strncpy(order, input, numberLetters);
-
-    // store details of the message with it's key
-    if (strcmp(order, "Deliver") == 0) {
-        defer_deliver(info, input, inputOrig, key);
-    } else if (strcmp(order, "Withdraw") == 0) {
-        defer_withdraw(info, input, inputOrig, key);
-    } else if (strcmp(order, "Transfer") == 0) {
-        defer_transfer(info, input, inputOrig, key);
+    if (info->wal != NULL) {
+        wal_unlock(info->wal);
     }
-}
-
-/**
- * Function to handle the deferral of the delivery message
- * @param info - Depot struct holding related data.
- * @param input - string of command to perform.
- * @param orig - original string message
- * @param key - integer for key if deferring the message
- */
-void defer_deliver(Depot *info, char *input, char *orig, int key) {
-    // check the original string for formatting issues
-    int checked = check_illegal_char(orig, DEFD);
-    if (checked != 0) {
-        return;
+    for (int s = 0; s < info->shardCount; s++) {
+        if (touched[s]) {
+            pthread_mutex_unlock(&info->shards[s].lock);
+        }
     }
+    pthread_mutex_unlock(&info->deferredLock);
+    free(touched);
 
-    // defer the delivery with it's key
-    depot_deliver(info, input, key);
-}
-
-/**
- * Function to handle the deferral of the withdraw message
- * @param info - Depot struct holding related data.
- * @param input - string of command to perform.
- * @param orig - original string message
- * @param key - integer for key if deferring the message
- */
-void defer_withdraw(Depot *info, char *input, char *orig, int key) {
-    // check the original string for formatting issues
-    int checked = check_illegal_char(orig, DEFW);
-    if (checked != 0) {
-        return;
+    if (targets != NULL) {
+        for (int i = 0; i < count; i++) {
+            if (commands[i].verb == TRANSFER) {
+                send_deliver(&targets[i], commands[i].item,
+                        commands[i].quantity);
+            }
+        }
+        free(targets);
     }
 
-    // defer the delivery with it's key
-    depot_withdraw(info, input, key);
+    for (int i = 0; i < count; i++) {
+        free(commands[i].names);
+    }
+    free(commands);
 }
 
 /**
- * Function to handle the transfer of the withdraw message
+ * Function to carry out the lines of (one shard's part of) a Batch. Every
+ * item belongs to the given shard, so its lock is taken once for the whole
+ * batch, and the Deliver messages generated by Transfer lines are flushed
+ * once at the end. Each line has the same effect as if sent on its own, and
+ * malformed lines are ignored.
  * @param info - Depot struct holding related data.
- * @param input - string of command to perform.
- * @param orig - original string message
- * @param key - integer for key if deferring the message
+ * @param shard - Shard owning every item in the batch
+ * @param arena - Arena for memory which only lives as long as the message
+ * @param input - the batch's lines
+ * @param length - number of characters in the input
+ * @param count - number of lines in the input
  */
-void defer_transfer(Depot *info, char *input, char *orig, int key) {
-    // check the original string for formatting issues
-    int checked = check_illegal_char(orig, DEFT);
-    if (checked != 0) {
-        return;
+void process_batch(Depot *info, Shard *shard, Arena *arena, char *input,
+        int length, int count) {
+    Command *commands = arena_alloc(arena, sizeof(Command) * count);
+    Connection *targets = arena_alloc(arena, sizeof(Connection) * count);
+    int parsed = 0;
+    int transfers = 0;
+
+    // parse every line first, so no parsing happens under the locks
+    char *end = input + length;
+    for (char *line = input; line < end && parsed < count;) {
+        char *next = memchr(line, '\n', end - line);
+        next = next == NULL ? end : next + 1;
+        Command *command = &commands[parsed];
+        if (parse_command(arena, line, next - line, command) == 0
+                && (command->verb == DELIVER || command->verb == WITHDRAW
+                || command->verb == TRANSFER)) {
+            transfers += command->verb == TRANSFER;
+            parsed++;
+        }
+        line = next;
     }
 
-    // defer the delivery with it's key
-    depot_transfer(info, input, key);
-}
-
-/**
- * Control execution of deferred messages
- * @param info - struct of Depot info
- * @param key - integer key to execute deferred messages with
- */
-void control_execute(Depot *info, int key) {
-    /* add commands for worker consumption */
-    for (int i = 0; i < info->defCount; i++) {
-        if (key == info->deferred[i].key) {
-            // create message to send to worker thread down channel
-            Message *message = malloc(sizeof(Message));
-            char *messageInput = malloc(
-                    (strlen(info->deferred[i].input) + 2) * sizeof(char));
-            strncpy(messageInput, info->deferred[i].input,
-                    strlen(info->deferred[i].input));
-            strcat(messageInput, "\n");
-            message->input = messageInput;
-
-            bool output = false;
-            while (!output) { // stop once message successfully written
-                // properly lock & unlock mutex.
-                pthread_mutex_lock(&info->channelLock);
-                output = write_channel(info->channel, message);
-                pthread_mutex_unlock(&info->channelLock);
+    // look up every Transfer's destination in one go
+    if (transfers > 0) {
+        pthread_mutex_lock(&info->dataLock);
+        for (int i = 0; i < parsed; i++) {
+            if (commands[i].verb == TRANSFER && find_neighbour_locked(info,
+                    commands[i].target, &targets[i]) != 0) {
+                commands[i].verb = UNKNOWN; // unknown depot, ignored
             }
-            // signal that a message is ready
-            sem_post(info->signal);
-
         }
+        pthread_mutex_unlock(&info->dataLock);
     }
 
-    /* remove all message that have been run with given key */
-    bool foundKey;
-    do {
-        foundKey = false;
-        int i;
-        // check if any messages have given key
-        for (i = 0; i < info->defCount; i++) {
-            if (info->deferred[i].key == key) {
-                foundKey = true;
-                break;
-            }
+    pthread_mutex_lock(&shard->lock);
+    if (info->wal != NULL) {
+        wal_lock(info->wal);
+    }
+    for (int i = 0; i < parsed; i++) {
+        Command *command = &commands[i];
+        if (command->verb == UNKNOWN) {
+            continue;
+        }
+        int delta = command->verb == DELIVER
+                ? command->quantity : -command->quantity;
+        inventory_adjust(&shard->inventory, command->item.start,
+                command->item.length, delta);
+        if (info->wal != NULL) {
+            wal_adjust(info->wal, command->item.start, command->item.length,
+                    delta);
         }
+    }
+    if (info->wal != NULL) {
+        wal_unlock(info->wal);
+    }
+    pthread_mutex_unlock(&shard->lock);
 
-        if (foundKey == true) {
-            // If command with matching key found in array
-            if (i < info->defCount) {
-                // reduce size of array and shift elements
-                info->defCount = info->defCount - 1;
-                for (int j = i; j < info->defCount; j++) {
-                    info->deferred[j] = info->deferred[j + 1];
-                }
+    if (transfers > 0) {
+        for (int i = 0; i < parsed; i++) {
+            if (commands[i].verb == TRANSFER) {
+                send_deliver(&targets[i], commands[i].item,
+                        commands[i].quantity);
             }
         }
-    } while (foundKey == true); // continue until all msg with keys removed
+    }
 }
 
 /**
- * Function to execute all deferred message
- * @param info - Depot struct holding related data.
- * @param input - string of command to perform.
+ * Function to disconnect a depot which sent a bad IM. The thread reading the
+ * connection still owns its streams, and messages from it may still be
+ * queued, so the socket is only shut down: the reader sees the end of the
+ * stream and stops.
+ * @param socket - integer representing file descriptor of socket
  */
-void depot_execute(Depot *info, char *input) {
-    strtok(input, "\n"); // remove extra newlines
-    char *inputOrig = malloc(sizeof(char) * strlen(input));
-    strcpy(inputOrig, input);
-
-    input += 7; // remove starting portion of msg (EXECUTE)
-    if (input[0] != ':') {
-        return; // check formatting of ':' symbol
-    }
-    input++;
-
-    // check key format and parse from string to int
-    int checkKey = check_int(input);
-    if (checkKey != 0) {
-        return;
-    }
-    int key = atoi(input);
-
-    // continue execution of deferred messages
-    control_execute(info, key);
+static void drop_connection(int socket) {
+    shutdown(socket, SHUT_RDWR);
 }
 
 /**
  * Function to handle the processing of an input from a given connection
  * @param info - Depot struct holding related data.
+ * @param arena - Arena for memory which only lives as long as the message
  * @param input - string of command to perform.
+ * @param length - number of characters in the input
  * @param in - File stream into the server
  * @param out - File stream out of the server
  * @param socket - integer representing file descriptor of socket
+ * @return Verb of the command carried out (UNKNOWN if it was badly formed)
  */
-void process_input(Depot *info, char *input, FILE *in, FILE *out, int socket) {
-    if (strncmp(input, "Connect", 7) == 0) {
-        // connect to depot
-        depot_connect(info, input);
-    } else if (strncmp(input, "IM", 2) == 0) {
-        int imStatus = depot_im(info, input, in, out);
-        if (imStatus != 0) {
-            // bad IM, disconnect & ignore
-            fclose(in);
-            fclose(out);
-            close(socket);
-        }
-    } else if (strncmp(input, "Deliver", 7) == 0) {
-        // deliver items to depot
-        depot_deliver(info, input, -1);
-    } else if (strncmp(input, "Withdraw", 8) == 0) {
-        // withdraw items from depot
-        depot_withdraw(info, input, -1);
-    } else if (strncmp(input, "Transfer", 8) == 0) {
-        // transfer items between two IM'd depots
-        depot_transfer(info, input, -1);
-    } else if (strncmp(input, "Defer", 5) == 0) {
-        // defer message for later use (represented by a key)
-        defer(info, input);
-    } else if (strncmp(input, "Execute", 7) == 0) {
-        // execute deferred message with a given key
-        depot_execute(info, input);
-    }
-}
\ No newline at end of file
+Verb process_input(Depot *info, Arena *arena, char *input, int length,
+        FILE *in, FILE *out, int socket) {
+    Command command;
+    int parsed = parse_command(arena, input, length, &command);
+    trace_mark(TRACE_DISPATCH, 0);
+    if (parsed == 0) {
+        process_command(info, &command, in, out, socket);
+        return command.verb;
+    } else if (command.verb == IM) {
+        // bad IM, disconnect & ignore
+        drop_connection(socket);
+    }
+    // other badly formed messages are ignored
+    return UNKNOWN;
+}
+
+/**
+ * Function to carry out a command from a given connection
+ * @param info - Depot struct holding related data.
+ * @param command - parsed (or decoded) Command to carry out
+ * @param in - File stream into the server
+ * @param out - File stream out of the server
+ * @param socket - integer representing file descriptor of socket
+ */
+void process_command(Depot *info, Command *command, FILE *in, FILE *out,
+        int socket) {
+    switch (command->verb) {
+        case CONNECT:
+            // connect to depot
+            depot_connect(info, command);
+            break;
+        case IM:
+            if (depot_im(info, command, in, out) != 0) {
+                // bad IM, disconnect & ignore
+                drop_connection(socket);
+            }
+            break;
+        case DELIVER:
+            // deliver items to depot
+            depot_deliver(info, command);
+            break;
+        case WITHDRAW:
+            // withdraw items from depot
+            depot_withdraw(info, command);
+            break;
+        case TRANSFER:
+            // transfer items between two IM'd depots
+            depot_transfer(info, command);
+            break;
+        case DEFER:
+            // defer message for later use (represented by a key)
+            defer(info, command);
+            break;
+        case EXECUTE:
+            // execute deferred message with a given key
+            control_execute(info, command->key);
+            break;
+        case FRAMES:
+            // neighbour can read binary frames
+            depot_frames(info, command, in);
+            break;
+        case LIST:
+            // list items by prefix
+            depot_list(info, command, in);
+            break;
+        case QUERY:
+            // count of one item, or of every item
+            depot_query(info, command, in);
+            break;
+        case STATS:
+            // the depot's metrics
+            depot_stats(info, in);
+            break;
+        default:
+            break;
+    }
+}
@@ -1,19 +1,32 @@
 #ifndef COMMS_H
 #define COMMS_H
 #include "2310depot.h"
+#include "arena.h"
 
+void add_connection(Connection **list, Connection *connection, int *pos,
+        int *numElements);
 
-void defer_deliver(Depot *info, char *input, char *inputOriginal, int key);
+void item_add(Shard *shard, const char *name, int length, int count);
 
-void defer_withdraw(Depot *info, char *input, char *orig, int key);
+void item_remove(Shard *shard, const char *name, int length, int count);
 
-void defer_transfer(Depot *info, char *input, char *orig, int key);
+Verb process_input(Depot *info, Arena *arena, char *input, int length,
+        FILE *in, FILE *out, int socket);
 
-void add_connection(Connection **list, Connection *connection, int *pos,
-        int *numElements);
+void process_command(Depot *info, Command *command, FILE *in, FILE *out,
+        int socket);
 
-void process_input(Depot *info, char *input, FILE *in, FILE *out, int socket);
+void keep_deferred(Depot *info, int key, Command *command);
+
+void process_batch(Depot *info, Shard *shard, Arena *arena, char *input,
+        int length, int count);
 
 void record_attempt(Depot *info, int socket);
 
+void report_neighbours(Depot *info, FILE *out);
+
+void spin_listening_thread(Depot *info, ThreadData *connection);
+
+void serve_connection(Depot *info, int fileDescriptor);
+
 #endif
\ No newline at end of file
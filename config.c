@@ -0,0 +1,86 @@
+#include <stdlib.h>
+#include <string.h>
+#include "config.h"
+
+/**
+ * Function to read a non-negative integer option from the environment
+ * @param name - name of the environment variable
+ * @param fallback - value to use if the variable is unset or malformed
+ * @return the option's value
+ */
+static int read_int_option(const char *name, int fallback) {
+    const char *value = getenv(name);
+    if (value == NULL || strlen(value) == 0) {
+        return fallback;
+    }
+
+    char *end;
+    long number = strtol(value, &end, 10);
+    if (*end != '\0' || number < 0) {
+        return fallback;
+    }
+    return (int) number;
+}
+
+/**
+ * Function to load runtime options
+ * @param config - Config struct to fill in
+ */
+void load_config(Config *config) {
+    config->credits = read_int_option("DEPOT_CREDITS", 0);
+
+    const char *io = getenv("DEPOT_IO");
+    config->eventLoop = (io != NULL && strcmp(io, "epoll") == 0);
+    config->ioThreads = read_int_option("DEPOT_IO_THREADS", 1);
+    if (config->ioThreads == 0) {
+        config->ioThreads = 1;
+    }
+
+    config->workers = read_int_option("DEPOT_WORKERS", 1);
+    if (config->workers == 0) {
+        config->workers = 1;
+    }
+
+    config->acceptors = read_int_option("DEPOT_ACCEPTORS", 1);
+    if (config->acceptors == 0) {
+        config->acceptors = 1;
+    }
+
+    config->frames = read_int_option("DEPOT_FRAMES", 0) != 0;
+
+    config->flushMicros = read_int_option("DEPOT_FLUSH_US", 0);
+    config->writers = read_int_option("DEPOT_WRITERS", 1);
+    if (config->writers == 0) {
+        config->writers = 1;
+    }
+
+    config->connectMs = read_int_option("DEPOT_CONNECT_MS", 3000);
+
+    const char *wal = getenv("DEPOT_WAL");
+    config->walDirectory = (wal != NULL && strlen(wal) > 0) ? wal : NULL;
+    config->walBatch = read_int_option("DEPOT_WAL_BATCH", 512);
+    if (config->walBatch == 0) {
+        config->walBatch = 1;
+    }
+    config->walMicros = read_int_option("DEPOT_WAL_US", 2000);
+    config->walSnapshot = read_int_option("DEPOT_WAL_SNAPSHOT", 1000000);
+    if (config->walSnapshot == 0) {
+        config->walSnapshot = 1;
+    }
+    config->metricsSample = read_int_option("DEPOT_METRICS_SAMPLE", 16);
+    if (config->metricsSample == 0) {
+        config->metricsSample = 1;
+    }
+
+    config->traceSample = read_int_option("DEPOT_TRACE", 0);
+    config->traceEvents = read_int_option("DEPOT_TRACE_EVENTS", 4096);
+    if (config->traceEvents == 0) {
+        config->traceEvents = 1;
+    }
+    const char *traceFile = getenv("DEPOT_TRACE_FILE");
+    config->traceFile = (traceFile != NULL && strlen(traceFile) > 0)
+            ? traceFile : "depot-trace.json";
+
+    const char *stock = getenv("DEPOT_STOCK");
+    config->stockFile = (stock != NULL && strlen(stock) > 0) ? stock : NULL;
+}
@@ -0,0 +1,73 @@
+#ifndef CONFIG_H
+#define CONFIG_H
+
+/*
+ * Runtime tuning options. The command line is reserved for the depot name and
+ * its starting goods, so options are read from DEPOT_* environment variables.
+ */
+typedef struct {
+    // DEPOT_CREDITS - messages a connection may have queued for the worker
+    // before its socket stops being read (0 for unbounded).
+    int credits;
+    // DEPOT_IO - "epoll" to multiplex every connection onto a few event
+    // loop threads, otherwise ("threads", the default) one thread per
+    // connection.
+    int eventLoop;
+    // DEPOT_IO_THREADS - number of event loop threads (epoll mode only).
+    int ioThreads;
+    // DEPOT_WORKERS - number of worker threads. Items are partitioned between
+    // workers by a hash of their name (default 1).
+    int workers;
+    // DEPOT_ACCEPTORS - number of threads accepting connections, each with
+    // its own socket on the depot's port, which the kernel spreads new
+    // connections across (default 1).
+    int acceptors;
+    // DEPOT_FRAMES - 1 to offer binary framing to other depots, which is
+    // used for the Deliver messages sent by Transfer when both sides offer
+    // it (default 0, text only).
+    int frames;
+    // DEPOT_FLUSH_US - how long a neighbour's writer waits for more Delivers
+    // to gather before writing, in microseconds (default 0, write as soon as
+    // any are waiting).
+    int flushMicros;
+    // DEPOT_WRITERS - number of threads writing Delivers to the neighbours,
+    // which are shared out between them (default 1).
+    int writers;
+    // DEPOT_CONNECT_MS - how long a Connect may take to reach the other
+    // depot before it is given up on, in milliseconds (default 3000).
+    int connectMs;
+    // DEPOT_WAL - directory to log every change to the inventory and the
+    // deferred commands in, so a restarted depot recovers its state (default
+    // none, state is only kept in memory).
+    const char *walDirectory;
+    // DEPOT_WAL_BATCH - records gathered before the log is written and
+    // fsync'd (default 512).
+    int walBatch;
+    // DEPOT_WAL_US - longest a record waits for its batch to fill before the
+    // log is written anyway, in microseconds (default 2000).
+    int walMicros;
+    // DEPOT_WAL_SNAPSHOT - records logged between snapshots, which bound how
+    // much log recovery replays (default 1000000).
+    int walSnapshot;
+    // DEPOT_METRICS_SAMPLE - while busy, each worker times one message in
+    // this many for the latency histograms (default 16, 1 times every
+    // message). Counts are always exact.
+    int metricsSample;
+    // DEPOT_TRACE - each connection traces one message in this many through
+    // the depot, written as Chrome trace JSON on SIGUSR2 (default 0, no
+    // tracing).
+    int traceSample;
+    // DEPOT_TRACE_EVENTS - latest trace events kept by each thread (default
+    // 4096).
+    int traceEvents;
+    // DEPOT_TRACE_FILE - file the trace is written to (default
+    // "depot-trace.json").
+    const char *traceFile;
+    // DEPOT_STOCK - file of starting goods, loaded along with any given on
+    // the command line (default none). See stock.h.
+    const char *stockFile;
+} Config;
+
+void load_config(Config *config);
+
+#endif
@@ -0,0 +1,260 @@
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <time.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <sys/socket.h>
+#include "connector.h"
+#include "channel.h"
+#include "comms.h"
+
+// Maximum events handled per epoll_wait call.
+#define CONNECT_BATCH 64
+// Starting number of attempts the connector has room for.
+#define PENDING_START 16
+
+/**
+ * Function to get the current time in milliseconds
+ * @return monotonic time in milliseconds
+ */
+static long now_ms(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000L + ts.tv_nsec / 1000000;
+}
+
+/**
+ * Function to work out the address of localhost, the first time it is needed
+ * @param connector - Connector to cache the address in
+ * @return 0 if the address is known, -1 if it could not be resolved
+ */
+static int resolve_localhost(Connector *connector) {
+    if (connector->resolved) {
+        return 0;
+    }
+
+    struct addrinfo *addressInfo = NULL;
+    struct addrinfo settings;
+    memset(&settings, 0, sizeof(struct addrinfo));
+    settings.ai_family = AF_INET; // IPv4 connection
+    settings.ai_socktype = SOCK_STREAM; // connect peer to peer
+    if (getaddrinfo("localhost", NULL, &settings, &addressInfo) != 0) {
+        return -1; // try again on the next Connect
+    }
+    connector->address =
+            ((struct sockaddr_in *) addressInfo->ai_addr)->sin_addr;
+    connector->resolved = 1;
+    freeaddrinfo(addressInfo);
+    return 0;
+}
+
+/**
+ * Function to stop tracking an attempt, closing its socket unless it has
+ * been handed on
+ * @param connector - Connector the attempt belongs to
+ * @param position - position of the attempt in the pending list
+ * @param keepSocket - 1 if the socket is now being served, 0 to close it
+ */
+static void drop_pending(Connector *connector, int position, int keepSocket) {
+    PendingConnect *attempt = connector->pending[position];
+    epoll_ctl(connector->epollFd, EPOLL_CTL_DEL, attempt->fileDescriptor,
+            NULL);
+    if (!keepSocket) {
+        close(attempt->fileDescriptor);
+    }
+    free(attempt);
+    connector->pending[position] =
+            connector->pending[--connector->pendingCount];
+}
+
+/**
+ * Function to hand a connected socket over to be served like any other
+ * @param connector - Connector which made the connection
+ * @param fileDescriptor - FD of the connected socket
+ */
+static void serve_connected(Connector *connector, int fileDescriptor) {
+    // connections are read with blocking I/O from here on
+    int flags = fcntl(fileDescriptor, F_GETFL);
+    fcntl(fileDescriptor, F_SETFL, flags & ~O_NONBLOCK);
+    serve_connection(connector->depot, fileDescriptor);
+}
+
+/**
+ * Function to start connecting to a port
+ * @param connector - Connector to track the attempt
+ * @param port - port (on localhost) to connect to
+ */
+static void begin_connect(Connector *connector, int port) {
+    for (int i = 0; i < connector->pendingCount; i++) {
+        if (connector->pending[i]->port == port) {
+            return; // already connecting
+        }
+    }
+    if (resolve_localhost(connector) != 0) {
+        return; // could not work out the address
+    }
+
+    struct sockaddr_in address;
+    memset(&address, 0, sizeof(address));
+    address.sin_family = AF_INET;
+    address.sin_port = htons(port);
+    address.sin_addr = connector->address;
+
+    int fileDescriptor = socket(AF_INET, SOCK_STREAM | SOCK_NONBLOCK, 0);
+    if (fileDescriptor < 0) {
+        return;
+    }
+    if (connect(fileDescriptor, (struct sockaddr *) &address,
+            sizeof(address)) == 0) {
+        serve_connected(connector, fileDescriptor);
+        return;
+    } else if (errno != EINPROGRESS) {
+        close(fileDescriptor);
+        return; // refused straight away
+    }
+
+    // wait for the handshake to finish
+    PendingConnect *attempt = malloc(sizeof(PendingConnect));
+    attempt->fileDescriptor = fileDescriptor;
+    attempt->port = port;
+    attempt->deadline = now_ms() + connector->depot->config.connectMs;
+    if (connector->pendingCount == connector->pendingCapacity) {
+        connector->pendingCapacity *= 2;
+        connector->pending = realloc(connector->pending,
+                sizeof(PendingConnect *) * connector->pendingCapacity);
+    }
+    connector->pending[connector->pendingCount++] = attempt;
+
+    struct epoll_event event;
+    event.events = EPOLLOUT;
+    event.data.ptr = attempt;
+    epoll_ctl(connector->epollFd, EPOLL_CTL_ADD, fileDescriptor, &event);
+}
+
+/**
+ * Function to finish an attempt whose socket has become writable (or failed)
+ * @param connector - Connector the attempt belongs to
+ * @param attempt - PendingConnect which epoll reported on
+ */
+static void finish_connect(Connector *connector, PendingConnect *attempt) {
+    int position = 0;
+    while (connector->pending[position] != attempt) {
+        position++;
+    }
+
+    int error = 0;
+    socklen_t length = sizeof(error);
+    getsockopt(attempt->fileDescriptor, SOL_SOCKET, SO_ERROR, &error,
+            &length);
+    int fileDescriptor = attempt->fileDescriptor;
+    drop_pending(connector, position, error == 0);
+    if (error == 0) {
+        serve_connected(connector, fileDescriptor);
+    }
+}
+
+/**
+ * Function to start connecting to every port the workers have asked for
+ * @param connector - Connector to take the ports from
+ */
+static void handle_requests(Connector *connector) {
+    uint64_t count;
+    if (read(connector->wakeFd, &count, sizeof(count)) < 0) {
+        // spurious wake, still drain the channel
+    }
+
+    void *port;
+    while (read_channel(connector->requests, &port)) {
+        begin_connect(connector, (int) (intptr_t) port);
+    }
+}
+
+/**
+ * Function to abandon attempts which have run out of time
+ * @param connector - Connector holding the attempts
+ * @return milliseconds until the next attempt runs out, -1 if there are none
+ */
+static int expire_attempts(Connector *connector) {
+    long now = now_ms();
+    long next = -1;
+    for (int i = 0; i < connector->pendingCount; ) {
+        long deadline = connector->pending[i]->deadline;
+        if (deadline <= now) {
+            drop_pending(connector, i, 0); // moves the last one to i
+            continue;
+        }
+        if (next < 0 || deadline - now < next) {
+            next = deadline - now;
+        }
+        i++;
+    }
+    return (int) next;
+}
+
+/**
+ * Function for the connector thread to make connections in the background
+ * @param data - void pointer (parsed to Connector struct)
+ * @return void pointer
+ */
+static void *thread_connector(void *data) {
+    Connector *connector = (Connector *) data;
+    struct epoll_event events[CONNECT_BATCH];
+    while (1) {
+        int timeout = expire_attempts(connector);
+        int count = epoll_wait(connector->epollFd, events, CONNECT_BATCH,
+                timeout);
+        for (int i = 0; i < count; i++) {
+            if (events[i].data.ptr == NULL) {
+                handle_requests(connector);
+            } else {
+                finish_connect(connector,
+                        (PendingConnect *) events[i].data.ptr);
+            }
+        }
+    }
+    return NULL;
+}
+
+/**
+ * Function to start the connector thread
+ * @param info - Depot struct holding related data.
+ */
+void start_connector(Depot *info) {
+    Connector *connector = calloc(1, sizeof(Connector));
+    connector->depot = info;
+    connector->epollFd = epoll_create1(0);
+    connector->wakeFd = eventfd(0, EFD_NONBLOCK);
+    connector->requests = new_channel();
+    connector->pendingCapacity = PENDING_START;
+    connector->pending = malloc(sizeof(PendingConnect *) * PENDING_START);
+    info->connector = connector;
+
+    // the wake fd is marked with a NULL pointer
+    struct epoll_event event;
+    event.events = EPOLLIN;
+    event.data.ptr = NULL;
+    epoll_ctl(connector->epollFd, EPOLL_CTL_ADD, connector->wakeFd, &event);
+
+    pthread_t tid;
+    pthread_create(&tid, 0, thread_connector, (void *) connector);
+    pthread_detach(tid);
+}
+
+/**
+ * Function to ask the connector thread to connect to a port. Returns
+ * straight away; the connection is served once (and if) it is made.
+ * @param info - Depot struct holding related data.
+ * @param port - port (on localhost) to connect to
+ */
+void connect_later(Depot *info, int port) {
+    if (port <= 0 || port > 65535) {
+        return; // not a port anything could be listening on
+    }
+    uint64_t one = 1;
+    write_channel(info->connector->requests, (void *) (intptr_t) port);
+    if (write(info->connector->wakeFd, &one, sizeof(one)) < 0) {
+        // counter already non-zero, the connector is being woken anyway
+    }
+}
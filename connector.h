@@ -0,0 +1,42 @@
+#ifndef CONNECTOR_H
+#define CONNECTOR_H
+
+#include <netinet/in.h>
+#include "2310depot.h"
+
+// struct for a Connect whose socket is still connecting
+typedef struct {
+    int fileDescriptor;
+    int port;
+    long deadline; // monotonic time (ms) at which the attempt is abandoned
+} PendingConnect;
+
+/*
+ * A thread making the depot's outgoing connections. Workers hand it the port
+ * of each Connect and carry on; it opens a non-blocking socket, waits for
+ * the handshake with epoll alongside every other attempt, and starts serving
+ * the socket once it is connected. Attempts still connecting after
+ * DEPOT_CONNECT_MS are abandoned. The address of localhost is resolved once
+ * and reused for every Connect.
+ */
+typedef struct Connector {
+    struct Depot *depot;
+    int epollFd;
+    // eventfd signalled when ports are added to requests
+    int wakeFd;
+    // ports to connect to (written by the workers)
+    struct Channel *requests;
+    // attempts in progress (owned by the connector thread)
+    PendingConnect **pending;
+    int pendingCount;
+    int pendingCapacity;
+    // localhost, once it has been resolved
+    struct in_addr address;
+    int resolved;
+} Connector;
+
+void start_connector(Depot *info);
+
+void connect_later(Depot *info, int port);
+
+#endif
@@ -0,0 +1,152 @@
+#include <stdint.h>
+#include <stdlib.h>
+#include "deferred.h"
+
+// Group states (see DeferredGroup).
+#define GROUP_EMPTY 0
+#define GROUP_LIVE 1
+#define GROUP_REMOVED -1
+// Starting number of groups, and of commands in each group.
+#define DEFERRED_START 16
+#define GROUP_START 4
+
+/**
+ * Function to create an empty deferred store
+ * @param store - DeferredStore struct to initialise
+ */
+void init_deferred(DeferredStore *store) {
+    store->capacity = DEFERRED_START;
+    store->groups = calloc(store->capacity, sizeof(DeferredGroup));
+    store->used = 0;
+    store->keys = 0;
+    store->commands = 0;
+}
+
+/**
+ * Function to find the group for a key (or where it would go)
+ * @param store - DeferredStore to search
+ * @param key - deferral key
+ * @return the key's group, or the first free group it would be put in
+ */
+static DeferredGroup *probe(DeferredStore *store, int key) {
+    unsigned int mask = store->capacity - 1;
+    // spread sequential keys across the table
+    unsigned int position = ((uint32_t) key * 2654435761u) & mask;
+    DeferredGroup *insertAt = NULL;
+    while (1) {
+        DeferredGroup *group = &store->groups[position];
+        if (group->state == GROUP_EMPTY) {
+            return insertAt != NULL ? insertAt : group;
+        }
+        if (group->state == GROUP_REMOVED) {
+            if (insertAt == NULL) {
+                insertAt = group;
+            }
+        } else if (group->key == key) {
+            return group;
+        }
+        position = (position + 1) & mask; // linear probing
+    }
+}
+
+/**
+ * Function to rebuild the table, dropping removed groups and growing it if
+ * needed
+ * @param store - DeferredStore to rebuild
+ */
+static void rebuild(DeferredStore *store) {
+    DeferredGroup *old = store->groups;
+    int oldCapacity = store->capacity;
+    int live = 0;
+    for (int i = 0; i < oldCapacity; i++) {
+        live += old[i].state == GROUP_LIVE;
+    }
+
+    // keep the table at most a quarter full after the rebuild
+    store->capacity = DEFERRED_START;
+    while (store->capacity < live * 4) {
+        store->capacity *= 2;
+    }
+    store->groups = calloc(store->capacity, sizeof(DeferredGroup));
+    store->used = live;
+    for (int i = 0; i < oldCapacity; i++) {
+        if (old[i].state == GROUP_LIVE) {
+            *probe(store, old[i].key) = old[i];
+        }
+    }
+    free(old);
+}
+
+/**
+ * Function to add a deferred command to the end of its key's group
+ * @param store - DeferredStore to add to
+ * @param key - deferral key
+ * @param command - Deferred struct containing command to defer (copied)
+ */
+void add_deferred(DeferredStore *store, int key, Deferred *command) {
+    DeferredGroup *group = probe(store, key);
+    if (group->state != GROUP_LIVE) {
+        if (group->state == GROUP_EMPTY && (store->used + 1) * 2
+                > store->capacity) {
+            // too full (of live or removed groups), rebuild and look again
+            rebuild(store);
+            group = probe(store, key);
+        }
+        if (group->state == GROUP_EMPTY) {
+            store->used++;
+        }
+        group->key = key;
+        group->state = GROUP_LIVE;
+        group->commands = malloc(sizeof(Deferred) * GROUP_START);
+        group->count = 0;
+        group->capacity = GROUP_START;
+        __atomic_store_n(&store->keys, store->keys + 1, __ATOMIC_RELAXED);
+    }
+
+    if (group->count == group->capacity) {
+        group->capacity *= 2;
+        group->commands = realloc(group->commands,
+                sizeof(Deferred) * group->capacity);
+    }
+    group->commands[group->count++] = *command;
+    __atomic_store_n(&store->commands, store->commands + 1, __ATOMIC_RELAXED);
+}
+
+/**
+ * Function to remove every command deferred under a key
+ * @param store - DeferredStore to take from
+ * @param key - deferral key
+ * @param commands - set to the commands, in the order they were deferred
+ * (to be freed by the caller), or NULL if there are none
+ * @return number of commands taken
+ */
+int take_deferred(DeferredStore *store, int key, Deferred **commands) {
+    DeferredGroup *group = probe(store, key);
+    if (group->state != GROUP_LIVE) {
+        *commands = NULL;
+        return 0;
+    }
+    *commands = group->commands;
+    group->state = GROUP_REMOVED;
+    group->commands = NULL;
+    __atomic_store_n(&store->keys, store->keys - 1, __ATOMIC_RELAXED);
+    __atomic_store_n(&store->commands, store->commands - group->count,
+            __ATOMIC_RELAXED);
+    return group->count;
+}
+
+/**
+ * Function to walk the keys which have commands deferred
+ * @param store - DeferredStore to walk
+ * @param position - where to carry on from (0 to start, updated)
+ * @return next group holding a key, NULL once there are no more
+ */
+DeferredGroup *next_deferred_group(DeferredStore *store, int *position) {
+    while (*position < store->capacity) {
+        DeferredGroup *group = &store->groups[(*position)++];
+        if (group->state == GROUP_LIVE) {
+            return group;
+        }
+    }
+    return NULL;
+}
@@ -0,0 +1,55 @@
+#ifndef DEFERRED_H
+#define DEFERRED_H
+
+#include "parse.h"
+
+// struct for a validated Deliver, Withdraw or Transfer kept until Execute
+typedef struct {
+    Verb verb;
+    int quantity;
+    // index of the shard owning the item
+    int shard;
+    // item name followed by the Transfer destination (one allocation)
+    char *names;
+    // slices of names (target is only set for Transfer)
+    Slice item;
+    Slice target;
+} Deferred;
+
+// struct for the commands deferred under one key
+typedef struct {
+    int key;
+    // 1 while the group holds a key, -1 once removed (0 if never used)
+    int state;
+    // commands in the order they were deferred
+    Deferred *commands;
+    int count;
+    int capacity;
+} DeferredGroup;
+
+/*
+ * Deferred commands grouped by key. An open addressing hash table maps each
+ * key to its group, so deferring a command is amortised O(1), and taking the
+ * commands for a key costs O(1) plus the number of commands taken. This data
+ * structure (by itself) is not threadsafe.
+ */
+typedef struct {
+    // power of two
+    DeferredGroup *groups;
+    int capacity;
+    // groups holding a key or removed
+    int used;
+    // keys and commands currently deferred (read without locking)
+    int keys;
+    int commands;
+} DeferredStore;
+
+void init_deferred(DeferredStore *store);
+
+void add_deferred(DeferredStore *store, int key, Deferred *command);
+
+int take_deferred(DeferredStore *store, int key, Deferred **commands);
+
+DeferredGroup *next_deferred_group(DeferredStore *store, int *position);
+
+#endif
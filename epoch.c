@@ -0,0 +1,156 @@
+#include "epoch.h"
+#include <pthread.h>
+#include <stdbool.h>
+#include <stdlib.h>
+
+// Lowest bit of a record's state, set while inside a critical section.
+#define EPOCH_ACTIVE 1UL
+
+// A piece of memory waiting for every reader to move past its epoch.
+typedef struct Retired {
+    void *data;
+    void (*clean)(void *);
+    unsigned long epoch;
+    struct Retired *next;
+} Retired;
+
+// Per-thread reclamation state. Records are never freed, only reused.
+typedef struct EpochRecord {
+    // (epoch << 1) | EPOCH_ACTIVE while in a critical section, 0 otherwise.
+    unsigned long state;
+    // 1 while owned by a live thread.
+    int inUse;
+    // memory retired by the owning thread, oldest last.
+    Retired *limbo;
+    struct EpochRecord *next;
+} EpochRecord;
+
+static unsigned long globalEpoch = 1;
+static EpochRecord *records = NULL;
+static pthread_key_t recordKey;
+static pthread_once_t recordOnce = PTHREAD_ONCE_INIT;
+static __thread EpochRecord *self = NULL;
+
+/**
+ * Function to hand a thread's record back for reuse when the thread exits
+ * @param data - EpochRecord owned by the exiting thread
+ */
+static void release_record(void *data) {
+    EpochRecord *record = (EpochRecord *) data;
+    __atomic_store_n(&record->state, 0, __ATOMIC_RELEASE);
+    __atomic_store_n(&record->inUse, 0, __ATOMIC_RELEASE);
+}
+
+/**
+ * Function to create the key used to release records on thread exit
+ */
+static void create_record_key(void) {
+    pthread_key_create(&recordKey, release_record);
+}
+
+/**
+ * Function to find (or create) a record for the calling thread
+ * @return EpochRecord owned by the calling thread
+ */
+static EpochRecord *register_thread(void) {
+    pthread_once(&recordOnce, create_record_key);
+
+    // reuse a record left behind by an exited thread where possible
+    EpochRecord *record = __atomic_load_n(&records, __ATOMIC_ACQUIRE);
+    for (; record != NULL; record = record->next) {
+        int expected = 0;
+        if (__atomic_compare_exchange_n(&record->inUse, &expected, 1, false,
+                __ATOMIC_ACQ_REL, __ATOMIC_RELAXED)) {
+            break;
+        }
+    }
+
+    if (record == NULL) {
+        // push a new record onto the global list
+        record = calloc(1, sizeof(EpochRecord));
+        record->inUse = 1;
+        record->next = __atomic_load_n(&records, __ATOMIC_RELAXED);
+        while (!__atomic_compare_exchange_n(&records, &record->next, record,
+                true, __ATOMIC_RELEASE, __ATOMIC_RELAXED)) {
+        }
+    }
+
+    pthread_setspecific(recordKey, record);
+    self = record;
+    return record;
+}
+
+/**
+ * Function to enter a read-side critical section
+ */
+void epoch_enter(void) {
+    EpochRecord *record = self ? self : register_thread();
+    unsigned long epoch = __atomic_load_n(&globalEpoch, __ATOMIC_RELAXED);
+    __atomic_store_n(&record->state, (epoch << 1) | EPOCH_ACTIVE,
+            __ATOMIC_RELAXED);
+    // the announcement must be visible before any shared memory is read
+    __atomic_thread_fence(__ATOMIC_SEQ_CST);
+}
+
+/**
+ * Function to leave a read-side critical section
+ */
+void epoch_exit(void) {
+    __atomic_store_n(&self->state, 0, __ATOMIC_RELEASE);
+}
+
+/**
+ * Function to retire memory once it has been unlinked
+ * @param data - memory to clean up
+ * @param clean - function used to clean up the memory
+ */
+void epoch_retire(void *data, void (*clean)(void *)) {
+    EpochRecord *record = self ? self : register_thread();
+    Retired *retired = malloc(sizeof(Retired));
+    retired->data = data;
+    retired->clean = clean;
+    retired->epoch = __atomic_load_n(&globalEpoch, __ATOMIC_ACQUIRE);
+    retired->next = record->limbo;
+    record->limbo = retired;
+}
+
+/**
+ * Function to advance the global epoch if every active thread has observed it
+ * @return the (possibly advanced) global epoch
+ */
+static unsigned long try_advance(void) {
+    __atomic_thread_fence(__ATOMIC_SEQ_CST);
+    unsigned long epoch = __atomic_load_n(&globalEpoch, __ATOMIC_ACQUIRE);
+    EpochRecord *record = __atomic_load_n(&records, __ATOMIC_ACQUIRE);
+    for (; record != NULL; record = record->next) {
+        unsigned long state = __atomic_load_n(&record->state,
+                __ATOMIC_ACQUIRE);
+        if ((state & EPOCH_ACTIVE) && (state >> 1) != epoch) {
+            return epoch; // a reader is still behind
+        }
+    }
+    __atomic_compare_exchange_n(&globalEpoch, &epoch, epoch + 1, false,
+            __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE);
+    return __atomic_load_n(&globalEpoch, __ATOMIC_ACQUIRE);
+}
+
+/**
+ * Function to free retired memory which no reader can still reference
+ */
+void epoch_collect(void) {
+    EpochRecord *record = self ? self : register_thread();
+    unsigned long epoch = try_advance();
+
+    // memory retired two epochs ago is unreachable by every reader
+    Retired **link = &record->limbo;
+    while (*link != NULL) {
+        Retired *retired = *link;
+        if (retired->epoch + 2 <= epoch) {
+            *link = retired->next;
+            retired->clean(retired->data);
+            free(retired);
+        } else {
+            link = &retired->next;
+        }
+    }
+}
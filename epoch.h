@@ -0,0 +1,40 @@
+#ifndef _EPOCH_H_
+#define _EPOCH_H_
+
+/*
+ * Epoch based memory reclamation. Lock-free readers call epoch_enter() before
+ * touching shared memory which may be unlinked by another thread, and
+ * epoch_exit() once they hold no more references to it. Memory unlinked by a
+ * writer is handed to epoch_retire(), and is only freed once every thread that
+ * could have seen it has left its critical section.
+ *
+ * Critical sections must not nest, and must not block.
+ */
+
+/*
+ * Marks the start of a read-side critical section for the calling thread.
+ * The first call from a thread registers it with the reclamation domain.
+ */
+void epoch_enter(void);
+
+/*
+ * Marks the end of a read-side critical section for the calling thread.
+ */
+void epoch_exit(void);
+
+/*
+ * Hands a piece of memory which is no longer reachable from any shared
+ * structure to the reclamation domain. Takes as arguments the memory, and the
+ * function used to clean it up once no reader can still hold it (for example
+ * free).
+ */
+void epoch_retire(void *data, void (*clean)(void *));
+
+/*
+ * Attempts to advance the global epoch and cleans up any memory retired by the
+ * calling thread which is now safe to free. Called periodically by threads
+ * which retire memory.
+ */
+void epoch_collect(void);
+
+#endif // _EPOCH_H_
@@ -0,0 +1,329 @@
+#include <errno.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <sys/socket.h>
+#include "event.h"
+#include "comms.h"
+#include "trace.h"
+
+// Maximum events handled per epoll_wait call.
+#define EVENT_BATCH 64
+// Starting size of each connection's read buffer.
+#define BUFFER_START 512
+// Reads from one connection before moving on to the others.
+#define READS_PER_EVENT 16
+
+/**
+ * Function called (by the worker) when a paused connection gets credit back
+ * @param owner - void pointer (parsed to ThreadData struct)
+ */
+static void resume_connection(void *owner) {
+    ThreadData *connection = (ThreadData *) owner;
+    EventLoop *loop = connection->loop;
+    uint64_t one = 1;
+
+    write_channel(loop->resumed, connection);
+    if (write(loop->wakeFd, &one, sizeof(one)) < 0) {
+        // counter already non-zero, the loop is being woken anyway
+    }
+}
+
+/**
+ * Function to start (or restart) watching a connection for input
+ * @param connection - ThreadData of the connection
+ */
+static void arm_connection(ThreadData *connection) {
+    struct epoll_event event;
+    event.events = EPOLLIN;
+    event.data.ptr = connection;
+    epoll_ctl(connection->loop->epollFd, EPOLL_CTL_ADD,
+            fileno(connection->streamFrom), &event);
+}
+
+/**
+ * Function to stop watching a connection for input
+ * @param connection - ThreadData of the connection
+ */
+static void disarm_connection(ThreadData *connection) {
+    epoll_ctl(connection->loop->epollFd, EPOLL_CTL_DEL,
+            fileno(connection->streamFrom), NULL);
+}
+
+/**
+ * Function to decode a frame at the start of a connection's unsent input
+ * @param connection - ThreadData of the connection
+ * @param frame - start of the frame (its marker byte)
+ * @param available - number of bytes buffered from the start of the frame
+ * @param command - Command to fill in if the frame holds one
+ * @param size - set to the number of bytes in the frame
+ * @return 1 if a command was decoded, 0 if not, -1 if the frame is
+ * incomplete, -2 if the header is malformed
+ */
+static int split_frame(ThreadData *connection, const char *frame,
+        int available, Command *command, int *size) {
+    int length;
+    int header = frame_header((const unsigned char *) frame, available,
+            &length);
+    if (header <= 0) {
+        return header - 1;
+    }
+    *size = header + length;
+    // decoding a Deliver has no side effects, so the frame can be decoded
+    // again if the connection runs out of credit
+    return read_frame(&connection->frames,
+            (const unsigned char *) frame + header, length, command) == 1;
+}
+
+/**
+ * Function to measure the lines of a Batch, if they have all arrived
+ * @param lines - start of the first line after the Batch header
+ * @param available - number of bytes buffered from there
+ * @param count - number of lines in the batch
+ * @return number of bytes in the lines, -1 if some are still to arrive
+ */
+static int batch_length(const char *lines, int available, int count) {
+    int used = 0;
+    for (int i = 0; i < count; i++) {
+        const char *end = memchr(lines + used, '\n', available - used);
+        if (end == NULL) {
+            return -1;
+        }
+        used = end - lines + 1;
+    }
+    return used;
+}
+
+/**
+ * Function to split the lines of a Batch between the shards
+ * @param connection - ThreadData of the connection
+ * @param lines - start of the first line after the Batch header
+ * @param length - number of bytes in the lines
+ * @return last part of the batch to post to the worker, NULL if the batch
+ * had no usable lines
+ */
+static Message *split_batch(ThreadData *connection, char *lines,
+        int length) {
+    Message **parts = calloc(connection->depot->shardCount,
+            sizeof(Message *));
+    int start = 0;
+    while (start < length) {
+        char *end = memchr(lines + start, '\n', length - start);
+        int size = end - (lines + start) + 1;
+        add_batch_line(connection, parts, lines + start, size);
+        start += size;
+    }
+    Message *last = finish_batch(connection, parts);
+    free(parts);
+    return last;
+}
+
+/**
+ * Function to post every complete line (and frame) in a connection's buffer
+ * to the worker
+ * @param connection - ThreadData of the connection
+ */
+static void split_lines(ThreadData *connection) {
+    int start = connection->bufferStart;
+    while (!connection->paused) {
+        char *line = connection->buffer->data + start;
+        int available = connection->bufferUsed - start;
+        Command command;
+        int framed = 0;
+        int header = 0; // bytes in the header line of a Batch
+        int lines = 1; // lines (or frames) taken from the buffer
+        int length;
+
+        if (available > 0 && connection->depot->config.frames
+                && (unsigned char) line[0] == FRAME_MARKER) {
+            // frames can only arrive if we offered them
+            framed = split_frame(connection, line, available, &command,
+                    &length);
+            if (framed == -1) {
+                break; // partial frame, wait for the rest
+            } else if (framed < 0) {
+                // the stream cannot be followed past a bad header
+                disarm_connection(connection);
+                connection->ignore = 1;
+                drop_buffer(connection);
+                __atomic_store_n(&connection->metrics.closed, 1,
+                        __ATOMIC_RELAXED);
+                return;
+            } else if (framed == 0) {
+                count_received(&connection->metrics, length, 1);
+                start += length; // nothing for the worker
+                continue;
+            }
+        } else {
+            char *end = memchr(line, '\n', available);
+            if (end == NULL) {
+                break; // partial line, wait for the rest
+            }
+            length = end - line + 1;
+            int count = parse_batch(line, length);
+            if (count > 0) {
+                lines += count;
+                // a batch is only split once all of it has arrived
+                int rest = batch_length(line + length, available - length,
+                        count);
+                if (rest < 0) {
+                    break;
+                }
+                header = length;
+                length += rest;
+            }
+        }
+        if (!try_acquire_credit(&connection->credits)) {
+            connection->paused = 1; // resume_connection will be called
+            break;
+        }
+
+        Message *message;
+        if (framed) {
+            message = new_frame_message(connection, &command);
+        } else if (header) {
+            message = split_batch(connection, line + header, length - header);
+        } else {
+            message = new_line_message(connection, line, length);
+        }
+        if (message != NULL) {
+            post_message(connection->depot, message);
+        } else {
+            release_credit(&connection->credits); // nothing for the worker
+        }
+        count_received(&connection->metrics, length, lines);
+        start += length;
+    }
+
+    // leftover (partial or unsent) lines stay for the next call
+    connection->bufferStart = start;
+}
+
+/**
+ * Function to read whatever is available from a connection
+ * @param connection - ThreadData of the connection
+ */
+static void read_connection(ThreadData *connection) {
+    int fd = fileno(connection->streamFrom);
+    for (int reads = 0; reads < READS_PER_EVENT && !connection->paused
+            && !connection->ignore; reads++) {
+        reserve_buffer(connection);
+        ReadBuffer *buffer = connection->buffer;
+        ssize_t got = recv(fd, buffer->data + connection->bufferUsed,
+                buffer->size - connection->bufferUsed, MSG_DONTWAIT);
+        if (got > 0) {
+            connection->bufferUsed += got;
+            split_lines(connection);
+        } else if (got < 0 && errno == EINTR) {
+            continue;
+        } else if (got < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+            return; // drained for now
+        } else {
+            // EOF or error from depot (disconnects)
+            disarm_connection(connection);
+            connection->ignore = 1;
+            drop_buffer(connection);
+            __atomic_store_n(&connection->metrics.closed, 1,
+                    __ATOMIC_RELAXED);
+            return;
+        }
+    }
+
+    if (connection->paused) {
+        // stop reading so the socket buffer fills and the sender slows down
+        disarm_connection(connection);
+    }
+}
+
+/**
+ * Function to pick up connections whose credit has been returned
+ * @param loop - EventLoop the connections belong to
+ */
+static void handle_resumed(EventLoop *loop) {
+    uint64_t count;
+    if (read(loop->wakeFd, &count, sizeof(count)) < 0) {
+        // spurious wake, still drain the channel
+    }
+
+    ThreadData *connection;
+    while (read_channel(loop->resumed, (void **) &connection)) {
+        if (!connection->paused || connection->ignore) {
+            continue; // credit came back before we ran out
+        }
+        connection->paused = 0;
+        end_pause(&connection->credits);
+
+        // lines may already be buffered, send them before reading more
+        split_lines(connection);
+        if (!connection->paused && !connection->ignore) {
+            arm_connection(connection);
+        }
+    }
+}
+
+/**
+ * Function for an I/O thread to wait for and handle socket events
+ * @param data - void pointer (parsed to EventLoop struct)
+ * @return void pointer
+ */
+static void *event_loop(void *data) {
+    EventLoop *loop = (EventLoop *) data;
+    struct epoll_event events[EVENT_BATCH];
+    trace_name_thread("io");
+    while (1) {
+        int count = epoll_wait(loop->epollFd, events, EVENT_BATCH, -1);
+        for (int i = 0; i < count; i++) {
+            if (events[i].data.ptr == NULL) {
+                handle_resumed(loop);
+            } else {
+                read_connection((ThreadData *) events[i].data.ptr);
+            }
+        }
+    }
+    return NULL;
+}
+
+/**
+ * Function to start the event loop threads
+ * @param info - Depot struct holding related data.
+ */
+void start_event_loops(Depot *info) {
+    info->loops = malloc(sizeof(EventLoop) * info->config.ioThreads);
+    info->nextLoop = 0;
+    for (int i = 0; i < info->config.ioThreads; i++) {
+        EventLoop *loop = &info->loops[i];
+        loop->epollFd = epoll_create1(0);
+        loop->wakeFd = eventfd(0, EFD_NONBLOCK);
+        loop->resumed = new_channel();
+
+        // the wake fd is marked with a NULL pointer
+        struct epoll_event event;
+        event.events = EPOLLIN;
+        event.data.ptr = NULL;
+        epoll_ctl(loop->epollFd, EPOLL_CTL_ADD, loop->wakeFd, &event);
+
+        pthread_t tid;
+        pthread_create(&tid, 0, event_loop, (void *) loop);
+        pthread_detach(tid);
+    }
+}
+
+/**
+ * Function to hand a connection to one of the event loops
+ * @param info - Depot struct holding related data.
+ * @param connection - ThreadData of the connection
+ */
+void watch_connection(Depot *info, ThreadData *connection) {
+    unsigned int next = __atomic_fetch_add(&info->nextLoop, 1,
+            __ATOMIC_RELAXED);
+    connection->loop = &info->loops[next % info->config.ioThreads];
+    connection->buffer = new_read_buffer(BUFFER_START);
+    connection->bufferStart = 0;
+    connection->bufferUsed = 0;
+    connection->paused = 0;
+    connection->credits.resume = resume_connection;
+    connection->credits.owner = connection;
+
+    arm_connection(connection);
+}
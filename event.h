@@ -0,0 +1,23 @@
+#ifndef EVENT_H
+#define EVENT_H
+
+#include "2310depot.h"
+
+/*
+ * An I/O thread multiplexing many connections with epoll. Lines read from a
+ * connection are posted straight to the worker, and a connection out of
+ * credit is taken out of the epoll set until the worker hands credit back.
+ */
+typedef struct EventLoop {
+    int epollFd;
+    // eventfd signalled when a paused connection gets credit back
+    int wakeFd;
+    // connections whose credit has returned (written by the worker)
+    struct Channel *resumed;
+} EventLoop;
+
+void start_event_loops(Depot *info);
+
+void watch_connection(Depot *info, ThreadData *connection);
+
+#endif
@@ -0,0 +1,172 @@
+#include <time.h>
+#include "flow.h"
+#include "futex.h"
+
+/**
+ * Function to read the monotonic clock
+ * @return nanoseconds since an arbitrary point
+ */
+static unsigned long now_nanos(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (unsigned long) ts.tv_sec * 1000000000UL + ts.tv_nsec;
+}
+
+/**
+ * Function to set up credit for a new connection
+ * @param credits - Credits struct to initialise
+ * @param limit - number of credits (0 for unbounded)
+ * @param stats - depot-wide FlowStats to record pauses in
+ */
+void init_credits(Credits *credits, int limit, FlowStats *stats) {
+    credits->available = limit;
+    credits->limit = limit;
+    credits->blocked = 0;
+    credits->sequence = 0;
+    credits->stats = stats;
+    credits->pausedSince = 0;
+    credits->resume = NULL;
+    credits->owner = NULL;
+}
+
+/**
+ * Function to record the start of a pause for credit
+ * @param credits - Credits of the paused connection
+ */
+static void start_pause(Credits *credits) {
+    FlowStats *stats = credits->stats;
+    credits->pausedSince = now_nanos();
+    __atomic_fetch_add(&stats->pausedConnections, 1, __ATOMIC_RELAXED);
+    __atomic_fetch_add(&stats->pauses, 1, __ATOMIC_RELAXED);
+}
+
+/**
+ * Function to record the end of a pause for credit
+ * @param credits - Credits of the resumed connection
+ */
+void end_pause(Credits *credits) {
+    FlowStats *stats = credits->stats;
+    __atomic_fetch_sub(&stats->pausedConnections, 1, __ATOMIC_RELAXED);
+    __atomic_fetch_add(&stats->pausedNanos,
+            now_nanos() - credits->pausedSince, __ATOMIC_RELAXED);
+}
+
+/**
+ * Function to check whether a connection may hand another line to the worker
+ * @param credits - Credits of the connection
+ * @return 1 if a credit can be taken
+ */
+static int credit_ready(Credits *credits) {
+    if (__atomic_load_n(&credits->blocked, __ATOMIC_ACQUIRE)) {
+        return 0;
+    }
+    return credits->limit == 0
+            || __atomic_load_n(&credits->available, __ATOMIC_ACQUIRE) > 0;
+}
+
+/**
+ * Function to tell a paused reader that it may be able to continue
+ * @param credits - Credits of the connection
+ */
+static void notify_reader(Credits *credits) {
+    if (credits->resume != NULL) {
+        credits->resume(credits->owner);
+    } else {
+        __atomic_fetch_add(&credits->sequence, 1, __ATOMIC_ACQ_REL);
+        futex_wake(&credits->sequence, 1);
+    }
+}
+
+/**
+ * Function to take a credit before handing a line to the worker, waiting
+ * (without reading the socket) if the connection has none left.
+ * @param credits - Credits of the connection
+ */
+void acquire_credit(Credits *credits) {
+    if (!credit_ready(credits)) {
+        // out of credit, record the pause and sleep until the worker catches up
+        start_pause(credits);
+        while (1) {
+            int sequence = __atomic_load_n(&credits->sequence,
+                    __ATOMIC_ACQUIRE);
+            if (credit_ready(credits)) {
+                break;
+            }
+            futex_wait(&credits->sequence, sequence);
+        }
+        end_pause(credits);
+    }
+
+    // only the listening thread takes credit, so this cannot go negative
+    if (credits->limit != 0) {
+        __atomic_fetch_sub(&credits->available, 1, __ATOMIC_ACQ_REL);
+    }
+}
+
+/**
+ * Function to take a credit without blocking. On failure the connection is
+ * counted as paused until end_pause() is called, and credits->resume will be
+ * called once credit is returned.
+ * @param credits - Credits of the connection
+ * @return 1 if a credit was taken
+ *         0 if the connection is out of credit
+ */
+int try_acquire_credit(Credits *credits) {
+    if (!credit_ready(credits)) {
+        start_pause(credits);
+        return 0;
+    }
+    if (credits->limit != 0) {
+        __atomic_fetch_sub(&credits->available, 1, __ATOMIC_ACQ_REL);
+    }
+    return 1;
+}
+
+/**
+ * Function to hand a credit back once the worker is done with a line
+ * @param credits - Credits of the connection (may be NULL)
+ */
+void release_credit(Credits *credits) {
+    if (credits == NULL || credits->limit == 0) {
+        return;
+    }
+    if (__atomic_fetch_add(&credits->available, 1, __ATOMIC_ACQ_REL) == 0) {
+        // the reader may be paused waiting for this credit
+        notify_reader(credits);
+    }
+}
+
+/**
+ * Function to stop a connection reading until unblock_credit is called
+ * @param credits - Credits of the connection
+ */
+void block_credit(Credits *credits) {
+    __atomic_store_n(&credits->blocked, 1, __ATOMIC_RELEASE);
+}
+
+/**
+ * Function to let a blocked connection read again
+ * @param credits - Credits of the connection
+ */
+void unblock_credit(Credits *credits) {
+    __atomic_store_n(&credits->blocked, 0, __ATOMIC_RELEASE);
+    notify_reader(credits);
+}
+
+/**
+ * Function to print flow control counters
+ * @param stats - FlowStats to print
+ * @param depth - messages waiting for the workers
+ * @param out - stream to print to
+ */
+void flow_report(FlowStats *stats, unsigned long depth, FILE *out) {
+    fprintf(out, "Flow:\n");
+    fprintf(out, "depth %lu\n", depth);
+    fprintf(out, "paused %ld\n",
+            __atomic_load_n(&stats->pausedConnections, __ATOMIC_RELAXED));
+    fprintf(out, "pauses %lu\n",
+            __atomic_load_n(&stats->pauses, __ATOMIC_RELAXED));
+    fprintf(out, "pausedMs %lu\n",
+            __atomic_load_n(&stats->pausedNanos, __ATOMIC_RELAXED) / 1000000);
+    fflush(out);
+}
@@ -0,0 +1,61 @@
+#ifndef FLOW_H
+#define FLOW_H
+
+#include <stdio.h>
+
+/*
+ * Depot-wide flow control counters. Updated atomically by the listening
+ * threads and the worker, and read without locking.
+ */
+typedef struct {
+    // connections currently waiting for credit
+    long pausedConnections;
+    // times any connection has had to wait for credit
+    unsigned long pauses;
+    // total time connections have spent waiting for credit
+    unsigned long pausedNanos;
+} FlowStats;
+
+/*
+ * Per-connection credit. A listening thread takes one credit for every line
+ * it hands to the worker, and the worker returns it once the line has been
+ * processed. A connection without credit stops reading its socket, so TCP
+ * flow control pushes back on the sending depot.
+ */
+typedef struct {
+    // credits left
+    int available;
+    // credits the connection started with (0 for unbounded)
+    int limit;
+    // 1 while a message from the connection must finish before the next
+    // line is read (regardless of credit)
+    int blocked;
+    // bumped whenever credit returns (futex word the listening thread
+    // sleeps on)
+    int sequence;
+    FlowStats *stats;
+    // when the current pause started
+    unsigned long pausedSince;
+    // called instead of a futex wake when credit returns to a connection
+    // that does not block waiting for it (NULL for blocking readers)
+    void (*resume)(void *owner);
+    void *owner;
+} Credits;
+
+void init_credits(Credits *credits, int limit, FlowStats *stats);
+
+void acquire_credit(Credits *credits);
+
+int try_acquire_credit(Credits *credits);
+
+void end_pause(Credits *credits);
+
+void block_credit(Credits *credits);
+
+void unblock_credit(Credits *credits);
+
+void release_credit(Credits *credits);
+
+void flow_report(FlowStats *stats, unsigned long depth, FILE *out);
+
+#endif
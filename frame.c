@@ -0,0 +1,219 @@
+#include <limits.h>
+#include <stdlib.h>
+#include <string.h>
+#include "frame.h"
+
+// Longest item name which fits in a FRAME_NAME payload.
+#define FRAME_NAME_MAX (FRAME_MAX - 1 - VARINT_MAX)
+
+/**
+ * Function to write an unsigned number as a varint (7 bits per byte, low bits
+ * first, top bit set on every byte but the last)
+ * @param out - buffer with room for VARINT_MAX bytes
+ * @param value - number to write
+ * @return number of bytes written
+ */
+int encode_varint(unsigned char *out, unsigned int value) {
+    int used = 0;
+    while (value >= 0x80) {
+        out[used++] = (value & 0x7F) | 0x80;
+        value >>= 7;
+    }
+    out[used++] = value;
+    return used;
+}
+
+/**
+ * Function to read a varint
+ * @param in - bytes to read from
+ * @param length - number of bytes available
+ * @param value - set to the number read
+ * @return number of bytes read, 0 if more bytes are needed, -1 if the varint
+ * is too long
+ */
+int decode_varint(const unsigned char *in, int length, unsigned int *value) {
+    unsigned int total = 0;
+    for (int i = 0; i < length; i++) {
+        if (i == VARINT_MAX || (i == VARINT_MAX - 1 && in[i] > 0x0F)) {
+            return -1; // more than 32 bits
+        }
+        total |= (unsigned int) (in[i] & 0x7F) << (7 * i);
+        if (!(in[i] & 0x80)) {
+            *value = total;
+            return i + 1;
+        }
+    }
+    return 0;
+}
+
+/**
+ * Function to create the sending half of a framed connection
+ * @return FrameWriter with no names bound
+ */
+FrameWriter *new_frame_writer(void) {
+    FrameWriter *writer = malloc(sizeof(FrameWriter));
+    init_inventory(&writer->names);
+    return writer;
+}
+
+/**
+ * Function to wrap a payload in a frame
+ * @param out - buffer with room for the payload and FRAME_OVERHEAD bytes
+ * @param payload - payload bytes
+ * @param length - number of payload bytes
+ * @return number of bytes written
+ */
+static int put_frame(unsigned char *out, const unsigned char *payload,
+        int length) {
+    out[0] = FRAME_MARKER;
+    int used = 1 + encode_varint(out + 1, length);
+    memcpy(out + used, payload, length);
+    return used + length;
+}
+
+/**
+ * Function to encode a Deliver as a frame, binding the item's name first if
+ * it has not been sent on this stream before
+ * @param writer - FrameWriter for the stream
+ * @param out - buffer with room for the name and FRAME_DELIVER_EXTRA bytes
+ * @param name - item name (need not be terminated)
+ * @param length - number of characters in the name
+ * @param quantity - quantity to deliver
+ * @return number of bytes written, 0 if the name is too long for a frame
+ * (so the Deliver must be sent as text)
+ */
+int encode_deliver_frame(FrameWriter *writer, unsigned char *out,
+        const char *name, int length, int quantity) {
+    if (length > FRAME_NAME_MAX) {
+        return 0;
+    }
+
+    unsigned char payload[FRAME_MAX];
+    int used = 0;
+    int id = inventory_find(&writer->names, name, length);
+    if (id == -1) {
+        // bind the name, ids are never reused as counts never drop
+        inventory_adjust(&writer->names, name, length, 1);
+        id = inventory_find(&writer->names, name, length);
+        payload[0] = FRAME_NAME;
+        int size = 1 + encode_varint(payload + 1, id);
+        memcpy(payload + size, name, length);
+        used += put_frame(out + used, payload, size + length);
+    }
+
+    payload[0] = FRAME_DELIVER;
+    int size = 1 + encode_varint(payload + 1, id);
+    size += encode_varint(payload + size, quantity);
+    used += put_frame(out + used, payload, size);
+    return used;
+}
+
+/**
+ * Function to read the header of a frame
+ * @param in - bytes starting with FRAME_MARKER
+ * @param length - number of bytes available
+ * @param payload - set to the number of payload bytes
+ * @return number of header bytes, 0 if the whole frame has not arrived yet,
+ * -1 if the header is malformed
+ */
+int frame_header(const unsigned char *in, int length, int *payload) {
+    unsigned int size;
+    int used = decode_varint(in + 1, length - 1, &size);
+    if (used <= 0) {
+        return used;
+    }
+    if (size == 0 || size > FRAME_MAX) {
+        return -1;
+    }
+    if (1 + used + (int) size > length) {
+        return 0;
+    }
+    *payload = size;
+    return 1 + used;
+}
+
+/**
+ * Function to check that a bound name could have arrived in a text command
+ * @param name - characters of the name
+ * @param length - number of characters
+ * @return 0 if the name is legal, -1 otherwise
+ */
+static int check_name(const unsigned char *name, int length) {
+    if (length == 0) {
+        return -1;
+    }
+    for (int i = 0; i < length; i++) {
+        if (name[i] == ':' || name[i] == ' ' || name[i] == '\r'
+                || name[i] == '\n' || name[i] == '\0') {
+            return -1;
+        }
+    }
+    return 0;
+}
+
+/**
+ * Function to record a name bound by the peer
+ * @param reader - FrameReader for the connection
+ * @param id - id being bound (at most one past the last bound id)
+ * @param name - characters of the name
+ * @param length - number of characters
+ * @return 0 if bound, -1 if the binding is malformed
+ */
+static int bind_name(FrameReader *reader, unsigned int id,
+        const unsigned char *name, int length) {
+    if (id > reader->count || check_name(name, length) != 0) {
+        return -1;
+    }
+    if (id == reader->count) {
+        if (reader->count == reader->capacity) {
+            reader->capacity = reader->capacity ? reader->capacity * 2 : 16;
+            reader->names = realloc(reader->names,
+                    sizeof(char *) * reader->capacity);
+            reader->lengths = realloc(reader->lengths,
+                    sizeof(int) * reader->capacity);
+        }
+        reader->count++;
+    } else {
+        free(reader->names[id]);
+    }
+    reader->names[id] = strndup((const char *) name, length);
+    reader->lengths[id] = length;
+    return 0;
+}
+
+/**
+ * Function to decode the payload of a frame
+ * @param reader - FrameReader for the connection
+ * @param payload - payload bytes
+ * @param length - number of payload bytes
+ * @param command - Command to fill in (its item points into the reader, so
+ * should be copied before the next frame is read)
+ * @return 1 if a command was decoded, 0 if the frame only updated the
+ * reader, -1 if the frame is malformed
+ */
+int read_frame(FrameReader *reader, const unsigned char *payload, int length,
+        Command *command) {
+    unsigned int id;
+    int used = decode_varint(payload + 1, length - 1, &id);
+    if (used <= 0) {
+        return -1;
+    }
+    used++;
+
+    if (payload[0] == FRAME_NAME) {
+        return bind_name(reader, id, payload + used, length - used);
+    } else if (payload[0] == FRAME_DELIVER) {
+        unsigned int quantity;
+        int size = decode_varint(payload + used, length - used, &quantity);
+        if (size <= 0 || used + size != length || id >= reader->count
+                || quantity == 0 || quantity > INT_MAX) {
+            return -1;
+        }
+        command->verb = DELIVER;
+        command->quantity = quantity;
+        command->item.start = reader->names[id];
+        command->item.length = reader->lengths[id];
+        return 1;
+    }
+    return -1;
+}
@@ -0,0 +1,68 @@
+#ifndef FRAME_H
+#define FRAME_H
+
+#include "inventory.h"
+#include "parse.h"
+
+// First byte of every frame. Text commands always start with a letter.
+#define FRAME_MARKER 0xF5
+// Version of the framing offered in the Frames capability line.
+#define FRAME_VERSION 1
+// Largest frame payload accepted.
+#define FRAME_MAX 1024
+// Most bytes a varint may take (enough for 32 bits).
+#define VARINT_MAX 5
+// Bytes a frame takes on top of its payload.
+#define FRAME_OVERHEAD (1 + VARINT_MAX)
+// Most bytes an encoded Deliver takes on top of its item name (a name
+// binding frame, then the Deliver frame).
+#define FRAME_DELIVER_EXTRA (2 * FRAME_OVERHEAD + 1 + VARINT_MAX \
+        + 1 + 2 * VARINT_MAX)
+
+/*
+ * Binary framing between depots which have both offered it (with a
+ * "Frames:1" line after their IM). Each frame is FRAME_MARKER, the payload
+ * length as a varint, then the payload: an opcode byte followed by its
+ * fields.
+ *
+ * FRAME_NAME    varint id, name bytes - binds an item name to an id
+ * FRAME_DELIVER varint id, varint quantity - same as Deliver:quantity:name
+ *
+ * Item names are sent once per connection, after which Deliver frames only
+ * carry the id.
+ */
+typedef enum {
+    FRAME_NAME = 1,
+    FRAME_DELIVER = 2
+} FrameOp;
+
+// struct for the sending half of a framed connection (used by one thread)
+typedef struct {
+    // names already bound on this stream, each name's slot is its id
+    Inventory names;
+} FrameWriter;
+
+// struct for the receiving half of a framed connection (zeroed when empty)
+typedef struct {
+    // names bound by the peer, indexed by id
+    char **names;
+    int *lengths;
+    int count;
+    int capacity;
+} FrameReader;
+
+int encode_varint(unsigned char *out, unsigned int value);
+
+int decode_varint(const unsigned char *in, int length, unsigned int *value);
+
+FrameWriter *new_frame_writer(void);
+
+int encode_deliver_frame(FrameWriter *writer, unsigned char *out,
+        const char *name, int length, int quantity);
+
+int frame_header(const unsigned char *in, int length, int *payload);
+
+int read_frame(FrameReader *reader, const unsigned char *payload, int length,
+        Command *command);
+
+#endif
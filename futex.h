@@ -0,0 +1,23 @@
+#ifndef _FUTEX_H_
+#define _FUTEX_H_
+
+#include <linux/futex.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+
+/*
+ * Blocks the calling thread while *word still holds value. May return
+ * spuriously, so callers re-check their condition in a loop.
+ */
+static inline void futex_wait(int *word, int value) {
+    syscall(SYS_futex, word, FUTEX_WAIT_PRIVATE, value, NULL, NULL, 0);
+}
+
+/*
+ * Wakes up to count threads blocked in futex_wait on word.
+ */
+static inline void futex_wake(int *word, int count) {
+    syscall(SYS_futex, word, FUTEX_WAKE_PRIVATE, count, NULL, NULL, 0);
+}
+
+#endif // _FUTEX_H_
@@ -0,0 +1,18 @@
+#ifndef HASH_H
+#define HASH_H
+
+#include <stdint.h>
+
+/*
+ * FNV-1a hash of length bytes starting at data.
+ */
+static inline uint32_t hash_bytes(const char *data, int length) {
+    uint32_t hash = 2166136261u;
+    for (int i = 0; i < length; i++) {
+        hash ^= (unsigned char) data[i];
+        hash *= 16777619u;
+    }
+    return hash;
+}
+
+#endif
@@ -0,0 +1,404 @@
+#include <stdbool.h>
+#include <stdlib.h>
+#include <string.h>
+#include "inventory.h"
+#include "hash.h"
+#include "epoch.h"
+
+// Index entry markers (anything else is a slot + 1).
+#define INDEX_EMPTY 0
+#define INDEX_TOMBSTONE -1
+
+/**
+ * Function to pack a count with its slot's generation. Even generations
+ * hold an item, odd ones mark a slot emptied and waiting to be reused.
+ * @param generation - generation of the slot
+ * @param count - count of the item
+ * @return the count word
+ */
+static uint64_t pack_count(uint32_t generation, int count) {
+    return ((uint64_t) generation << 32) | (uint32_t) count;
+}
+
+/**
+ * Function to find a slot's count word
+ * @param inventory - Inventory holding the slot
+ * @param slot - slot number
+ * @return the slot's count word
+ */
+static uint64_t *count_word(Inventory *inventory, int slot) {
+    int chunk = inventory_chunk(slot);
+    return &inventory->counts[chunk][inventory_offset(slot, chunk)];
+}
+
+/**
+ * Function to find a slot's name
+ * @param inventory - Inventory holding the slot
+ * @param slot - slot number
+ * @return the slot's name pointer
+ */
+static char **name_word(Inventory *inventory, int slot) {
+    int chunk = inventory_chunk(slot);
+    return &inventory->names[chunk][inventory_offset(slot, chunk)];
+}
+
+/**
+ * Function to allocate an empty hash index
+ * @param capacity - number of entries (power of two)
+ * @return new InventoryIndex
+ */
+static InventoryIndex *new_index(int capacity) {
+    InventoryIndex *index = calloc(1, sizeof(InventoryIndex)
+            + sizeof(InventoryEntry) * capacity);
+    index->capacity = capacity;
+    return index;
+}
+
+/**
+ * Function to create an empty inventory
+ * @param inventory - Inventory struct to initialise
+ */
+void init_inventory(Inventory *inventory) {
+    memset(inventory->names, 0, sizeof(inventory->names));
+    memset(inventory->counts, 0, sizeof(inventory->counts));
+    memset(inventory->hashes, 0, sizeof(inventory->hashes));
+    inventory->slotCount = 0;
+    inventory->slotCapacity = 0;
+    inventory->freeSlots = NULL;
+    inventory->freeCount = 0;
+
+    inventory->index = new_index(INVENTORY_START * 2);
+    inventory->indexUsed = 0;
+    inventory->live = 0;
+    init_order(&inventory->order);
+}
+
+/**
+ * Function to free everything held by an inventory
+ * @param inventory - Inventory struct to destroy
+ */
+void destroy_inventory(Inventory *inventory) {
+    for (int i = 0; i < inventory->slotCount; i++) {
+        free(*name_word(inventory, i));
+    }
+    for (int i = 0; i < INVENTORY_CHUNKS; i++) {
+        free(inventory->names[i]);
+        free(inventory->counts[i]);
+        free(inventory->hashes[i]);
+    }
+    free(inventory->freeSlots);
+    free(inventory->index);
+    destroy_order(&inventory->order);
+}
+
+/**
+ * Function to find the index entry for a name (or where it would go). The
+ * caller must hold the lock.
+ * @param inventory - Inventory to search
+ * @param name - item name (need not be terminated)
+ * @param length - number of characters in the name
+ * @param hash - hash of the name
+ * @return position in the index of the name's entry, or of the first free
+ *         entry it would be inserted at
+ */
+static int probe(Inventory *inventory, const char *name, int length,
+        uint32_t hash) {
+    int mask = inventory->index->capacity - 1;
+    int position = hash & mask;
+    int insertAt = -1;
+    while (1) {
+        InventoryEntry *entry = &inventory->index->entries[position];
+        if (entry->slot == INDEX_EMPTY) {
+            return insertAt >= 0 ? insertAt : position;
+        }
+        if (entry->slot == INDEX_TOMBSTONE) {
+            if (insertAt < 0) {
+                insertAt = position;
+            }
+        } else if (entry->hash == hash) {
+            const char *stored = *name_word(inventory, entry->slot - 1);
+            if (strncmp(stored, name, length) == 0 && stored[length] == '\0') {
+                return position;
+            }
+        }
+        position = (position + 1) & mask; // linear probing
+    }
+}
+
+/**
+ * Function to store an index entry where lock-free lookups can see it
+ * @param entry - InventoryEntry to fill in
+ * @param slot - slot + 1, or one of the INDEX_ markers
+ * @param hash - hash of the slot's name
+ */
+static void set_entry(InventoryEntry *entry, int slot, uint32_t hash) {
+    // the hash must be in place before the slot is seen
+    __atomic_store_n(&entry->hash, hash, __ATOMIC_RELAXED);
+    __atomic_store_n(&entry->slot, slot, __ATOMIC_RELEASE);
+}
+
+/**
+ * Function to rebuild the index, dropping tombstones. Lock-free lookups may
+ * still be probing the old index, so it is retired.
+ * @param inventory - Inventory to re-index
+ * @param capacity - number of entries in the new index (power of two)
+ */
+static void rebuild_index(Inventory *inventory, int capacity) {
+    InventoryIndex *index = new_index(capacity);
+    inventory->indexUsed = inventory->live;
+
+    int mask = capacity - 1;
+    for (int slot = 0; slot < inventory->slotCount; slot++) {
+        if (*name_word(inventory, slot) == NULL) {
+            continue;
+        }
+        uint32_t hash = inventory_hash(inventory, slot);
+        int position = hash & mask;
+        while (index->entries[position].slot != INDEX_EMPTY) {
+            position = (position + 1) & mask;
+        }
+        index->entries[position].slot = slot + 1;
+        index->entries[position].hash = hash;
+    }
+
+    InventoryIndex *old = inventory->index;
+    __atomic_store_n(&inventory->index, index, __ATOMIC_RELEASE);
+    epoch_retire(old, free);
+    epoch_collect();
+}
+
+/**
+ * Function to hand out a slot for a new item, reusing reclaimed slots first
+ * @param inventory - Inventory to take a slot from
+ * @return slot number
+ */
+static int take_slot(Inventory *inventory) {
+    if (inventory->freeCount > 0) {
+        return inventory->freeSlots[--inventory->freeCount];
+    }
+    if (inventory->slotCount == inventory->slotCapacity) {
+        // add a chunk twice the size of the last, leaving the others where
+        // they are for lock-free lookups
+        int chunk = inventory_chunk(inventory->slotCount);
+        int size = INVENTORY_START << chunk;
+        inventory->names[chunk] = calloc(size, sizeof(char *));
+        inventory->counts[chunk] = calloc(size, sizeof(uint64_t));
+        inventory->hashes[chunk] = calloc(size, sizeof(uint32_t));
+        inventory->slotCapacity += size;
+        inventory->freeSlots = realloc(inventory->freeSlots,
+                sizeof(int) * inventory->slotCapacity);
+    }
+    return inventory->slotCount++;
+}
+
+/**
+ * Function to size the index for a number of items up front, so adding them
+ * does not rebuild it again and again as it fills. The caller must hold the
+ * lock.
+ * @param inventory - Inventory to grow
+ * @param items - number of items expected
+ */
+void inventory_reserve(Inventory *inventory, int items) {
+    int capacity = inventory->index->capacity;
+    while (capacity / 2 < items && capacity < (1 << 30)) {
+        capacity *= 2;
+    }
+    if (capacity != inventory->index->capacity) {
+        rebuild_index(inventory, capacity);
+    }
+}
+
+/**
+ * Function to look up the slot holding an item. The caller must hold the
+ * lock or be inside an epoch critical section, and without the lock the slot
+ * may hold another item by the time it is looked at (see inventory_read).
+ * @param inventory - Inventory to search
+ * @param name - item name (need not be terminated)
+ * @param length - number of characters in the name
+ * @return slot holding the item, or -1 if it is not stored
+ */
+int inventory_find(Inventory *inventory, const char *name, int length) {
+    uint32_t hash = hash_bytes(name, length);
+    InventoryIndex *index = __atomic_load_n(&inventory->index,
+            __ATOMIC_ACQUIRE);
+    int mask = index->capacity - 1;
+    for (int position = hash & mask;; position = (position + 1) & mask) {
+        InventoryEntry *entry = &index->entries[position];
+        int slot = __atomic_load_n(&entry->slot, __ATOMIC_ACQUIRE);
+        if (slot == INDEX_EMPTY) {
+            return -1;
+        }
+        if (slot <= 0 || __atomic_load_n(&entry->hash, __ATOMIC_RELAXED)
+                != hash) {
+            continue;
+        }
+        const char *stored = inventory_name(inventory, slot - 1);
+        if (stored != NULL && strncmp(stored, name, length) == 0
+                && stored[length] == '\0') {
+            return slot - 1;
+        }
+    }
+}
+
+/**
+ * Function to read the count of an item without the lock, from the slot it
+ * was found in. The caller must be inside an epoch critical section (or hold
+ * the lock), and the slot must have been found through the index or the
+ * ordered index after the critical section began.
+ * @param inventory - Inventory to read
+ * @param slot - slot the item was found in
+ * @param name - item name (need not be terminated)
+ * @param length - number of characters in the name
+ * @return the item's count, or 0 if the slot no longer holds it
+ */
+int inventory_read(Inventory *inventory, int slot, const char *name,
+        int length) {
+    // as in inventory_try_adjust, the name is read after the generation, so
+    // if the slot still holds the name the count is the item's
+    uint64_t seen = __atomic_load_n(count_word(inventory, slot),
+            __ATOMIC_ACQUIRE);
+    if ((seen >> 32) & 1) {
+        return 0; // emptied
+    }
+    const char *stored = inventory_name(inventory, slot);
+    if (stored == NULL || strncmp(stored, name, length) != 0
+            || stored[length] != '\0') {
+        return 0;
+    }
+    return (int) (uint32_t) seen;
+}
+
+/**
+ * Function to empty a slot whose count has been swapped to zero, so it can
+ * be reused for the next new item
+ * @param inventory - Inventory holding the slot
+ * @param position - position of the slot's entry in the index
+ * @param slot - slot to empty
+ */
+static void reclaim_slot(Inventory *inventory, int position, int slot) {
+    InventoryEntry *entry = &inventory->index->entries[position];
+    set_entry(entry, INDEX_TOMBSTONE, entry->hash);
+    char **name = name_word(inventory, slot);
+    order_remove(&inventory->order, *name);
+    // a lock-free lookup may still be comparing against the name
+    char *stored = *name;
+    __atomic_store_n(name, NULL, __ATOMIC_RELEASE);
+    epoch_retire(stored, free);
+    inventory->freeSlots[inventory->freeCount++] = slot;
+    inventory->live--;
+    epoch_collect();
+}
+
+/**
+ * Function to change the count of an item, adding the item if it is not
+ * stored and reclaiming its slot if its count drops to zero. The caller must
+ * hold the lock (inventory_try_adjust may run alongside it).
+ * @param inventory - Inventory to change
+ * @param name - item name (need not be terminated)
+ * @param length - number of characters in the name
+ * @param delta - amount to add to the count (negative to take away)
+ * @return the item's new count
+ */
+int inventory_adjust(Inventory *inventory, const char *name, int length,
+        int delta) {
+    uint32_t hash = hash_bytes(name, length);
+    int position = probe(inventory, name, length, hash);
+    int entry = inventory->index->entries[position].slot;
+
+    if (entry > 0) {
+        int slot = entry - 1;
+        uint64_t *word = count_word(inventory, slot);
+        uint64_t seen = __atomic_load_n(word, __ATOMIC_RELAXED);
+        int count;
+        uint64_t next;
+        do {
+            // only this thread may empty the slot, so its generation holds
+            uint32_t generation = seen >> 32;
+            count = (int) (uint32_t) seen + delta;
+            next = count != 0 ? pack_count(generation, count)
+                    : pack_count(generation + 1, 0);
+        } while (!__atomic_compare_exchange_n(word, &seen, next, true,
+                __ATOMIC_RELAXED, __ATOMIC_RELAXED));
+        if (count == 0) {
+            // nothing left, give the slot back
+            reclaim_slot(inventory, position, slot);
+        }
+        return count;
+    }
+    if (delta == 0) {
+        return 0; // nothing to store
+    }
+
+    // new item, store it in a fresh (or reclaimed) slot
+    int slot = take_slot(inventory);
+    char *copy = malloc(length + 1);
+    memcpy(copy, name, length);
+    copy[length] = '\0';
+    int chunk = inventory_chunk(slot);
+    inventory->hashes[chunk][inventory_offset(slot, chunk)] = hash;
+    __atomic_store_n(name_word(inventory, slot), copy, __ATOMIC_RELEASE);
+    // a reused slot moves on to the next even generation
+    uint64_t *word = count_word(inventory, slot);
+    uint32_t generation = __atomic_load_n(word, __ATOMIC_RELAXED) >> 32;
+    generation += generation & 1;
+    __atomic_store_n(word, pack_count(generation, delta), __ATOMIC_RELEASE);
+    if (entry == INDEX_EMPTY) {
+        inventory->indexUsed++;
+    }
+    set_entry(&inventory->index->entries[position], slot + 1, hash);
+    inventory->live++;
+    order_insert(&inventory->order, copy, slot);
+
+    // keep the index at most half full (counting tombstones), only growing
+    // it if live entries (not tombstones) are what fills it
+    int capacity = inventory->index->capacity;
+    if (inventory->indexUsed * 2 > capacity) {
+        rebuild_index(inventory, inventory->live * 2 >= capacity / 2
+                ? capacity * 2 : capacity);
+    }
+    return delta;
+}
+
+/**
+ * Function to change the count of a stored item without the lock. Nothing
+ * is changed if the item is not stored or its count would drop to zero
+ * (adding and reclaiming slots need the lock), and the caller falls back to
+ * inventory_adjust under the lock.
+ * @param inventory - Inventory to change
+ * @param name - item name (need not be terminated)
+ * @param length - number of characters in the name
+ * @param delta - amount to add to the count (negative to take away)
+ * @return 1 if the count was changed, 0 if the lock is needed
+ */
+int inventory_try_adjust(Inventory *inventory, const char *name, int length,
+        int delta) {
+    int applied = 0;
+    epoch_enter();
+    int slot = inventory_find(inventory, name, length);
+    if (slot >= 0) {
+        // the name is read after the generation, so if the generation still
+        // holds when the count is swapped, so did the name
+        uint64_t *word = count_word(inventory, slot);
+        uint64_t seen = __atomic_load_n(word, __ATOMIC_ACQUIRE);
+        uint32_t generation = seen >> 32;
+        const char *stored = inventory_name(inventory, slot);
+        if (stored != NULL && strncmp(stored, name, length) == 0
+                && stored[length] == '\0') {
+            while ((generation & 1) == 0 && (uint32_t) (seen >> 32)
+                    == generation) {
+                int count = (int) (uint32_t) seen + delta;
+                if (count == 0) {
+                    break; // the slot is reclaimed under the lock
+                }
+                if (__atomic_compare_exchange_n(word, &seen,
+                        pack_count(generation, count), true,
+                        __ATOMIC_RELAXED, __ATOMIC_RELAXED)) {
+                    applied = 1;
+                    break;
+                }
+            }
+        }
+    }
+    epoch_exit();
+    return applied;
+}
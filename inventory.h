@@ -0,0 +1,125 @@
+#ifndef INVENTORY_H
+#define INVENTORY_H
+
+#include <stdint.h>
+#include "order.h"
+
+// Slots in the first chunk of slots (each later chunk is twice as big).
+#define INVENTORY_START 16
+// Most chunks of slots, enough for INT_MAX slots.
+#define INVENTORY_CHUNKS 27
+
+// struct for an entry in the inventory's hash index
+typedef struct {
+    int slot;
+    uint32_t hash;
+} InventoryEntry;
+
+// struct for the hash index (power of two capacity)
+typedef struct {
+    int capacity;
+    InventoryEntry entries[];
+} InventoryIndex;
+
+/*
+ * Item counts keyed by name. Items live in numbered slots, with names and
+ * counts held in separate arrays so a scan over counts stays in cache, and an
+ * open addressing hash index maps names to slots. Slots whose count drops to
+ * zero are reclaimed for the next new item. An ordered index of the names is
+ * kept alongside, so items can be listed in order without sorting.
+ *
+ * Slots are held in chunks which never move once allocated, and each count
+ * is an atomic word holding the count and its slot's generation (bumped
+ * whenever the slot is emptied or reused). inventory_try_adjust changes the
+ * count of a stored item with one compare and swap, without the caller's
+ * lock, and may run in any number of threads at once, as may inventory_find
+ * and inventory_read (and walks of the ordered index) inside an epoch
+ * critical section. Everything else (adding items, reclaiming slots,
+ * rebuilding the index) needs the caller to hold a lock, and the memory it
+ * unlinks is retired through the epoch domain so lock-free lookups never
+ * touch freed memory.
+ */
+typedef struct {
+    // per-slot data (see inventory_name etc.), NULL name for a free slot
+    char **names[INVENTORY_CHUNKS];
+    uint64_t *counts[INVENTORY_CHUNKS];
+    uint32_t *hashes[INVENTORY_CHUNKS];
+    // slots handed out so far (free or not), and room for slots
+    int slotCount;
+    int slotCapacity;
+    // stack of reclaimed slots
+    int *freeSlots;
+    int freeCount;
+
+    // hash index, each entry's slot is a slot + 1 (or one of the INDEX_
+    // markers), stored alongside the hash so most mismatches are rejected
+    // without touching the slot arrays. Replaced whole when rebuilt.
+    InventoryIndex *index;
+    // entries holding a slot or a tombstone
+    int indexUsed;
+    // slots holding an item
+    int live;
+    // names in lexicographic order, each with its slot
+    Order order;
+} Inventory;
+
+/*
+ * Chunk holding a slot.
+ */
+static inline int inventory_chunk(int slot) {
+    return 31 - __builtin_clz(slot / INVENTORY_START + 1);
+}
+
+/*
+ * Position of a slot within its chunk.
+ */
+static inline int inventory_offset(int slot, int chunk) {
+    return slot - INVENTORY_START * ((1 << chunk) - 1);
+}
+
+/*
+ * Name of the item in a slot (NULL for a free slot).
+ */
+static inline const char *inventory_name(Inventory *inventory, int slot) {
+    int chunk = inventory_chunk(slot);
+    return __atomic_load_n(
+            &inventory->names[chunk][inventory_offset(slot, chunk)],
+            __ATOMIC_ACQUIRE);
+}
+
+/*
+ * Count of the item in a slot.
+ */
+static inline int inventory_count(Inventory *inventory, int slot) {
+    int chunk = inventory_chunk(slot);
+    return (int) (uint32_t) __atomic_load_n(
+            &inventory->counts[chunk][inventory_offset(slot, chunk)],
+            __ATOMIC_RELAXED);
+}
+
+/*
+ * Hash of the name of the item in a slot.
+ */
+static inline uint32_t inventory_hash(Inventory *inventory, int slot) {
+    int chunk = inventory_chunk(slot);
+    return inventory->hashes[chunk][inventory_offset(slot, chunk)];
+}
+
+void init_inventory(Inventory *inventory);
+
+void destroy_inventory(Inventory *inventory);
+
+void inventory_reserve(Inventory *inventory, int items);
+
+int inventory_find(Inventory *inventory, const char *name, int length);
+
+int inventory_read(Inventory *inventory, int slot, const char *name,
+        int length);
+
+int inventory_adjust(Inventory *inventory, const char *name, int length,
+        int delta);
+
+int inventory_try_adjust(Inventory *inventory, const char *name, int length,
+        int delta);
+
+#endif
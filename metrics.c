@@ -0,0 +1,221 @@
+#include <time.h>
+#include "metrics.h"
+#include "2310depot.h"
+#include "shard.h"
+
+// Names of the kinds of message, in Verb order, then Batch.
+static const char *kindNames[METRIC_KINDS] = {
+    "Connect", "IM", "Deliver", "Withdraw", "Transfer", "Defer", "Execute",
+    "Frames", "List", "Query", "Stats", "Unknown", "Batch"
+};
+
+/**
+ * Function to get the current time for timing messages
+ * @return monotonic time in nanoseconds
+ */
+long metrics_now(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000000L + ts.tv_nsec;
+}
+
+/**
+ * Function to name a kind of message
+ * @param kind - Verb, or METRIC_BATCH
+ * @return name of the kind (as shown in the metrics)
+ */
+const char *metric_kind_name(int kind) {
+    return (kind >= 0 && kind < METRIC_KINDS) ? kindNames[kind] : "Unknown";
+}
+
+/**
+ * Function to add one to a counter which only this thread writes
+ * @param counter - counter to add to
+ */
+static void bump(unsigned long *counter) {
+    __atomic_store_n(counter, *counter + 1, __ATOMIC_RELAXED);
+}
+
+/**
+ * Function to add a time to a histogram (only written by this thread)
+ * @param histogram - Histogram to add to
+ * @param nanos - time taken in nanoseconds
+ */
+void record_time(Histogram *histogram, long nanos) {
+    int bucket = nanos <= 0 ? 0 : 64 - __builtin_clzl(nanos);
+    if (bucket >= LATENCY_BUCKETS) {
+        bucket = LATENCY_BUCKETS - 1;
+    }
+    bump(&histogram->buckets[bucket]);
+}
+
+/**
+ * Function for a worker to count a message it has processed
+ * @param metrics - WorkerMetrics of the worker
+ * @param kind - Verb of the message, METRIC_BATCH, or -1 to only count it as
+ * processed (e.g. SIGHUP)
+ * @param nanos - time taken to process it in nanoseconds, or -1 if it was
+ * not timed
+ */
+void count_processed(WorkerMetrics *metrics, int kind, long nanos) {
+    if (kind >= 0) {
+        bump(&metrics->counts[kind]);
+        if (nanos >= 0) {
+            record_time(&metrics->latency[kind], nanos);
+        }
+    }
+    bump(&metrics->processed);
+}
+
+/**
+ * Function for a reading thread to count what it has read from its
+ * connection
+ * @param metrics - ConnectionMetrics of the connection
+ * @param bytes - number of bytes read
+ * @param messages - number of lines and frames in them
+ */
+void count_received(ConnectionMetrics *metrics, int bytes, int messages) {
+    __atomic_store_n(&metrics->bytes, metrics->bytes + bytes,
+            __ATOMIC_RELAXED);
+    __atomic_store_n(&metrics->messages, metrics->messages + messages,
+            __ATOMIC_RELAXED);
+}
+
+/**
+ * Function to find a percentile of a histogram
+ * @param histogram - Histogram to read
+ * @param total - number of times in the histogram
+ * @param percent - percentile wanted (100 for the largest)
+ * @return upper bound of the bucket holding the percentile, in nanoseconds
+ */
+static unsigned long percentile(Histogram *histogram, unsigned long total,
+        int percent) {
+    unsigned long wanted = (total * percent + 99) / 100;
+    unsigned long seen = 0;
+    for (int i = 0; i < LATENCY_BUCKETS; i++) {
+        seen += histogram->buckets[i];
+        if (seen >= wanted && seen > 0) {
+            return 1UL << i;
+        }
+    }
+    return 1UL << (LATENCY_BUCKETS - 1);
+}
+
+/**
+ * Function to write a histogram's count and percentiles (of the times
+ * sampled)
+ * @param out - stream to write to
+ * @param format - format of a line, given the metric's name and value
+ * @param name - name of the histogram
+ * @param histogram - Histogram to write
+ * @return number of lines written
+ */
+static int write_histogram(FILE *out, const char *format, const char *name,
+        Histogram *histogram) {
+    unsigned long total = 0;
+    for (int i = 0; i < LATENCY_BUCKETS; i++) {
+        total += histogram->buckets[i];
+    }
+    if (total == 0) {
+        return 0;
+    }
+    char metric[64];
+    snprintf(metric, sizeof(metric), "%s.timed", name);
+    fprintf(out, format, metric, total);
+    const int percents[] = {50, 99, 100};
+    const char *labels[] = {"p50Ns", "p99Ns", "maxNs"};
+    for (int i = 0; i < 3; i++) {
+        snprintf(metric, sizeof(metric), "%s.%s", name, labels[i]);
+        fprintf(out, format, metric,
+                percentile(histogram, total, percents[i]));
+    }
+    return 4;
+}
+
+/**
+ * Function to add one histogram's counts to another
+ * @param sum - Histogram to add to
+ * @param histogram - Histogram to add
+ */
+static void add_histogram(Histogram *sum, Histogram *histogram) {
+    for (int i = 0; i < LATENCY_BUCKETS; i++) {
+        sum->buckets[i] += __atomic_load_n(&histogram->buckets[i],
+                __ATOMIC_RELAXED);
+    }
+}
+
+/**
+ * Function to write every metric, one per line: message counts and
+ * latencies per kind (over every worker), the wait before a worker picks a
+ * message up, each worker's channel depth, the deferred commands, and each
+ * open connection's traffic.
+ * @param info - Depot struct holding related data.
+ * @param out - stream to write to
+ * @param format - format of a line, given the metric's name (%s) and value
+ * (%lu)
+ * @return number of lines written
+ */
+int write_metrics(Depot *info, FILE *out, const char *format) {
+    int written = 0;
+    char name[64];
+    for (int kind = 0; kind < METRIC_KINDS; kind++) {
+        Histogram sum = {{0}};
+        unsigned long count = 0;
+        for (int s = 0; s < info->shardCount; s++) {
+            WorkerMetrics *metrics = &info->shards[s].metrics;
+            add_histogram(&sum, &metrics->latency[kind]);
+            count += __atomic_load_n(&metrics->counts[kind],
+                    __ATOMIC_RELAXED);
+        }
+        snprintf(name, sizeof(name), "verb.%s.count", kindNames[kind]);
+        fprintf(out, format, name, count);
+        snprintf(name, sizeof(name), "verb.%s", kindNames[kind]);
+        written += 1 + write_histogram(out, format, name, &sum);
+    }
+
+    Histogram wait = {{0}};
+    for (int s = 0; s < info->shardCount; s++) {
+        add_histogram(&wait, &info->shards[s].metrics.wait);
+    }
+    written += write_histogram(out, format, "wait", &wait);
+
+    for (int s = 0; s < info->shardCount; s++) {
+        WorkerMetrics *metrics = &info->shards[s].metrics;
+        snprintf(name, sizeof(name), "worker%d.processed", s);
+        fprintf(out, format, name,
+                __atomic_load_n(&metrics->processed, __ATOMIC_RELAXED));
+        snprintf(name, sizeof(name), "worker%d.depth", s);
+        fprintf(out, format, name, channel_depth(info->shards[s].channel));
+        written += 2;
+    }
+
+    // messages waiting over every worker
+    fprintf(out, format, "depth", queued_messages(info));
+    written++;
+
+    fprintf(out, format, "deferred.keys", (unsigned long)
+            __atomic_load_n(&info->deferred.keys, __ATOMIC_RELAXED));
+    fprintf(out, format, "deferred.commands", (unsigned long)
+            __atomic_load_n(&info->deferred.commands, __ATOMIC_RELAXED));
+    written += 2;
+
+    pthread_mutex_lock(&info->dataLock);
+    for (int i = 0; i < info->connectionCount; i++) {
+        ThreadData *connection = info->connections[i];
+        ConnectionMetrics *metrics = &connection->metrics;
+        if (__atomic_load_n(&metrics->closed, __ATOMIC_RELAXED)) {
+            continue;
+        }
+        snprintf(name, sizeof(name), "connection%d.bytes",
+                connection->socket);
+        fprintf(out, format, name,
+                __atomic_load_n(&metrics->bytes, __ATOMIC_RELAXED));
+        snprintf(name, sizeof(name), "connection%d.messages",
+                connection->socket);
+        fprintf(out, format, name,
+                __atomic_load_n(&metrics->messages, __ATOMIC_RELAXED));
+        written += 2;
+    }
+    pthread_mutex_unlock(&info->dataLock);
+    return written;
+}
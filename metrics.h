@@ -0,0 +1,59 @@
+#ifndef METRICS_H
+#define METRICS_H
+
+#include <stdio.h>
+#include "parse.h"
+
+// Buckets in a histogram. Bucket i counts times under 2^i ns (and at least
+// 2^(i - 1) ns); the last one also counts anything longer.
+#define LATENCY_BUCKETS 32
+// Kinds of message a worker counts: one per verb, then Batch.
+#define METRIC_BATCH (UNKNOWN + 1)
+#define METRIC_KINDS (UNKNOWN + 2)
+
+// struct for a histogram of times, bucketed by powers of two
+typedef struct {
+    unsigned long buckets[LATENCY_BUCKETS];
+} Histogram;
+
+/*
+ * Counters kept by one worker. Only the worker writes them, with plain
+ * (relaxed) stores rather than locked instructions, and anyone may read them
+ * at any time, so a reader may see a message counted but not yet timed.
+ * Reading the clock costs about as much as a small message, so while the
+ * worker is busy only a sample of messages is timed (see metricsSample);
+ * counts are exact.
+ */
+typedef struct {
+    unsigned long counts[METRIC_KINDS];
+    // time spent processing each kind of message
+    Histogram latency[METRIC_KINDS];
+    // time from a (sampled) message being posted to the worker picking it
+    // up
+    Histogram wait;
+    unsigned long processed;
+} WorkerMetrics;
+
+// struct for the counters of one connection (written only by its reader)
+typedef struct {
+    // bytes received, and the number of lines and frames in them
+    unsigned long bytes;
+    unsigned long messages;
+    int closed; // 1 once the connection has been read to the end
+} ConnectionMetrics;
+
+struct Depot;
+
+long metrics_now(void);
+
+const char *metric_kind_name(int kind);
+
+void record_time(Histogram *histogram, long nanos);
+
+void count_processed(WorkerMetrics *metrics, int kind, long nanos);
+
+void count_received(ConnectionMetrics *metrics, int bytes, int messages);
+
+int write_metrics(struct Depot *info, FILE *out, const char *format);
+
+#endif
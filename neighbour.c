@@ -0,0 +1,141 @@
+#include <stdlib.h>
+#include <string.h>
+#include "neighbour.h"
+#include "hash.h"
+
+// Starting number of entries in each table.
+#define NEIGHBOUR_START 64
+
+/**
+ * Function to create empty neighbour indexes
+ * @param index - NeighbourIndex struct to initialise
+ */
+void init_neighbour_index(NeighbourIndex *index) {
+    index->capacity = NEIGHBOUR_START;
+    index->byName = calloc(index->capacity, sizeof(NameEntry));
+    index->byPort = calloc(index->capacity, sizeof(PortEntry));
+    index->count = 0;
+}
+
+/**
+ * Function to spread a port across the table
+ * @param port - port number
+ * @return hash of the port
+ */
+static uint32_t hash_port(int port) {
+    return (uint32_t) port * 2654435761u;
+}
+
+/**
+ * Function to find the entry for a name (or where it would go)
+ * @param index - NeighbourIndex to search
+ * @param name - neighbour name (need not be terminated)
+ * @param length - number of characters in the name
+ * @param hash - hash of the name
+ * @return the name's entry, or the empty entry it would be put in
+ */
+static NameEntry *probe_name(NeighbourIndex *index, const char *name,
+        int length, uint32_t hash) {
+    int mask = index->capacity - 1;
+    for (int position = hash & mask; ; position = (position + 1) & mask) {
+        NameEntry *entry = &index->byName[position];
+        if (entry->position == 0 || (entry->hash == hash
+                && strncmp(entry->name, name, length) == 0
+                && entry->name[length] == '\0')) {
+            return entry;
+        }
+    }
+}
+
+/**
+ * Function to find the entry for a port (or where it would go)
+ * @param index - NeighbourIndex to search
+ * @param port - port number
+ * @return the port's entry, or the empty entry it would be put in
+ */
+static PortEntry *probe_port(NeighbourIndex *index, int port) {
+    int mask = index->capacity - 1;
+    for (int position = hash_port(port) & mask; ;
+            position = (position + 1) & mask) {
+        PortEntry *entry = &index->byPort[position];
+        if (entry->position == 0 || entry->port == port) {
+            return entry;
+        }
+    }
+}
+
+/**
+ * Function to double the size of both tables
+ * @param index - NeighbourIndex to grow
+ */
+static void grow_index(NeighbourIndex *index) {
+    NameEntry *oldNames = index->byName;
+    PortEntry *oldPorts = index->byPort;
+    int oldCapacity = index->capacity;
+    index->capacity *= 2;
+    index->byName = calloc(index->capacity, sizeof(NameEntry));
+    index->byPort = calloc(index->capacity, sizeof(PortEntry));
+    for (int i = 0; i < oldCapacity; i++) {
+        if (oldNames[i].position != 0) {
+            *probe_name(index, oldNames[i].name, strlen(oldNames[i].name),
+                    oldNames[i].hash) = oldNames[i];
+        }
+        if (oldPorts[i].position != 0) {
+            *probe_port(index, oldPorts[i].port) = oldPorts[i];
+        }
+    }
+    free(oldNames);
+    free(oldPorts);
+}
+
+/**
+ * Function to add a neighbour to the indexes
+ * @param index - NeighbourIndex to add to
+ * @param name - terminated neighbour name (not copied)
+ * @param port - neighbour's port
+ * @param position - neighbour's position in the neighbour array
+ */
+void index_neighbour(NeighbourIndex *index, const char *name, int port,
+        int position) {
+    // keep both tables at most half full
+    if ((index->count + 1) * 2 > index->capacity) {
+        grow_index(index);
+    }
+    index->count++;
+
+    int length = strlen(name);
+    uint32_t hash = hash_bytes(name, length);
+    NameEntry *named = probe_name(index, name, length, hash);
+    if (named->position == 0) {
+        named->name = name;
+        named->hash = hash;
+        named->position = position + 1;
+    }
+    PortEntry *ported = probe_port(index, port);
+    if (ported->position == 0) {
+        ported->port = port;
+        ported->position = position + 1;
+    }
+}
+
+/**
+ * Function to look up a neighbour by name
+ * @param index - NeighbourIndex to search
+ * @param name - neighbour name (need not be terminated)
+ * @param length - number of characters in the name
+ * @return position of the neighbour in the array, -1 if there is none
+ */
+int neighbour_by_name(NeighbourIndex *index, const char *name, int length) {
+    return probe_name(index, name, length, hash_bytes(name, length))
+            ->position - 1;
+}
+
+/**
+ * Function to look up a neighbour by port
+ * @param index - NeighbourIndex to search
+ * @param port - port number
+ * @return position of the neighbour in the array, -1 if there is none
+ */
+int neighbour_by_port(NeighbourIndex *index, int port) {
+    return probe_port(index, port)->position - 1;
+}
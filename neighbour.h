@@ -0,0 +1,44 @@
+#ifndef NEIGHBOUR_H
+#define NEIGHBOUR_H
+
+#include <stdint.h>
+
+// struct for an entry in the index by name
+typedef struct {
+    const char *name; // terminated, owned by the neighbour's record
+    uint32_t hash;
+    int position; // position in the neighbour array + 1, 0 when empty
+} NameEntry;
+
+// struct for an entry in the index by port
+typedef struct {
+    int port;
+    int position; // position in the neighbour array + 1, 0 when empty
+} PortEntry;
+
+/*
+ * Hash indexes over the depot's neighbour array, by name and by port, so a
+ * neighbour is found in O(1) rather than by scanning every neighbour. Both
+ * are open addressing tables of positions in the array. Neighbours are never
+ * removed, so there are no tombstones. Where two neighbours share a name the
+ * first one recorded is found. This data structure (by itself) is not
+ * threadsafe.
+ */
+typedef struct {
+    NameEntry *byName;
+    PortEntry *byPort;
+    // power of two, shared by both tables
+    int capacity;
+    int count;
+} NeighbourIndex;
+
+void init_neighbour_index(NeighbourIndex *index);
+
+void index_neighbour(NeighbourIndex *index, const char *name, int port,
+        int position);
+
+int neighbour_by_name(NeighbourIndex *index, const char *name, int length);
+
+int neighbour_by_port(NeighbourIndex *index, int port);
+
+#endif
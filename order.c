@@ -0,0 +1,478 @@
+#include <stddef.h>
+#include <stdlib.h>
+#include <string.h>
+#include "order.h"
+#include "epoch.h"
+
+// Fewest keys a node other than the root may hold.
+#define ORDER_MIN (ORDER_FANOUT / 2 - 1)
+// Most pieces of memory one insert or removal can replace (on each level a
+// node, a sibling, a merged node and a separator, then the old root).
+#define ORDER_REPLACED (ORDER_DEPTH * 4 + 1)
+
+// struct for the memory an insert or removal has replaced, which walks may
+// still be reading until the new root is published
+typedef struct {
+    int count;
+    void *replaced[ORDER_REPLACED];
+} OrderEdit;
+
+/**
+ * Function to create an empty node
+ * @param leaf - 1 for a leaf, 0 for an inner node
+ * @return new node
+ */
+static OrderNode *new_node(int leaf) {
+    OrderNode *node = malloc(sizeof(OrderNode));
+    node->leaf = leaf;
+    node->count = 0;
+    return node;
+}
+
+/**
+ * Function to copy a node so the copy can be changed, noting the original
+ * to be retired once the edit is published
+ * @param node - node to copy
+ * @param edit - OrderEdit in progress
+ * @return copy of the node
+ */
+static OrderNode *copy_node(OrderNode *node, OrderEdit *edit) {
+    OrderNode *copy = malloc(sizeof(OrderNode));
+    copy->leaf = node->leaf;
+    copy->count = node->count;
+    memcpy(copy->keys, node->keys, sizeof(char *) * node->count);
+    if (node->leaf) {
+        memcpy(copy->values, node->values, sizeof(int) * node->count);
+    } else {
+        memcpy(copy->children, node->children,
+                sizeof(OrderNode *) * (node->count + 1));
+    }
+    edit->replaced[edit->count++] = node;
+    return copy;
+}
+
+/**
+ * Function to free the memory an edit replaced, once no walk can reach it
+ * @param data - OrderEdit (as made by publish_edit)
+ */
+static void free_edit(void *data) {
+    OrderEdit *edit = (OrderEdit *) data;
+    for (int i = 0; i < edit->count; i++) {
+        free(edit->replaced[i]);
+    }
+    free(edit);
+}
+
+/**
+ * Function to publish the new root of an edit, then retire everything the
+ * edit replaced (in one piece), as walks which started earlier may still be
+ * reading it
+ * @param order - Order being edited
+ * @param root - new root
+ * @param edit - OrderEdit holding the replaced memory
+ */
+static void publish_edit(Order *order, OrderNode *root, OrderEdit *edit) {
+    __atomic_store_n(&order->root, root, __ATOMIC_RELEASE);
+    size_t size = sizeof(void *) * edit->count;
+    OrderEdit *retired = malloc(offsetof(OrderEdit, replaced) + size);
+    retired->count = edit->count;
+    memcpy(retired->replaced, edit->replaced, size);
+    epoch_retire(retired, free_edit);
+    epoch_collect();
+}
+
+/**
+ * Function to create an empty ordered index
+ * @param order - Order struct to initialise
+ */
+void init_order(Order *order) {
+    order->root = new_node(1);
+    order->count = 0;
+}
+
+/**
+ * Function to free a node and everything below it
+ * @param node - node to free
+ */
+static void free_node(OrderNode *node) {
+    if (!node->leaf) {
+        for (int i = 0; i < node->count; i++) {
+            free((char *) node->keys[i]);
+        }
+        for (int i = 0; i <= node->count; i++) {
+            free_node(node->children[i]);
+        }
+    }
+    free(node);
+}
+
+/**
+ * Function to free everything held by an ordered index (but not the names)
+ * @param order - Order struct to destroy
+ */
+void destroy_order(Order *order) {
+    free_node(order->root);
+}
+
+/**
+ * Function to count the keys in a node which sort at or before a key
+ * @param node - node to search
+ * @param key - terminated key
+ * @return position just past the last key not greater than key
+ */
+static int upper_bound(OrderNode *node, const char *key) {
+    int low = 0;
+    int high = node->count;
+    while (low < high) {
+        int middle = (low + high) / 2;
+        if (strcmp(node->keys[middle], key) <= 0) {
+            low = middle + 1;
+        } else {
+            high = middle;
+        }
+    }
+    return low;
+}
+
+/**
+ * Function to count the keys in a node which sort before a prefix
+ * @param node - node to search
+ * @param prefix - prefix (need not be terminated)
+ * @param length - number of characters in the prefix
+ * @return position of the first key whose first length characters do not
+ * sort before the prefix
+ */
+static int lower_bound(OrderNode *node, const char *prefix, int length) {
+    int low = 0;
+    int high = node->count;
+    while (low < high) {
+        int middle = (low + high) / 2;
+        if (strncmp(node->keys[middle], prefix, length) < 0) {
+            low = middle + 1;
+        } else {
+            high = middle;
+        }
+    }
+    return low;
+}
+
+/**
+ * Function to split a node which has filled up
+ * @param node - node holding ORDER_FANOUT keys (a copy no walk can see yet)
+ * @param separator - set to the key separating the two halves
+ * @return new node holding the upper half
+ */
+static OrderNode *split_node(OrderNode *node, const char **separator) {
+    int half = ORDER_FANOUT / 2;
+    OrderNode *right = new_node(node->leaf);
+    if (node->leaf) {
+        // leaves keep every key, the right half's first is copied up
+        right->count = node->count - half;
+        memcpy(right->keys, node->keys + half,
+                sizeof(char *) * right->count);
+        memcpy(right->values, node->values + half,
+                sizeof(int) * right->count);
+        // the leaf's key may be removed while the separator is still needed
+        *separator = strdup(right->keys[0]);
+    } else {
+        // the middle key moves up
+        right->count = node->count - half - 1;
+        memcpy(right->keys, node->keys + half + 1,
+                sizeof(char *) * right->count);
+        memcpy(right->children, node->children + half + 1,
+                sizeof(OrderNode *) * (right->count + 1));
+        *separator = node->keys[half];
+    }
+    node->count = half;
+    return right;
+}
+
+/**
+ * Function to insert a key below a node, into copies of the nodes on the
+ * way down
+ * @param node - node to insert below
+ * @param key - terminated key
+ * @param value - value to store with the key
+ * @param right - set to the new right hand node if the node split, NULL
+ * otherwise
+ * @param separator - set to the separating key if the node splits
+ * @param edit - OrderEdit in progress
+ * @return copy of the node holding the key (or its left half)
+ */
+static OrderNode *insert_below(OrderNode *node, const char *key, int value,
+        OrderNode **right, const char **separator, OrderEdit *edit) {
+    // equal keys go after those already stored
+    int position = upper_bound(node, key);
+    OrderNode *copy;
+    if (node->leaf) {
+        copy = copy_node(node, edit);
+        memmove(copy->keys + position + 1, copy->keys + position,
+                sizeof(char *) * (copy->count - position));
+        memmove(copy->values + position + 1, copy->values + position,
+                sizeof(int) * (copy->count - position));
+        copy->keys[position] = key;
+        copy->values[position] = value;
+    } else {
+        const char *middle;
+        OrderNode *split;
+        OrderNode *child = insert_below(node->children[position], key, value,
+                &split, &middle, edit);
+        copy = copy_node(node, edit);
+        copy->children[position] = child;
+        if (split == NULL) {
+            *right = NULL;
+            return copy;
+        }
+        memmove(copy->keys + position + 1, copy->keys + position,
+                sizeof(char *) * (copy->count - position));
+        memmove(copy->children + position + 2, copy->children + position + 1,
+                sizeof(OrderNode *) * (copy->count - position));
+        copy->keys[position] = middle;
+        copy->children[position + 1] = split;
+    }
+    copy->count++;
+    *right = copy->count == ORDER_FANOUT ? split_node(copy, separator)
+            : NULL;
+    return copy;
+}
+
+/**
+ * Function to add a key to an ordered index
+ * @param order - Order to add to
+ * @param key - terminated key (not copied)
+ * @param value - value to store with the key
+ */
+void order_insert(Order *order, const char *key, int value) {
+    OrderEdit edit;
+    edit.count = 0;
+    const char *separator;
+    OrderNode *right;
+    OrderNode *root = insert_below(order->root, key, value, &right,
+            &separator, &edit);
+    if (right != NULL) {
+        // the root split, so the tree grows a level
+        OrderNode *left = root;
+        root = new_node(0);
+        root->count = 1;
+        root->keys[0] = separator;
+        root->children[0] = left;
+        root->children[1] = right;
+    }
+    order->count++;
+    publish_edit(order, root, &edit);
+}
+
+/**
+ * Function to top up a child which has dropped below ORDER_MIN keys, by
+ * borrowing a key from a sibling or merging with one. The parent and the
+ * child are copies no walk can see yet, and a sibling is copied before it is
+ * changed.
+ * @param parent - inner node holding the child
+ * @param position - which child of the parent to top up
+ * @param edit - OrderEdit in progress
+ */
+static void refill_child(OrderNode *parent, int position, OrderEdit *edit) {
+    OrderNode *child = parent->children[position];
+    OrderNode *left = position > 0 ? parent->children[position - 1] : NULL;
+    OrderNode *right = position < parent->count
+            ? parent->children[position + 1] : NULL;
+
+    if (left != NULL && left->count > ORDER_MIN) {
+        // move the left sibling's last key to the front of the child
+        left = copy_node(left, edit);
+        parent->children[position - 1] = left;
+        memmove(child->keys + 1, child->keys, sizeof(char *) * child->count);
+        if (child->leaf) {
+            memmove(child->values + 1, child->values,
+                    sizeof(int) * child->count);
+            child->keys[0] = left->keys[left->count - 1];
+            child->values[0] = left->values[left->count - 1];
+            edit->replaced[edit->count++] = (char *) parent->keys[position - 1];
+            parent->keys[position - 1] = strdup(child->keys[0]);
+        } else {
+            memmove(child->children + 1, child->children,
+                    sizeof(OrderNode *) * (child->count + 1));
+            child->keys[0] = parent->keys[position - 1];
+            child->children[0] = left->children[left->count];
+            parent->keys[position - 1] = left->keys[left->count - 1];
+        }
+        child->count++;
+        left->count--;
+    } else if (right != NULL && right->count > ORDER_MIN) {
+        // move the right sibling's first key to the end of the child
+        right = copy_node(right, edit);
+        parent->children[position + 1] = right;
+        if (child->leaf) {
+            child->keys[child->count] = right->keys[0];
+            child->values[child->count] = right->values[0];
+            memmove(right->values, right->values + 1,
+                    sizeof(int) * (right->count - 1));
+        } else {
+            child->keys[child->count] = parent->keys[position];
+            child->children[child->count + 1] = right->children[0];
+            memmove(right->children, right->children + 1,
+                    sizeof(OrderNode *) * right->count);
+        }
+        if (child->leaf) {
+            edit->replaced[edit->count++] = (char *) parent->keys[position];
+            parent->keys[position] = strdup(right->keys[1]);
+        } else {
+            parent->keys[position] = right->keys[0];
+        }
+        memmove(right->keys, right->keys + 1,
+                sizeof(char *) * (right->count - 1));
+        child->count++;
+        right->count--;
+    } else {
+        // both siblings are at the minimum, so merge with one of them
+        if (left == NULL) {
+            left = child;
+            position++;
+        } else {
+            left = copy_node(left, edit);
+            parent->children[position - 1] = left;
+        }
+        OrderNode *merged = parent->children[position];
+        if (left->leaf) {
+            memcpy(left->keys + left->count, merged->keys,
+                    sizeof(char *) * merged->count);
+            memcpy(left->values + left->count, merged->values,
+                    sizeof(int) * merged->count);
+            left->count += merged->count;
+            edit->replaced[edit->count++] = (char *) parent->keys[position - 1];
+        } else {
+            left->keys[left->count] = parent->keys[position - 1];
+            memcpy(left->keys + left->count + 1, merged->keys,
+                    sizeof(char *) * merged->count);
+            memcpy(left->children + left->count + 1, merged->children,
+                    sizeof(OrderNode *) * (merged->count + 1));
+            left->count += merged->count + 1;
+        }
+        edit->replaced[edit->count++] = merged;
+        memmove(parent->keys + position - 1, parent->keys + position,
+                sizeof(char *) * (parent->count - position));
+        memmove(parent->children + position, parent->children + position + 1,
+                sizeof(OrderNode *) * (parent->count - position));
+        parent->count--;
+    }
+}
+
+/**
+ * Function to remove a key from below a node, from copies of the nodes on
+ * the way down
+ * @param node - node to remove from
+ * @param key - terminated key
+ * @param edit - OrderEdit in progress
+ * @return copy of the node without the key, or NULL if the key was not found
+ */
+static OrderNode *remove_below(OrderNode *node, const char *key,
+        OrderEdit *edit) {
+    int position = upper_bound(node, key);
+    if (node->leaf) {
+        if (position == 0 || strcmp(node->keys[position - 1], key) != 0) {
+            return NULL;
+        }
+        position--;
+        OrderNode *copy = copy_node(node, edit);
+        memmove(copy->keys + position, copy->keys + position + 1,
+                sizeof(char *) * (copy->count - position - 1));
+        memmove(copy->values + position, copy->values + position + 1,
+                sizeof(int) * (copy->count - position - 1));
+        copy->count--;
+        return copy;
+    }
+
+    OrderNode *child = remove_below(node->children[position], key, edit);
+    if (child == NULL) {
+        return NULL;
+    }
+    OrderNode *copy = copy_node(node, edit);
+    copy->children[position] = child;
+    if (child->count < ORDER_MIN) {
+        refill_child(copy, position, edit);
+    }
+    return copy;
+}
+
+/**
+ * Function to remove a key from an ordered index (if the key was inserted
+ * more than once, one of its entries is removed)
+ * @param order - Order to remove from
+ * @param key - terminated key
+ */
+void order_remove(Order *order, const char *key) {
+    OrderEdit edit;
+    edit.count = 0;
+    OrderNode *root = remove_below(order->root, key, &edit);
+    if (root == NULL) {
+        // nothing was copied, so there is nothing to retire
+        return;
+    }
+    order->count--;
+    if (!root->leaf && root->count == 0) {
+        // the root's last two children merged, so the tree shrinks a level
+        edit.replaced[edit.count++] = root;
+        root = root->children[0];
+    }
+    publish_edit(order, root, &edit);
+}
+
+/**
+ * Function to start a walk at the first key beginning with (or sorting
+ * after) a prefix. The walk sees the tree as it is now, and a walk made
+ * without the lock must end before its epoch critical section does.
+ * @param order - Order to walk
+ * @param prefix - prefix (need not be terminated, empty to walk every key)
+ * @param length - number of characters in the prefix
+ * @param cursor - OrderCursor to set up
+ */
+void order_seek(Order *order, const char *prefix, int length,
+        OrderCursor *cursor) {
+    OrderNode *node = __atomic_load_n(&order->root, __ATOMIC_ACQUIRE);
+    int depth = 0;
+    while (!node->leaf) {
+        int position = lower_bound(node, prefix, length);
+        cursor->path[depth] = node;
+        cursor->positions[depth] = position;
+        node = node->children[position];
+        depth++;
+    }
+    cursor->path[depth] = node;
+    cursor->positions[depth] = lower_bound(node, prefix, length);
+    cursor->depth = depth;
+}
+
+/**
+ * Function to take the next key of a walk
+ * @param cursor - OrderCursor set up by order_seek
+ * @param key - set to the key
+ * @param value - set to the key's value
+ * @return 1 if a key was taken, 0 at the end of the index
+ */
+int order_next(OrderCursor *cursor, const char **key, int *value) {
+    int depth = cursor->depth;
+    OrderNode *leaf = cursor->path[depth];
+    if (cursor->positions[depth] == leaf->count) {
+        // the leaf is used up, so climb to the nearest node with children
+        // left to walk, then down the leftmost path of its next child
+        int level = depth - 1;
+        while (level >= 0
+                && cursor->positions[level] == cursor->path[level]->count) {
+            level--;
+        }
+        if (level < 0) {
+            return 0;
+        }
+        cursor->positions[level]++;
+        for (; level < depth; level++) {
+            cursor->path[level + 1] =
+                    cursor->path[level]->children[cursor->positions[level]];
+            cursor->positions[level + 1] = 0;
+        }
+        leaf = cursor->path[depth];
+    }
+    *key = leaf->keys[cursor->positions[depth]];
+    *value = leaf->values[cursor->positions[depth]];
+    cursor->positions[depth]++;
+    return 1;
+}
@@ -0,0 +1,58 @@
+#ifndef ORDER_H
+#define ORDER_H
+
+// Most keys a node of the tree can hold.
+#define ORDER_FANOUT 32
+// Most levels the tree can have, enough for INT_MAX keys.
+#define ORDER_DEPTH 12
+
+// struct for a node of the tree (leaves hold values, others hold children)
+typedef struct OrderNode {
+    int leaf;
+    int count;
+    const char *keys[ORDER_FANOUT];
+    int values[ORDER_FANOUT];
+    struct OrderNode *children[ORDER_FANOUT + 1];
+} OrderNode;
+
+/*
+ * Names kept in lexicographic (strcmp) order, each with an integer value,
+ * as a B+ tree. Names are not copied (the inner nodes keep their own copies
+ * of the few used as separators), so each must stay put until it is removed.
+ * Inserts and removals are O(log n), finding where a prefix starts is
+ * O(log n), and each step of a walk is O(1) on average.
+ *
+ * Nodes are never changed once they can be seen: inserts and removals copy
+ * the nodes they change, from the leaf up to a new root which is published
+ * with one store, and retire what they replaced through the epoch domain. So
+ * while only one thread at a time may insert or remove, any number of others
+ * may walk the tree at once without a lock, inside an epoch critical
+ * section, each seeing the tree as it was when its walk started.
+ */
+typedef struct {
+    OrderNode *root;
+    int count;
+} Order;
+
+// struct for a position in an in-order walk: the path from the root down
+// to the current leaf, with the child (or key) reached in each node
+typedef struct {
+    OrderNode *path[ORDER_DEPTH];
+    int positions[ORDER_DEPTH];
+    int depth; // level of the leaf
+} OrderCursor;
+
+void init_order(Order *order);
+
+void destroy_order(Order *order);
+
+void order_insert(Order *order, const char *key, int value);
+
+void order_remove(Order *order, const char *key);
+
+void order_seek(Order *order, const char *prefix, int length,
+        OrderCursor *cursor);
+
+int order_next(OrderCursor *cursor, const char **key, int *value);
+
+#endif
@@ -0,0 +1,395 @@
+#include <errno.h>
+#include <limits.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <sys/uio.h>
+#include "outbox.h"
+#include "channel.h"
+#include "hash.h"
+
+// Starting number of entries (and bytes of names) in a batch.
+#define OUTBOX_START 64
+// Most pieces handed to one writev call.
+#define OUTBOX_IOV 1024
+// Most bytes an encoded Deliver takes on top of its item name.
+#define ENTRY_EXTRA (FRAME_DELIVER_EXTRA > 19 ? FRAME_DELIVER_EXTRA : 19)
+// Stack of each writer thread, which only encodes and sends batches.
+#define WRITER_STACK (64 * 1024)
+
+/**
+ * Function to create an empty batch
+ * @param batch - OutboxBatch struct to initialise
+ */
+static void init_batch(OutboxBatch *batch) {
+    batch->capacity = OUTBOX_START;
+    batch->entries = malloc(sizeof(OutboxEntry) * batch->capacity);
+    batch->count = 0;
+    batch->namesCapacity = OUTBOX_START * 16;
+    batch->names = malloc(batch->namesCapacity);
+    batch->namesUsed = 0;
+    batch->indexCapacity = OUTBOX_START * 2;
+    batch->index = calloc(batch->indexCapacity, sizeof(int));
+    batch->bytes = 0;
+}
+
+/**
+ * Function to empty a batch once it has been sent, keeping its memory
+ * @param batch - OutboxBatch to empty
+ */
+static void clear_batch(OutboxBatch *batch) {
+    batch->count = 0;
+    batch->namesUsed = 0;
+    memset(batch->index, 0, sizeof(int) * batch->indexCapacity);
+    batch->bytes = 0;
+}
+
+/**
+ * Function to count the digits of a quantity
+ * @param quantity - positive number
+ * @return number of decimal digits
+ */
+static int digits(int quantity) {
+    int count = 1;
+    while (quantity >= 10) {
+        quantity /= 10;
+        count++;
+    }
+    return count;
+}
+
+/**
+ * Function to find the index position for an item's newest entry (or where
+ * it would go)
+ * @param batch - OutboxBatch to search
+ * @param name - item name (need not be terminated)
+ * @param length - number of characters in the name
+ * @param hash - hash of the name
+ * @return position in the index
+ */
+static int probe(OutboxBatch *batch, const char *name, int length,
+        uint32_t hash) {
+    int mask = batch->indexCapacity - 1;
+    int position = hash & mask;
+    while (batch->index[position] != 0) {
+        OutboxEntry *entry = &batch->entries[batch->index[position] - 1];
+        if (entry->hash == hash && entry->length == length
+                && memcmp(batch->names + entry->name, name, length) == 0) {
+            break;
+        }
+        position = (position + 1) & mask; // linear probing
+    }
+    return position;
+}
+
+/**
+ * Function to double the size of a batch's index
+ * @param batch - OutboxBatch to re-index
+ */
+static void grow_index(OutboxBatch *batch) {
+    batch->indexCapacity *= 2;
+    free(batch->index);
+    batch->index = calloc(batch->indexCapacity, sizeof(int));
+    // later entries for an item replace earlier ones
+    for (int i = 0; i < batch->count; i++) {
+        OutboxEntry *entry = &batch->entries[i];
+        int position = probe(batch, batch->names + entry->name,
+                entry->length, entry->hash);
+        batch->index[position] = i + 1;
+    }
+}
+
+/**
+ * Function to add a Deliver to a batch, merging it into the item's waiting
+ * entry where there is one
+ * @param batch - OutboxBatch to add to
+ * @param name - item name (need not be terminated)
+ * @param length - number of characters in the name
+ * @param quantity - quantity to deliver
+ * @return 1 if the Deliver was merged into a waiting one, 0 otherwise
+ */
+static int add_entry(OutboxBatch *batch, const char *name, int length,
+        int quantity) {
+    uint32_t hash = hash_bytes(name, length);
+    int position = probe(batch, name, length, hash);
+    if (batch->index[position] != 0) {
+        OutboxEntry *entry = &batch->entries[batch->index[position] - 1];
+        if (entry->quantity <= INT_MAX - quantity) {
+            batch->bytes -= digits(entry->quantity);
+            entry->quantity += quantity;
+            batch->bytes += digits(entry->quantity);
+            return 1;
+        }
+        // too much for one message, start a fresh entry
+    }
+
+    if (batch->count == batch->capacity) {
+        batch->capacity *= 2;
+        batch->entries = realloc(batch->entries,
+                sizeof(OutboxEntry) * batch->capacity);
+    }
+    while (batch->namesUsed + length + 1 > batch->namesCapacity) {
+        batch->namesCapacity *= 2;
+        batch->names = realloc(batch->names, batch->namesCapacity);
+    }
+    OutboxEntry *entry = &batch->entries[batch->count++];
+    entry->name = batch->namesUsed;
+    entry->length = length;
+    entry->quantity = quantity;
+    entry->hash = hash;
+    memcpy(batch->names + batch->namesUsed, name, length);
+    batch->names[batch->namesUsed + length] = '\n';
+    batch->namesUsed += length + 1;
+    batch->index[position] = batch->count;
+
+    // keep the index at most half full
+    if (batch->count * 2 > batch->indexCapacity) {
+        grow_index(batch);
+    }
+    batch->bytes += length + 10 + digits(quantity); // "Deliver:q:name\n"
+    return 0;
+}
+
+/**
+ * Function to add a piece to a list of pieces to write, extending the last
+ * piece instead if the new one follows straight on from it
+ * @param pieces - pieces so far
+ * @param count - number of pieces so far
+ * @param start - start of the new piece
+ * @param length - number of bytes in the new piece
+ * @return new number of pieces
+ */
+static int add_piece(struct iovec *pieces, int count, char *start,
+        int length) {
+    if (count > 0 && (char *) pieces[count - 1].iov_base
+            + pieces[count - 1].iov_len == start) {
+        pieces[count - 1].iov_len += length;
+        return count;
+    }
+    pieces[count].iov_base = start;
+    pieces[count].iov_len = length;
+    return count + 1;
+}
+
+/**
+ * Function to write pieces to a file descriptor, carrying on after partial
+ * writes
+ * @param outbox - Outbox being written (for its counters)
+ * @param fd - file descriptor to write to
+ * @param pieces - pieces to write (changed as they are written)
+ * @param count - number of pieces
+ * @return 0 once everything is written, -1 on error
+ */
+static int write_pieces(Outbox *outbox, int fd, struct iovec *pieces,
+        int count) {
+    while (count > 0) {
+        ssize_t written = writev(fd, pieces,
+                count < OUTBOX_IOV ? count : OUTBOX_IOV);
+        if (written < 0 && errno == EINTR) {
+            continue;
+        } else if (written < 0) {
+            return -1;
+        }
+        __atomic_add_fetch(&outbox->writes, 1, __ATOMIC_RELAXED);
+        __atomic_add_fetch(&outbox->writtenBytes, written, __ATOMIC_RELAXED);
+
+        // skip past whatever was written
+        while (count > 0 && written >= (ssize_t) pieces->iov_len) {
+            written -= pieces->iov_len;
+            pieces++;
+            count--;
+        }
+        if (count > 0) {
+            pieces->iov_base = (char *) pieces->iov_base + written;
+            pieces->iov_len -= written;
+        }
+    }
+    return 0;
+}
+
+/**
+ * Function to send a batch to the neighbour. Framed Delivers are encoded
+ * into one buffer, while text Delivers point at the names in the batch, so
+ * names are not copied again.
+ * @param outbox - Outbox the batch belongs to
+ * @param batch - OutboxBatch to send
+ * @param frames - FrameWriter for the stream, NULL to send text
+ */
+static void send_batch(Outbox *outbox, OutboxBatch *batch,
+        FrameWriter *frames) {
+    char *scratch = malloc(batch->namesUsed + batch->count * ENTRY_EXTRA);
+    struct iovec *pieces = malloc(sizeof(struct iovec) * batch->count * 2);
+    int count = 0;
+    int used = 0;
+    for (int i = 0; i < batch->count; i++) {
+        OutboxEntry *entry = &batch->entries[i];
+        char *name = batch->names + entry->name;
+        int size = frames == NULL ? 0 : encode_deliver_frame(frames,
+                (unsigned char *) scratch + used, name, entry->length,
+                entry->quantity);
+        if (size > 0) {
+            count = add_piece(pieces, count, scratch + used, size);
+        } else {
+            size = sprintf(scratch + used, "Deliver:%d:", entry->quantity);
+            count = add_piece(pieces, count, scratch + used, size);
+            count = add_piece(pieces, count, name, entry->length + 1);
+        }
+        used += size;
+    }
+
+    // anything buffered in the stream (such as a reply) goes first
+    flockfile(outbox->stream);
+    fflush(outbox->stream);
+    write_pieces(outbox, fileno(outbox->stream), pieces, count);
+    funlockfile(outbox->stream);
+    free(scratch);
+    free(pieces);
+}
+
+/**
+ * Function to send everything gathered in an outbox since its last write
+ * @param outbox - Outbox to write
+ */
+static void write_outbox(Outbox *outbox) {
+    pthread_mutex_lock(&outbox->lock);
+    OutboxBatch *batch = &outbox->batches[outbox->filling];
+    outbox->filling ^= 1;
+    FrameWriter *frames = outbox->frames;
+    pthread_mutex_unlock(&outbox->lock);
+
+    send_batch(outbox, batch, frames);
+    __atomic_sub_fetch(&outbox->queuedBytes, batch->bytes, __ATOMIC_RELAXED);
+    clear_batch(batch);
+}
+
+/**
+ * Function for a writer thread to send the outboxes handed to it, each once
+ * its Delivers have had flushMicros to gather
+ * @param data - void pointer (parsed to OutboxWriter struct)
+ * @return void pointer
+ */
+static void *thread_writer(void *data) {
+    OutboxWriter *writer = (OutboxWriter *) data;
+    while (1) {
+        Outbox *outbox;
+        while (read_channel(writer->ready, (void **) &outbox)) {
+            if (writer->flushMicros > 0) {
+                // outboxes arrive in the order they fall due
+                pthread_mutex_lock(&outbox->lock);
+                struct timespec due = outbox->due;
+                pthread_mutex_unlock(&outbox->lock);
+                while (clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &due,
+                        NULL) == EINTR) {
+                }
+            }
+            write_outbox(outbox);
+        }
+        wait_channel(writer->ready);
+    }
+    return NULL;
+}
+
+/**
+ * Function to start the writer threads shared by every outbox
+ * @param pool - OutboxPool to fill in
+ * @param count - number of writer threads
+ * @param flushMicros - how long the writers wait for more Delivers before
+ * writing (0 to write straight away)
+ */
+void start_outbox_writers(OutboxPool *pool, int count, int flushMicros) {
+    pool->writers = malloc(sizeof(OutboxWriter) * count);
+    pool->count = count;
+    pool->next = 0;
+    pthread_attr_t attributes;
+    pthread_attr_init(&attributes);
+    pthread_attr_setstacksize(&attributes, WRITER_STACK);
+    pthread_attr_setdetachstate(&attributes, PTHREAD_CREATE_DETACHED);
+    for (int i = 0; i < count; i++) {
+        OutboxWriter *writer = &pool->writers[i];
+        writer->ready = new_channel();
+        writer->flushMicros = flushMicros;
+        pthread_t tid;
+        pthread_create(&tid, &attributes, thread_writer, (void *) writer);
+    }
+    pthread_attr_destroy(&attributes);
+}
+
+/**
+ * Function to create the outbox for a neighbour, written by one of the
+ * pool's writers
+ * @param pool - OutboxPool to take a writer from
+ * @param stream - FILE stream to the neighbour
+ * @return new Outbox
+ */
+Outbox *new_outbox(OutboxPool *pool, FILE *stream) {
+    Outbox *outbox = calloc(1, sizeof(Outbox));
+    pthread_mutex_init(&outbox->lock, NULL);
+    init_batch(&outbox->batches[0]);
+    init_batch(&outbox->batches[1]);
+    outbox->stream = stream;
+    unsigned int next = __atomic_fetch_add(&pool->next, 1, __ATOMIC_RELAXED);
+    outbox->writer = &pool->writers[next % pool->count];
+    return outbox;
+}
+
+/**
+ * Function to queue a Deliver for the neighbour. The first Delivers since
+ * the last write hand the outbox to its writer.
+ * @param outbox - Outbox of the neighbour
+ * @param name - item name (need not be terminated)
+ * @param length - number of characters in the name
+ * @param quantity - quantity to deliver
+ */
+void outbox_deliver(Outbox *outbox, const char *name, int length,
+        int quantity) {
+    pthread_mutex_lock(&outbox->lock);
+    OutboxBatch *batch = &outbox->batches[outbox->filling];
+    int wasEmpty = batch->count == 0;
+    long before = batch->bytes;
+    if (add_entry(batch, name, length, quantity)) {
+        __atomic_add_fetch(&outbox->coalesced, 1, __ATOMIC_RELAXED);
+    }
+    __atomic_add_fetch(&outbox->queuedBytes, batch->bytes - before,
+            __ATOMIC_RELAXED);
+    int flushMicros = outbox->writer->flushMicros;
+    if (wasEmpty && flushMicros > 0) {
+        clock_gettime(CLOCK_MONOTONIC, &outbox->due);
+        outbox->due.tv_nsec += (flushMicros % 1000000) * 1000L;
+        outbox->due.tv_sec += flushMicros / 1000000
+                + outbox->due.tv_nsec / 1000000000;
+        outbox->due.tv_nsec %= 1000000000;
+    }
+    pthread_mutex_unlock(&outbox->lock);
+    // the writer takes the batch once for each time it is handed the outbox
+    if (wasEmpty) {
+        write_channel(outbox->writer->ready, outbox);
+    }
+}
+
+/**
+ * Function to switch an outbox to binary frames (once the neighbour has
+ * accepted them)
+ * @param outbox - Outbox of the neighbour
+ */
+void outbox_use_frames(Outbox *outbox) {
+    pthread_mutex_lock(&outbox->lock);
+    if (outbox->frames == NULL) {
+        outbox->frames = new_frame_writer();
+    }
+    pthread_mutex_unlock(&outbox->lock);
+}
+
+/**
+ * Function to print an outbox's counters
+ * @param outbox - Outbox of the neighbour
+ * @param name - name of the neighbour
+ * @param out - stream to print to
+ */
+void outbox_report(Outbox *outbox, const char *name, FILE *out) {
+    fprintf(out, "%s queuedBytes %ld writtenBytes %lu writes %lu "
+            "coalesced %lu\n", name,
+            __atomic_load_n(&outbox->queuedBytes, __ATOMIC_RELAXED),
+            __atomic_load_n(&outbox->writtenBytes, __ATOMIC_RELAXED),
+            __atomic_load_n(&outbox->writes, __ATOMIC_RELAXED),
+            __atomic_load_n(&outbox->coalesced, __ATOMIC_RELAXED));
+}
@@ -0,0 +1,87 @@
+#ifndef OUTBOX_H
+#define OUTBOX_H
+
+#include <pthread.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <time.h>
+#include "frame.h"
+
+// struct for a Deliver waiting to be sent
+typedef struct {
+    int name; // offset of the name (followed by a newline) in the names
+    int length;
+    int quantity;
+    uint32_t hash;
+} OutboxEntry;
+
+// struct for the Delivers gathered between two writes
+typedef struct {
+    OutboxEntry *entries;
+    int count;
+    int capacity;
+    char *names;
+    int namesUsed;
+    int namesCapacity;
+    // hash index of each item's newest entry (entry + 1, 0 when empty),
+    // power of two
+    int *index;
+    int indexCapacity;
+    // bytes the entries would take as text
+    long bytes;
+} OutboxBatch;
+
+// struct for a writer thread, which sends the outboxes handed to it
+typedef struct {
+    // outboxes with Delivers waiting, each added when its first arrives
+    struct Channel *ready;
+    int flushMicros; // how long Delivers wait for more before being written
+} OutboxWriter;
+
+/*
+ * A fixed pool of writer threads shared by every neighbour's outbox, so
+ * neighbours do not each cost a thread. Each outbox belongs to one writer,
+ * which never has two of its writes going at once.
+ */
+typedef struct {
+    OutboxWriter *writers;
+    int count;
+    unsigned int next; // writer to hand the next outbox to
+} OutboxPool;
+
+/*
+ * Deliver messages waiting to be written to one neighbour. Workers only add
+ * to the outbox, and its writer takes everything gathered since its last
+ * write and sends it with writev. A Deliver for an item which already has one
+ * waiting is added to it instead, as the order of Delivers for different
+ * items does not matter to the neighbour.
+ */
+typedef struct {
+    pthread_mutex_t lock;
+    // workers add to batches[filling], the writer sends the other
+    OutboxBatch batches[2];
+    int filling;
+    FILE *stream; // stream to the neighbour, shared with replies
+    FrameWriter *frames; // NULL until the neighbour accepts frames
+    OutboxWriter *writer; // thread the outbox is written by
+    struct timespec due; // when the waiting Delivers are to be written
+
+    // counters, read without locking
+    long queuedBytes;
+    unsigned long writtenBytes;
+    unsigned long writes;
+    unsigned long coalesced;
+} Outbox;
+
+void start_outbox_writers(OutboxPool *pool, int count, int flushMicros);
+
+Outbox *new_outbox(OutboxPool *pool, FILE *stream);
+
+void outbox_deliver(Outbox *outbox, const char *name, int length,
+        int quantity);
+
+void outbox_use_frames(Outbox *outbox);
+
+void outbox_report(Outbox *outbox, const char *name, FILE *out);
+
+#endif
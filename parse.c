@@ -0,0 +1,259 @@
+#include <limits.h>
+#include <string.h>
+#include "parse.h"
+
+// Largest port a Connect or IM may name.
+#define PORT_MAX 65535
+
+// struct for the unread part of a line
+typedef struct {
+    const char *at;
+    const char *end;
+} Cursor;
+
+/**
+ * Function to check whether the cursor has reached the end of the line
+ * @param cursor - Cursor into the line
+ * @return 1 at the end of the line (or a newline / terminator), 0 otherwise
+ */
+static int at_end(Cursor *cursor) {
+    return cursor->at == cursor->end || *cursor->at == '\n'
+            || *cursor->at == '\0';
+}
+
+/**
+ * Function to finish a field, consuming the ':' after it unless it is the
+ * last field of the command
+ * @param cursor - Cursor sitting just past the field
+ * @param last - 1 if the field must end the line, 0 if a ':' must follow
+ * @return 0 if the field ended as expected, -1 otherwise
+ */
+static int end_field(Cursor *cursor, int last) {
+    if (last) {
+        return at_end(cursor) ? 0 : -1;
+    }
+    if (at_end(cursor) || *cursor->at != ':') {
+        return -1;
+    }
+    cursor->at++;
+    return 0;
+}
+
+/**
+ * Function to read a (non empty) text field, such as an item or depot name
+ * @param cursor - Cursor at the start of the field
+ * @param field - set to the characters of the field
+ * @param last - 1 if the field must end the line, 0 if a ':' must follow
+ * @return 0 if the field is well formed, -1 otherwise
+ */
+static int read_text(Cursor *cursor, Slice *field, int last) {
+    field->start = cursor->at;
+    while (!at_end(cursor) && *cursor->at != ':') {
+        if (*cursor->at == ' ' || *cursor->at == '\r') {
+            return -1; // never legal within a field
+        }
+        cursor->at++;
+    }
+    field->length = cursor->at - field->start;
+    if (field->length == 0) {
+        return -1;
+    }
+    return end_field(cursor, last);
+}
+
+/**
+ * Function to read a (non empty) unsigned number field
+ * @param cursor - Cursor at the start of the field
+ * @param value - set to the value of the field
+ * @param min - smallest value allowed
+ * @param max - largest value allowed
+ * @param last - 1 if the field must end the line, 0 if a ':' must follow
+ * @return 0 if the field is well formed and in range, -1 otherwise
+ */
+static int read_number(Cursor *cursor, int *value, int min, int max,
+        int last) {
+    const char *start = cursor->at;
+    int total = 0;
+    while (!at_end(cursor) && *cursor->at >= '0' && *cursor->at <= '9') {
+        int digit = *cursor->at - '0';
+        if (total > (max - digit) / 10) {
+            return -1; // out of range
+        }
+        total = total * 10 + digit;
+        cursor->at++;
+    }
+    if (cursor->at == start || total < min) {
+        return -1;
+    }
+    *value = total;
+    return end_field(cursor, last);
+}
+
+/**
+ * Function to work out which command a line starts with
+ * @param word - the characters before the first ':'
+ * @return Verb of the command, UNKNOWN if not recognised
+ */
+static Verb match_verb(Slice word) {
+    switch (word.length) {
+        case 2:
+            return memcmp(word.start, "IM", 2) == 0 ? IM : UNKNOWN;
+        case 4:
+            return memcmp(word.start, "List", 4) == 0 ? LIST : UNKNOWN;
+        case 5:
+            if (memcmp(word.start, "Defer", 5) == 0) {
+                return DEFER;
+            } else if (memcmp(word.start, "Query", 5) == 0) {
+                return QUERY;
+            } else if (memcmp(word.start, "Stats", 5) == 0) {
+                return STATS;
+            }
+            return UNKNOWN;
+        case 6:
+            return memcmp(word.start, "Frames", 6) == 0 ? FRAMES : UNKNOWN;
+        case 7:
+            if (memcmp(word.start, "Connect", 7) == 0) {
+                return CONNECT;
+            } else if (memcmp(word.start, "Deliver", 7) == 0) {
+                return DELIVER;
+            } else if (memcmp(word.start, "Execute", 7) == 0) {
+                return EXECUTE;
+            }
+            return UNKNOWN;
+        case 8:
+            if (memcmp(word.start, "Withdraw", 8) == 0) {
+                return WITHDRAW;
+            } else if (memcmp(word.start, "Transfer", 8) == 0) {
+                return TRANSFER;
+            }
+            return UNKNOWN;
+        default:
+            return UNKNOWN;
+    }
+}
+
+/**
+ * Function to read the verb at the start of a command, and the ':' after it
+ * (which only Stats may leave out)
+ * @param cursor - Cursor at the start of the command
+ * @return Verb of the command, UNKNOWN if not recognised
+ */
+static Verb read_verb(Cursor *cursor) {
+    Slice word;
+    word.start = cursor->at;
+    while (!at_end(cursor) && *cursor->at != ':') {
+        cursor->at++;
+    }
+    word.length = cursor->at - word.start;
+    if (at_end(cursor)) {
+        // only Stats may stand alone, without a ':'
+        return match_verb(word) == STATS ? STATS : UNKNOWN;
+    }
+    cursor->at++;
+    return match_verb(word);
+}
+
+/**
+ * Function to parse one command, allowing a nested Defer only at the top
+ * @param arena - Arena to take a nested command from
+ * @param cursor - Cursor at the start of the command
+ * @param command - Command to fill in
+ * @param nested - 1 if the command is itself being deferred
+ * @return 0 if the command is well formed, -1 otherwise
+ */
+static int parse_fields(Arena *arena, Cursor *cursor, Command *command,
+        int nested) {
+    command->verb = read_verb(cursor);
+
+    int status = -1;
+    switch (command->verb) {
+        case CONNECT:
+            status = nested ? -1
+                    : read_number(cursor, &command->port, 0, PORT_MAX, 1);
+            break;
+        case IM:
+            status = nested ? -1
+                    : read_number(cursor, &command->port, 0, PORT_MAX, 0)
+                    || read_text(cursor, &command->target, 1);
+            break;
+        case DELIVER:
+        case WITHDRAW:
+            status = read_number(cursor, &command->quantity, 1, INT_MAX, 0)
+                    || read_text(cursor, &command->item, 1);
+            break;
+        case TRANSFER:
+            status = read_number(cursor, &command->quantity, 1, INT_MAX, 0)
+                    || read_text(cursor, &command->item, 0)
+                    || read_text(cursor, &command->target, 1);
+            break;
+        case DEFER:
+            if (nested || read_number(cursor, &command->key, 0, INT_MAX, 0)) {
+                break;
+            }
+            command->deferred = arena_alloc(arena, sizeof(Command));
+            status = parse_fields(arena, cursor, command->deferred, 1);
+            break;
+        case EXECUTE:
+        case FRAMES:
+            status = nested ? -1
+                    : read_number(cursor, &command->key, 0, INT_MAX, 1);
+            break;
+        case LIST:
+            // an empty prefix lists every item
+            command->item.start = cursor->at;
+            command->item.length = 0;
+            status = nested ? -1 : at_end(cursor) ? 0
+                    : read_text(cursor, &command->item, 1);
+            break;
+        case QUERY:
+            status = nested ? -1 : read_text(cursor, &command->item, 1);
+            break;
+        case STATS:
+            status = nested ? -1 : 0; // anything after it is ignored
+            break;
+        case UNKNOWN:
+            break;
+    }
+    return status != 0 ? -1 : 0;
+}
+
+/**
+ * Function to check for a Batch header ("Batch:N"), which is followed by N
+ * Deliver, Withdraw or Transfer lines
+ * @param line - start of the line
+ * @param length - most characters to read
+ * @return the number of lines in the batch, or -1 if the line is not a well
+ * formed Batch header
+ */
+int parse_batch(const char *line, int length) {
+    if (length < 6 || memcmp(line, "Batch:", 6) != 0) {
+        return -1;
+    }
+    Cursor cursor;
+    cursor.at = line + 6;
+    cursor.end = line + length;
+    int count;
+    if (read_number(&cursor, &count, 1, BATCH_MAX, 1) != 0) {
+        return -1;
+    }
+    return count;
+}
+
+/**
+ * Function to parse a line into a command in a single pass. Nothing is copied:
+ * the command's slices point into the line.
+ * @param arena - Arena to take a nested (deferred) command from
+ * @param line - start of the line
+ * @param length - most characters to read (the line also ends at a newline
+ * or terminator)
+ * @param command - Command to fill in. Its verb is set even if the rest of the
+ * line is malformed
+ * @return 0 if the line is a well formed command, -1 otherwise
+ */
+int parse_command(Arena *arena, const char *line, int length,
+        Command *command) {
+    Cursor cursor;
+    cursor.at = line;
+    cursor.end = line + length;
+    return parse_fields(arena, &cursor, command, 0);
+}
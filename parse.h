@@ -0,0 +1,58 @@
+#ifndef PARSE_H
+#define PARSE_H
+
+#include "arena.h"
+
+// Most lines a single Batch may carry.
+#define BATCH_MAX 65536
+
+// enum for msgs
+typedef enum {
+    CONNECT = 0,
+    IM = 1,
+    DELIVER = 2,
+    WITHDRAW = 3,
+    TRANSFER = 4,
+    DEFER = 5,
+    EXECUTE = 6,
+    FRAMES = 7,
+    LIST = 8,
+    QUERY = 9,
+    STATS = 10,
+    UNKNOWN = 11
+} Verb;
+
+// struct for a run of characters within a line (not terminated)
+typedef struct {
+    const char *start;
+    int length;
+} Slice;
+
+/*
+ * A parsed message. Slices point into the line that was parsed, so the
+ * command is only valid while that line is. Fields not used by the verb are
+ * left unset.
+ */
+typedef struct Command {
+    Verb verb;
+    // Connect and IM
+    int port;
+    // Deliver, Withdraw and Transfer (always positive)
+    int quantity;
+    // item, or for List the prefix of the items to list (may be empty), or
+    // for Query the item to look up ("*" for every item)
+    Slice item;
+    // destination depot for Transfer, own name for IM
+    Slice target;
+    // Defer and Execute (the framing version for Frames)
+    int key;
+    // Defer only - the Deliver, Withdraw or Transfer to run on Execute
+    struct Command *deferred;
+} Command;
+
+int parse_command(Arena *arena, const char *line, int length,
+        Command *command);
+
+int parse_batch(const char *line, int length);
+
+#endif
@@ -0,0 +1,301 @@
+#include <limits.h>
+#include "shard.h"
+#include "hash.h"
+#include "epoch.h"
+#include "futex.h"
+
+// Bytes of scratch memory each worker starts with.
+#define SHARD_ARENA 4096
+
+/**
+ * Function to create one shard (and channel) per worker
+ * @param info - Depot struct holding related data.
+ */
+void init_shards(Depot *info) {
+    info->shardCount = info->config.workers;
+    info->shards = calloc(info->shardCount, sizeof(Shard));
+    for (int i = 0; i < info->shardCount; i++) {
+        Shard *shard = &info->shards[i];
+        shard->depot = info;
+        shard->index = i;
+        shard->channel = new_channel();
+        init_inventory(&shard->inventory);
+        pthread_mutex_init(&shard->lock, NULL);
+        init_arena(&shard->arena, SHARD_ARENA);
+    }
+}
+
+/**
+ * Function to work out which shard owns an item
+ * @param info - Depot struct holding related data.
+ * @param name - item name (need not be terminated)
+ * @param length - number of characters in the name
+ * @return index of the owning shard
+ */
+int shard_index(Depot *info, const char *name, int length) {
+    if (info->shardCount == 1) {
+        return 0;
+    }
+    return hash_bytes(name, length) % info->shardCount;
+}
+
+/**
+ * Function to find the shard owning an item
+ * @param info - Depot struct holding related data.
+ * @param name - item name (need not be terminated)
+ * @param length - number of characters in the name
+ * @return Shard owning the item
+ */
+Shard *shard_for(Depot *info, const char *name, int length) {
+    return &info->shards[shard_index(info, name, length)];
+}
+
+/**
+ * Function to take the next item of a shard's walk which starts with a prefix
+ * @param inventory - Inventory being walked
+ * @param cursor - OrderCursor of the walk
+ * @param prefix - prefix (need not be terminated)
+ * @param length - number of characters in the prefix
+ * @param count - set to the item's count
+ * @return the item's name, or NULL once the walk is past the prefix
+ */
+static const char *next_item(Inventory *inventory, OrderCursor *cursor,
+        const char *prefix, int length, int *count) {
+    const char *name;
+    int slot;
+    do {
+        if (!order_next(cursor, &name, &slot)
+                || strncmp(name, prefix, length) != 0) {
+            return NULL;
+        }
+        // without the locks, an item emptied since the walk began is skipped
+        *count = inventory_read(inventory, slot, name, strlen(name));
+    } while (*count == 0);
+    return name;
+}
+
+/**
+ * Function to write the items whose names start with a prefix, in
+ * lexicographic order across every shard. Each shard keeps its items in
+ * order, so their walks only need merging. Either every shard must be
+ * locked, or the caller must be inside an epoch critical section (and then
+ * the items and counts of each shard are read while writers carry on).
+ * @param info - Depot struct holding related data.
+ * @param prefix - prefix (need not be terminated, empty for every item)
+ * @param length - number of characters in the prefix
+ * @param out - stream to write to
+ * @param format - printf format for one item, given its name and count
+ * @return number of items written
+ */
+int write_items(Depot *info, const char *prefix, int length, FILE *out,
+        const char *format) {
+    int shards = info->shardCount;
+    OrderCursor *cursors = malloc(sizeof(OrderCursor) * shards);
+    const char **names = malloc(sizeof(char *) * shards);
+    int *counts = malloc(sizeof(int) * shards);
+    for (int i = 0; i < shards; i++) {
+        Inventory *inventory = &info->shards[i].inventory;
+        order_seek(&inventory->order, prefix, length, &cursors[i]);
+        names[i] = next_item(inventory, &cursors[i], prefix, length,
+                &counts[i]);
+    }
+
+    int written = 0;
+    while (1) {
+        // there are only a few shards, so look at the head of each
+        int first = -1;
+        for (int i = 0; i < shards; i++) {
+            if (names[i] != NULL && (first == -1
+                    || strcmp(names[i], names[first]) < 0)) {
+                first = i;
+            }
+        }
+        if (first == -1) {
+            break;
+        }
+        fprintf(out, format, names[first], counts[first]);
+        written++;
+        names[first] = next_item(&info->shards[first].inventory,
+                &cursors[first], prefix, length, &counts[first]);
+    }
+    free(cursors);
+    free(names);
+    free(counts);
+    return written;
+}
+
+/**
+ * Function to find the end of a field in a line
+ * @param field - start of the field
+ * @param end - end of the line
+ * @return first ':', newline or terminator after the start (or end)
+ */
+static const char *field_end(const char *field, const char *end) {
+    while (field < end && *field != ':' && *field != '\n' && *field != '\0') {
+        field++;
+    }
+    return field;
+}
+
+/**
+ * Function to find the item name in a Deliver/Withdraw/Transfer line
+ * @param input - line to search
+ * @param length - number of characters in the line
+ * @param itemLength - set to the number of characters in the name
+ * @return start of the item name, or NULL if the line has none
+ */
+static const char *find_item(const char *input, int length, int *itemLength) {
+    const char *end = input + length;
+    const char *field = field_end(input, end); // end of the command
+    if (field == end || *field != ':') {
+        return NULL;
+    }
+    field = field_end(field + 1, end); // end of the quantity
+    if (field == end || *field != ':') {
+        return NULL; // no quantity, so no item either
+    }
+    field++;
+    *itemLength = field_end(field, end) - field;
+    return field;
+}
+
+/**
+ * Function to check whether a line starts with a given word
+ * @param line - line to check
+ * @param length - number of characters in the line
+ * @param word - terminated word to look for
+ * @return 1 if the line starts with the word, 0 otherwise
+ */
+static int starts_with(const char *line, int length, const char *word) {
+    int wordLength = strlen(word);
+    return length >= wordLength && memcmp(line, word, wordLength) == 0;
+}
+
+/**
+ * Function to work out which shard a Deliver, Withdraw or Transfer line is
+ * for, without parsing the rest of it
+ * @param info - Depot struct holding related data.
+ * @param line - line to check (need not be terminated)
+ * @param length - number of characters in the line
+ * @return index of the shard owning the line's item, or -1 if the line is
+ * not a Deliver, Withdraw or Transfer
+ */
+int line_shard(Depot *info, const char *line, int length) {
+    if (!starts_with(line, length, "Deliver:")
+            && !starts_with(line, length, "Withdraw:")
+            && !starts_with(line, length, "Transfer:")) {
+        return -1;
+    }
+    int itemLength;
+    const char *item = find_item(line, length, &itemLength);
+    if (item == NULL) {
+        return 0; // malformed, the first shard will ignore it
+    }
+    return shard_index(info, item, itemLength);
+}
+
+/**
+ * Function to choose the worker a message is sent to. Deliver, Withdraw and
+ * Transfer go to the shard owning their item, so each item's messages keep
+ * their order, as does a Query for one item. Everything else goes to the
+ * first shard, and when there are several shards the commands which depend
+ * on the state of other shards (Connect, IM, Execute, List, Query:*) are
+ * marked as barriers for their connection: they wait for the connection's
+ * earlier messages to every other shard, and the connection is not read
+ * again until they have finished.
+ * @param info - Depot struct holding related data.
+ * @param message - Message being sent
+ * @return Shard to send the message to
+ */
+Shard *route_message(Depot *info, Message *message) {
+    if (message->sighup == 1) {
+        // the one SIGHUP message is reposted while a worker may still be
+        // reading it, so it is never written here
+        return &info->shards[0];
+    }
+    message->barrier = 0;
+    if (info->shardCount == 1) {
+        return &info->shards[0];
+    }
+    if (message->framed) {
+        // frames only carry Deliver, whose item was decoded by the reader
+        Slice item = message->command.item;
+        return &info->shards[shard_index(info, item.start, item.length)];
+    }
+
+    const char *input = message->input;
+    int index = line_shard(info, input, message->length);
+    if (index >= 0) {
+        // a batch's lines all belong to the shard of its first line
+        return &info->shards[index];
+    } else if (strncmp(input, "Query:", 6) == 0) {
+        const char *item = input + 6;
+        int itemLength = field_end(item, input + message->length) - item;
+        if (itemLength != 1 || item[0] != '*') {
+            return &info->shards[shard_index(info, item, itemLength)];
+        }
+        message->barrier = (message->credits != NULL);
+    } else if (strncmp(input, "Connect", 7) == 0
+            || strncmp(input, "IM", 2) == 0
+            || strncmp(input, "Execute", 7) == 0
+            || strncmp(input, "List", 4) == 0) {
+        message->barrier = (message->credits != NULL);
+    }
+    return &info->shards[0];
+}
+
+/**
+ * Function to count the messages waiting for the workers, from each shard's
+ * channel rather than a counter every message would have to update
+ * @param info - Depot struct holding related data.
+ * @return messages queued over every shard
+ */
+unsigned long queued_messages(Depot *info) {
+    unsigned long depth = 0;
+    for (int i = 0; i < info->shardCount; i++) {
+        depth += channel_depth(info->shards[i].channel);
+    }
+    return depth;
+}
+
+/**
+ * Function for a worker to count a message as finished, waking anyone
+ * waiting for it
+ * @param shard - Shard of the worker
+ */
+void finish_message(Shard *shard) {
+    __atomic_store_n(&shard->finished, shard->finished + 1, __ATOMIC_SEQ_CST);
+    if (__atomic_load_n(&shard->finishWaiters, __ATOMIC_SEQ_CST) > 0) {
+        __atomic_add_fetch(&shard->finishSequence, 1, __ATOMIC_RELEASE);
+        futex_wake(&shard->finishSequence, INT_MAX);
+    }
+}
+
+/**
+ * Function to wait until the workers have finished every message a
+ * connection has posted to them. The connection must not post any more
+ * while this waits.
+ * @param connection - ThreadData of the connection
+ * @param skip - index of a shard not to wait for (-1 to wait for them all)
+ */
+void wait_settled(ThreadData *connection, int skip) {
+    Depot *info = connection->depot;
+    for (int i = 0; i < info->shardCount; i++) {
+        Shard *shard = &info->shards[i];
+        if (i == skip || __atomic_load_n(&shard->finished, __ATOMIC_ACQUIRE)
+                >= connection->posted[i]) {
+            continue;
+        }
+        __atomic_add_fetch(&shard->finishWaiters, 1, __ATOMIC_SEQ_CST);
+        while (1) {
+            int sequence = __atomic_load_n(&shard->finishSequence,
+                    __ATOMIC_ACQUIRE);
+            if (__atomic_load_n(&shard->finished, __ATOMIC_SEQ_CST)
+                    >= connection->posted[i]) {
+                break;
+            }
+            futex_wait(&shard->finishSequence, sequence);
+        }
+        __atomic_sub_fetch(&shard->finishWaiters, 1, __ATOMIC_RELAXED);
+    }
+}
@@ -0,0 +1,25 @@
+#ifndef SHARD_H
+#define SHARD_H
+
+#include "2310depot.h"
+
+void init_shards(Depot *info);
+
+int shard_index(Depot *info, const char *name, int length);
+
+Shard *shard_for(Depot *info, const char *name, int length);
+
+int write_items(Depot *info, const char *prefix, int length, FILE *out,
+        const char *format);
+
+int line_shard(Depot *info, const char *line, int length);
+
+Shard *route_message(Depot *info, Message *message);
+
+unsigned long queued_messages(Depot *info);
+
+void finish_message(Shard *shard);
+
+void wait_settled(ThreadData *connection, int skip);
+
+#endif
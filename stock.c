@@ -0,0 +1,215 @@
+#include <fcntl.h>
+#include <limits.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include "stock.h"
+#include "shard.h"
+#include "frame.h"
+
+/**
+ * Function to check an item name from a stock file, by the rules for names
+ * given on the command line
+ * @param name - item name (not terminated)
+ * @param length - number of characters in the name
+ * @return 1 if the name is valid, 0 if not
+ */
+static int valid_name(const char *name, int length) {
+    if (length == 0) {
+        return 0;
+    }
+    for (int i = 0; i < length; i++) {
+        if (name[i] == ' ' || name[i] == '\n' || name[i] == '\r'
+                || name[i] == ':') {
+            return 0;
+        }
+    }
+    return 1;
+}
+
+/**
+ * Function to size every shard's index for the items about to be loaded
+ * @param info - Depot struct holding related data.
+ * @param items - number of items in the stock file (or a bound on it)
+ */
+static void reserve_items(Depot *info, long items) {
+    long share = items / info->shardCount + 1;
+    for (int i = 0; i < info->shardCount; i++) {
+        inventory_reserve(&info->shards[i].inventory,
+                share > INT_MAX ? INT_MAX : share);
+    }
+}
+
+/**
+ * Function to store an item with the shard that owns it. Only called before
+ * any other thread has started, so no lock is taken.
+ * @param info - Depot struct holding related data.
+ * @param name - item name (not terminated)
+ * @param length - number of characters in the name
+ * @param quantity - quantity to add
+ */
+static void store_item(Depot *info, const char *name, int length,
+        int quantity) {
+    inventory_adjust(&shard_for(info, name, length)->inventory, name, length,
+            quantity);
+}
+
+/**
+ * Function to load a text stock file: a "name quantity" line per item
+ * @param info - Depot struct holding related data.
+ * @param data - contents of the file
+ * @param size - number of bytes in the file
+ * @return OK, NAMEERR for a bad name or QUANERR for a bad quantity
+ */
+static Status load_text(Depot *info, const char *data, size_t size) {
+    const char *end = data + size;
+
+    // count the lines first, so the indexes are only sized once
+    long lines = 1;
+    for (const char *at = data; (at = memchr(at, '\n', end - at)) != NULL;
+            at++) {
+        lines++;
+    }
+    reserve_items(info, lines);
+
+    for (const char *line = data; line < end;) {
+        const char *stop = memchr(line, '\n', end - line);
+        if (stop == NULL) {
+            stop = end; // the last line need not end in a newline
+        }
+        if (stop == line) {
+            line++;
+            continue; // blank line
+        }
+        const char *space = memchr(line, ' ', stop - line);
+        if (space == NULL || space + 1 == stop) {
+            return QUANERR; // no quantity
+        }
+        if (space - line > INT_MAX || !valid_name(line, space - line)) {
+            return NAMEERR;
+        }
+        // digits only, as on the command line
+        long quantity = 0;
+        for (const char *digit = space + 1; digit < stop; digit++) {
+            if (!isdigit((unsigned char) *digit)) {
+                return QUANERR;
+            }
+            quantity = quantity * 10 + (*digit - '0');
+            if (quantity > INT_MAX) {
+                return QUANERR;
+            }
+        }
+        store_item(info, line, space - line, quantity);
+        line = stop + 1;
+    }
+    return OK;
+}
+
+/**
+ * Function to read the next varint of a binary stock file
+ * @param data - contents of the file
+ * @param size - number of bytes in the file
+ * @param used - bytes read so far, moved past the varint
+ * @param value - set to the number read
+ * @return 1 if a varint was read, 0 if the file is cut short or corrupt
+ */
+static int next_varint(const unsigned char *data, size_t size, size_t *used,
+        unsigned int *value) {
+    size_t left = size - *used;
+    int read = decode_varint(data + *used,
+            left < VARINT_MAX ? (int) left : VARINT_MAX, value);
+    if (read <= 0) {
+        return 0;
+    }
+    *used += read;
+    return 1;
+}
+
+/**
+ * Function to load a binary stock file (see stock.h)
+ * @param info - Depot struct holding related data.
+ * @param data - contents of the file
+ * @param size - number of bytes in the file
+ * @return OK, NAMEERR for a bad name, QUANERR for a bad quantity or STOCKERR
+ *         if the file is cut short or corrupt
+ */
+static Status load_binary(Depot *info, const unsigned char *data,
+        size_t size) {
+    size_t used = STOCK_MAGIC_LENGTH;
+    unsigned int items;
+    if (used == size || data[used++] != STOCK_VERSION
+            || !next_varint(data, size, &used, &items)) {
+        return STOCKERR;
+    }
+    // the count is only trusted as far as the file could hold the items
+    reserve_items(info, items < size / 3 ? items : size / 3);
+
+    for (unsigned int i = 0; i < items; i++) {
+        unsigned int length;
+        if (!next_varint(data, size, &used, &length)
+                || length > size - used) {
+            return STOCKERR;
+        }
+        const char *name = (const char *) data + used;
+        used += length;
+        unsigned int quantity;
+        if (!next_varint(data, size, &used, &quantity)) {
+            return STOCKERR;
+        }
+        if (length > INT_MAX || !valid_name(name, length)) {
+            return NAMEERR;
+        }
+        if (quantity > INT_MAX) {
+            return QUANERR;
+        }
+        store_item(info, name, length, quantity);
+    }
+    return used == size ? OK : STOCKERR;
+}
+
+/**
+ * Function to give the depot the goods in a stock file, before any other
+ * thread has started
+ * @param info - Depot struct holding related data.
+ * @param path - path of the stock file
+ * @return 0 - loaded successfully
+ *         2 - an item name is empty or contains banned characters
+ *         3 - a quantity is < 0 or is not a number
+ *         4 - the file cannot be read, or is cut short or corrupt
+ */
+int load_stock(Depot *info, const char *path) {
+    int fd = open(path, O_RDONLY);
+    struct stat stats;
+    if (fd < 0 || fstat(fd, &stats) != 0) {
+        perror(path);
+        if (fd >= 0) {
+            close(fd);
+        }
+        return show_message(STOCKERR);
+    }
+    size_t size = stats.st_size;
+    if (size == 0) {
+        close(fd);
+        return OK; // nothing to load
+    }
+
+    // map the whole file and read it once, front to back
+    void *map = mmap(NULL, size, PROT_READ, MAP_PRIVATE | MAP_POPULATE, fd,
+            0);
+    close(fd);
+    if (map == MAP_FAILED) {
+        perror(path);
+        return show_message(STOCKERR);
+    }
+    madvise(map, size, MADV_SEQUENTIAL);
+
+    Status status;
+    if (size >= STOCK_MAGIC_LENGTH
+            && memcmp(map, STOCK_MAGIC, STOCK_MAGIC_LENGTH) == 0) {
+        status = load_binary(info, (const unsigned char *) map, size);
+    } else {
+        status = load_text(info, (const char *) map, size);
+    }
+    munmap(map, size);
+    return status == OK ? OK : show_message(status);
+}
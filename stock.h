@@ -0,0 +1,30 @@
+#ifndef STOCK_H
+#define STOCK_H
+
+#include "2310depot.h"
+
+// First bytes of a binary stock file.
+#define STOCK_MAGIC "DEPOTSTK"
+// Bytes in STOCK_MAGIC.
+#define STOCK_MAGIC_LENGTH 8
+// Version of the binary stock format, after the magic.
+#define STOCK_VERSION 1
+
+/*
+ * Stock files give a depot its starting goods (see DEPOT_STOCK), for
+ * catalogues too big for the command line. The file is mapped and the
+ * inventory built in one pass over it, in either of two forms:
+ *
+ * text   - one "name quantity" line per item, as for the command line (the
+ *          lines of a SIGHUP Goods dump). Blank lines are skipped.
+ * binary - STOCK_MAGIC, a STOCK_VERSION byte and a varint count of items,
+ *          then for each item a varint name length, the name's bytes and a
+ *          varint quantity (varints as in frame.h).
+ *
+ * Names and quantities are checked as on the command line, and an item
+ * given more than once has its quantities added.
+ */
+
+int load_stock(Depot *info, const char *path);
+
+#endif
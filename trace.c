@@ -0,0 +1,304 @@
+#include <pthread.h>
+#include <stdbool.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include "trace.h"
+#include "metrics.h"
+#include "epoch.h"
+
+// struct for one recorded event
+typedef struct {
+    long nanos; // see metrics_now
+    unsigned int id; // message the event belongs to
+    int phase;
+    int detail; // Verb for TRACE_COMPLETE and TRACE_WRITE
+} TraceEvent;
+
+// Per-thread ring of events. Rings are never freed, only handed on to the
+// next thread to start tracing once their thread exits, so the events of a
+// thread which has exited can still be written out until they are
+// overwritten.
+typedef struct TraceRing {
+    TraceEvent *events;
+    // events recorded so far (only written by the owning thread)
+    unsigned long head;
+    // 1 while owned by a live thread
+    int inUse;
+    int index; // shown as the thread's id
+    // name of the thread, replaced when the ring is handed on (read under
+    // epoch protection)
+    char *name;
+    struct TraceRing *next;
+} TraceRing;
+
+// Events kept per thread, 0 until init_trace is called.
+static int ringSize = 0;
+static TraceRing *rings = NULL;
+static int ringCount = 0;
+static unsigned int lastId = 0;
+static pthread_key_t ringKey;
+static pthread_once_t ringOnce = PTHREAD_ONCE_INIT;
+static __thread TraceRing *self = NULL;
+static __thread char selfName[32];
+// message the calling thread is handling (0 if none is traced)
+static __thread unsigned int currentId = 0;
+
+/**
+ * Function to turn tracing on
+ * @param eventsPerThread - events each thread's ring keeps
+ */
+void init_trace(int eventsPerThread) {
+    ringSize = eventsPerThread;
+}
+
+/**
+ * Function to give a ring a new name. write_trace may still be reading the
+ * old one, so it is retired.
+ * @param ring - TraceRing owned by the calling thread
+ * @param name - name to show
+ */
+static void name_ring(TraceRing *ring, const char *name) {
+    char *old = __atomic_exchange_n(&ring->name, strdup(name),
+            __ATOMIC_ACQ_REL);
+    if (old != NULL) {
+        epoch_retire(old, free);
+        epoch_collect();
+    }
+}
+
+/**
+ * Function to name the calling thread in the trace
+ * @param name - name to show (such as "worker0")
+ */
+void trace_name_thread(const char *name) {
+    strncpy(selfName, name, sizeof(selfName) - 1);
+    if (self != NULL) {
+        name_ring(self, selfName);
+    }
+}
+
+/**
+ * Function to hand a thread's ring back for reuse when the thread exits
+ * @param data - TraceRing owned by the exiting thread
+ */
+static void release_ring(void *data) {
+    TraceRing *ring = (TraceRing *) data;
+    __atomic_store_n(&ring->inUse, 0, __ATOMIC_RELEASE);
+}
+
+/**
+ * Function to create the key used to release rings on thread exit
+ */
+static void create_ring_key(void) {
+    pthread_key_create(&ringKey, release_ring);
+}
+
+/**
+ * Function to find (or create) the calling thread's ring
+ * @return TraceRing owned by the calling thread
+ */
+static TraceRing *own_ring(void) {
+    if (self != NULL) {
+        return self;
+    }
+    pthread_once(&ringOnce, create_ring_key);
+
+    // reuse a ring left behind by an exited thread where possible, carrying
+    // on after its events
+    TraceRing *ring = __atomic_load_n(&rings, __ATOMIC_ACQUIRE);
+    for (; ring != NULL; ring = ring->next) {
+        int expected = 0;
+        if (__atomic_compare_exchange_n(&ring->inUse, &expected, 1, false,
+                __ATOMIC_ACQ_REL, __ATOMIC_RELAXED)) {
+            break;
+        }
+    }
+    int fresh = ring == NULL;
+    if (fresh) {
+        ring = calloc(1, sizeof(TraceRing));
+        ring->events = malloc(sizeof(TraceEvent) * ringSize);
+        ring->inUse = 1;
+        ring->index = __atomic_add_fetch(&ringCount, 1, __ATOMIC_RELAXED);
+    }
+    if (selfName[0] != '\0') {
+        name_ring(ring, selfName);
+    } else {
+        char name[32];
+        snprintf(name, sizeof(name), "thread%d", ring->index);
+        name_ring(ring, name);
+    }
+    if (fresh) {
+        // push onto the global list
+        ring->next = __atomic_load_n(&rings, __ATOMIC_RELAXED);
+        while (!__atomic_compare_exchange_n(&rings, &ring->next, ring, true,
+                __ATOMIC_RELEASE, __ATOMIC_RELAXED)) {
+        }
+    }
+
+    pthread_setspecific(ringKey, ring);
+    self = ring;
+    return ring;
+}
+
+/**
+ * Function for a reading thread to decide whether to trace its next message
+ * @param sinceTraced - messages the caller has read since it last traced one
+ * @param every - trace one message in this many (0 to trace none)
+ * @return id to trace the message under, 0 not to trace it
+ */
+unsigned int trace_sample(unsigned int *sinceTraced, int every) {
+    if (every <= 0 || ++*sinceTraced < (unsigned int) every) {
+        return 0;
+    }
+    *sinceTraced = 0;
+    unsigned int id = __atomic_add_fetch(&lastId, 1, __ATOMIC_RELAXED);
+    return id != 0 ? id : __atomic_add_fetch(&lastId, 1, __ATOMIC_RELAXED);
+}
+
+/**
+ * Function to record that a traced message has reached a phase
+ * @param id - id of the message (nothing is recorded for 0)
+ * @param phase - phase reached
+ * @param detail - Verb for TRACE_COMPLETE and TRACE_WRITE, otherwise 0
+ */
+void trace_event(unsigned int id, TracePhase phase, int detail) {
+    if (id == 0 || ringSize == 0) {
+        return;
+    }
+    TraceRing *ring = own_ring();
+    TraceEvent *event = &ring->events[ring->head % ringSize];
+    event->nanos = metrics_now();
+    event->id = id;
+    event->phase = phase;
+    event->detail = detail;
+    __atomic_store_n(&ring->head, ring->head + 1, __ATOMIC_RELEASE);
+}
+
+/**
+ * Function to set the message the calling thread is handling, so events
+ * deep in its handler can be recorded against it (see trace_mark)
+ * @param id - id of the message, 0 once it is finished with
+ */
+void trace_current(unsigned int id) {
+    currentId = id;
+}
+
+/**
+ * Function to record a phase of the message the calling thread is handling
+ * @param phase - phase reached
+ * @param detail - Verb for TRACE_COMPLETE and TRACE_WRITE, otherwise 0
+ */
+void trace_mark(TracePhase phase, int detail) {
+    trace_event(currentId, phase, detail);
+}
+
+/**
+ * Function to write one Chrome trace event
+ * @param out - stream to write to
+ * @param first - 1 until the first event has been written
+ * @param phase - Chrome phase ("b" to begin an async span, "e" to end one,
+ * "n" for an instant)
+ * @param name - name of the span
+ * @param event - TraceEvent it comes from
+ * @param tid - thread the event was recorded on
+ * @param verb - Verb to add as an argument, -1 for none
+ */
+static void write_event(FILE *out, int *first, const char *phase,
+        const char *name, TraceEvent *event, int tid, int verb) {
+    fprintf(out, "%s{\"name\":\"%s\",\"cat\":\"message\",\"ph\":\"%s\","
+            "\"id\":%u,\"ts\":%ld.%03ld,\"pid\":%d,\"tid\":%d",
+            *first ? "" : ",\n", name, phase, event->id,
+            event->nanos / 1000, event->nanos % 1000, (int) getpid(), tid);
+    if (verb >= 0) {
+        fprintf(out, ",\"args\":{\"verb\":\"%s\"}", metric_kind_name(verb));
+    }
+    fprintf(out, "}");
+    *first = 0;
+}
+
+/**
+ * Function to write the spans an event ends and begins
+ * @param out - stream to write to
+ * @param first - 1 until the first event has been written
+ * @param event - TraceEvent to write
+ * @param tid - thread the event was recorded on
+ */
+static void write_phase(FILE *out, int *first, TraceEvent *event, int tid) {
+    switch (event->phase) {
+        case TRACE_READ:
+            write_event(out, first, "b", "message", event, tid, -1);
+            write_event(out, first, "b", "listen", event, tid, -1);
+            break;
+        case TRACE_ENQUEUE:
+            write_event(out, first, "e", "listen", event, tid, -1);
+            write_event(out, first, "b", "channel", event, tid, -1);
+            break;
+        case TRACE_DEQUEUE:
+            write_event(out, first, "e", "channel", event, tid, -1);
+            write_event(out, first, "b", "parse", event, tid, -1);
+            break;
+        case TRACE_DISPATCH:
+            write_event(out, first, "e", "parse", event, tid, -1);
+            write_event(out, first, "b", "process", event, tid, -1);
+            break;
+        case TRACE_COMPLETE:
+            write_event(out, first, "e", "process", event, tid,
+                    event->detail);
+            write_event(out, first, "e", "message", event, tid, -1);
+            break;
+        default:
+            write_event(out, first, "n", "write", event, tid, event->detail);
+            break;
+    }
+}
+
+/**
+ * Function to write every thread's latest events as Chrome trace JSON. The
+ * threads keep recording while this runs, and any event that may have been
+ * overwritten while it was copied, or may still be half written, is left
+ * out.
+ * @param out - stream to write to
+ * @return number of events written
+ */
+int write_trace(FILE *out) {
+    int written = 0;
+    int first = 1;
+    fprintf(out, "{\"displayTimeUnit\":\"ns\",\"traceEvents\":[\n");
+    TraceEvent *copy = malloc(sizeof(TraceEvent) * (ringSize + 1));
+    TraceRing *ring = __atomic_load_n(&rings, __ATOMIC_ACQUIRE);
+    for (; ring != NULL; ring = ring->next) {
+        char name[32] = "";
+        epoch_enter();
+        const char *current = __atomic_load_n(&ring->name, __ATOMIC_ACQUIRE);
+        if (current != NULL) {
+            strncpy(name, current, sizeof(name) - 1);
+        }
+        epoch_exit();
+        fprintf(out, "%s{\"name\":\"thread_name\",\"ph\":\"M\",\"pid\":%d,"
+                "\"tid\":%d,\"args\":{\"name\":\"%s\"}}", first ? "" : ",\n",
+                (int) getpid(), ring->index, name);
+        first = 0;
+
+        unsigned long head = __atomic_load_n(&ring->head, __ATOMIC_ACQUIRE);
+        unsigned long start = head > (unsigned long) ringSize
+                ? head - ringSize : 0;
+        for (unsigned long i = start; i < head; i++) {
+            copy[i - start] = ring->events[i % ringSize];
+        }
+        // events the thread has since written over are not to be trusted,
+        // nor is the slot it fills next (event now), which it may be
+        // writing already
+        unsigned long now = __atomic_load_n(&ring->head, __ATOMIC_ACQUIRE);
+        unsigned long valid = now >= (unsigned long) ringSize
+                ? now - ringSize + 1 : 0;
+        for (unsigned long i = start > valid ? start : valid; i < head;
+                i++) {
+            write_phase(out, &first, &copy[i - start], ring->index);
+            written++;
+        }
+    }
+    fprintf(out, "\n]}\n");
+    free(copy);
+    return written;
+}
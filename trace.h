@@ -0,0 +1,48 @@
+#ifndef TRACE_H
+#define TRACE_H
+
+#include <stdio.h>
+
+/*
+ * Optional tracing of sampled messages through the depot. When a connection
+ * picks a message to trace it is given an id, and each thread that handles
+ * it records a timestamped event into its own ring buffer (no locks, no
+ * shared writes), so tracing can stay on: the cost is one event per phase of
+ * the sampled messages, and a branch for the rest. Each ring keeps the
+ * thread's latest events. write_trace turns every ring into Chrome trace
+ * JSON (load it in chrome://tracing or ui.perfetto.dev), where each message
+ * shows as one async track with a span per phase:
+ *
+ *   listen  - read from the socket, until posted to the worker's channel
+ *   channel - waiting in the channel, until the worker takes it
+ *   parse   - taken by the worker, until its handler is dispatched
+ *   process - the handler (named by verb), until it completes
+ *
+ * with a "write" marked for each message the handler sends out.
+ */
+
+// phases of a message, in the order they happen
+typedef enum {
+    TRACE_READ = 0,
+    TRACE_ENQUEUE = 1,
+    TRACE_DEQUEUE = 2,
+    TRACE_DISPATCH = 3,
+    TRACE_COMPLETE = 4,
+    TRACE_WRITE = 5
+} TracePhase;
+
+void init_trace(int eventsPerThread);
+
+void trace_name_thread(const char *name);
+
+unsigned int trace_sample(unsigned int *sinceTraced, int every);
+
+void trace_event(unsigned int id, TracePhase phase, int detail);
+
+void trace_current(unsigned int id);
+
+void trace_mark(TracePhase phase, int detail);
+
+int write_trace(FILE *out);
+
+#endif
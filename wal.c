@@ -0,0 +1,640 @@
+#include <dirent.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include "wal.h"
+#include "2310depot.h"
+#include "comms.h"
+#include "shard.h"
+#include "arena.h"
+
+// Starting bytes of each buffer.
+#define WAL_START 4096
+// Most bytes a record takes on top of the names in it.
+#define RECORD_EXTRA 48
+
+/**
+ * Function to get the current time in microseconds
+ * @return monotonic time in microseconds
+ */
+static long now_micros(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000L + ts.tv_nsec / 1000;
+}
+
+/**
+ * Function to build the path of one of the log's files
+ * @param directory - directory the files are kept in
+ * @param kind - "wal" or "snapshot"
+ * @param generation - generation of the file
+ * @return path (to be freed)
+ */
+static char *wal_path(const char *directory, const char *kind,
+        unsigned int generation) {
+    int size = strlen(directory) + strlen(kind) + 16;
+    char *path = malloc(size);
+    snprintf(path, size, "%s/%s.%u", directory, kind, generation);
+    return path;
+}
+
+/**
+ * Function to work out the generation of a file from its name
+ * @param name - file name
+ * @param kind - "wal" or "snapshot"
+ * @param generation - set to the generation
+ * @return 1 if the file is a log file of that kind, 0 otherwise
+ */
+static int file_generation(const char *name, const char *kind,
+        unsigned int *generation) {
+    int length = strlen(kind);
+    if (strncmp(name, kind, length) != 0 || name[length] != '.'
+            || name[length + 1] < '0' || name[length + 1] > '9') {
+        return 0;
+    }
+    char *end;
+    *generation = strtoul(name + length + 1, &end, 10);
+    return *end == '\0';
+}
+
+/**
+ * Function to write all of a buffer to a file, carrying on after partial
+ * writes
+ * @param fd - file descriptor to write to
+ * @param data - bytes to write
+ * @param size - number of bytes
+ */
+static void write_all(int fd, const char *data, long size) {
+    while (size > 0) {
+        ssize_t written = write(fd, data, size);
+        if (written < 0 && errno == EINTR) {
+            continue;
+        } else if (written < 0) {
+            perror("wal");
+            return;
+        }
+        data += written;
+        size -= written;
+    }
+}
+
+/**
+ * Function to make a file's creation (or renaming) in the log's directory
+ * durable
+ * @param wal - Wal the directory belongs to
+ */
+static void sync_directory(Wal *wal) {
+    int fd = open(wal->directory, O_RDONLY);
+    if (fd >= 0) {
+        fsync(fd);
+        close(fd);
+    }
+}
+
+/**
+ * Function to apply one record to the depot
+ * @param info - Depot struct holding related data.
+ * @param arena - Arena for parsing deferred commands
+ * @param line - the record, ending in a newline
+ * @param length - number of characters in the record (with its newline)
+ */
+static void replay_record(Depot *info, Arena *arena, char *line, int length) {
+    if (length < 3 || line[1] != ':') {
+        return; // not a record
+    }
+    char *end;
+    long number = strtol(line + 2, &end, 10);
+    char *rest = end + 1; // after the number's ':'
+    int restLength = line + length - rest;
+
+    if (line[0] == 'A' && *end == ':') {
+        // the name runs up to the newline
+        inventory_adjust(&shard_for(info, rest, restLength - 1)->inventory,
+                rest, restLength - 1, number);
+    } else if (line[0] == 'D' && *end == ':') {
+        Command command;
+        arena_reset(arena);
+        if (parse_command(arena, rest, restLength, &command) == 0) {
+            keep_deferred(info, number, &command);
+        }
+    } else if (line[0] == 'X' && *end == ':') {
+        Deferred *commands;
+        int count = take_deferred(&info->deferred, number, &commands);
+        for (int i = 0; i < count; i++) {
+            free(commands[i].names);
+        }
+        free(commands);
+    }
+}
+
+/**
+ * Function to check that all of an Execute's records were written
+ * @param line - the record, ending in a newline
+ * @param next - start of the record after it
+ * @param end - end of the file's data
+ * @return 0 if the record is an "X" missing some of the "A" records which
+ * follow it, 1 otherwise
+ */
+static int execute_complete(const char *line, const char *next,
+        const char *end) {
+    if (line[0] != 'X' || line[1] != ':') {
+        return 1;
+    }
+    const char *changes = memchr(line + 2, ':', next - line - 2);
+    if (changes == NULL) {
+        return 1; // not a record replay_record applies
+    }
+    for (long missing = strtol(changes + 1, NULL, 10); missing > 0;
+            missing--) {
+        next = memchr(next, '\n', end - next);
+        if (next == NULL) {
+            return 0;
+        }
+        next++;
+    }
+    return 1;
+}
+
+/**
+ * Function to apply every complete record in a file to the depot. A record
+ * cut short by a crash (with no newline) is ignored, as is an Execute whose
+ * records were not all written.
+ * @param info - Depot struct holding related data.
+ * @param arena - Arena for parsing deferred commands
+ * @param path - path of the file
+ * @return number of records applied, -1 if the file could not be read
+ */
+static long replay_file(Depot *info, Arena *arena, const char *path) {
+    int fd = open(path, O_RDONLY);
+    struct stat status;
+    if (fd < 0 || fstat(fd, &status) != 0) {
+        return -1;
+    }
+    char *data = malloc(status.st_size + 1);
+    long size = 0;
+    while (size < status.st_size) {
+        ssize_t got = read(fd, data + size, status.st_size - size);
+        if (got <= 0) {
+            break;
+        }
+        size += got;
+    }
+    close(fd);
+
+    long records = 0;
+    char *line = data;
+    char *end = data + size;
+    char *newline;
+    while ((newline = memchr(line, '\n', end - line)) != NULL) {
+        if (!execute_complete(line, newline + 1, end)) {
+            break; // the crash came part way through an Execute
+        }
+        replay_record(info, arena, line, newline + 1 - line);
+        records++;
+        line = newline + 1;
+    }
+    free(data);
+    return records;
+}
+
+/**
+ * Function to load the state left by an earlier run: the newest snapshot in
+ * the DEPOT_WAL directory, then every log written since it
+ * @param info - Depot struct holding related data.
+ * @param recovered - set to 1 if there was earlier state, 0 otherwise
+ * @return new Wal (not yet started), NULL if DEPOT_WAL is not set
+ */
+Wal *recover_wal(Depot *info, int *recovered) {
+    *recovered = 0;
+    if (info->config.walDirectory == NULL) {
+        return NULL;
+    }
+    Wal *wal = calloc(1, sizeof(Wal));
+    wal->directory = info->config.walDirectory;
+    mkdir(wal->directory, 0777); // may already exist
+
+    DIR *directory = opendir(wal->directory);
+    if (directory == NULL) {
+        perror(wal->directory);
+        free(wal);
+        return NULL;
+    }
+    int haveSnapshot = 0;
+    int haveLog = 0;
+    unsigned int snapshot = 0;
+    unsigned int newest = 0;
+    struct dirent *entry;
+    while ((entry = readdir(directory)) != NULL) {
+        unsigned int generation;
+        if (file_generation(entry->d_name, "snapshot", &generation)) {
+            if (!haveSnapshot || generation > snapshot) {
+                snapshot = generation;
+            }
+            haveSnapshot = 1;
+        } else if (file_generation(entry->d_name, "wal", &generation)) {
+            haveLog = 1;
+        } else {
+            continue;
+        }
+        newest = generation > newest ? generation : newest;
+    }
+    closedir(directory);
+    if (!haveSnapshot && !haveLog) {
+        return wal; // a fresh directory
+    }
+
+    // logs older than the snapshot are already part of it
+    Arena arena;
+    init_arena(&arena, 4096);
+    if (haveSnapshot) {
+        char *path = wal_path(wal->directory, "snapshot", snapshot);
+        replay_file(info, &arena, path);
+        free(path);
+    }
+    for (unsigned int g = snapshot; g <= newest; g++) {
+        char *path = wal_path(wal->directory, "wal", g);
+        replay_file(info, &arena, path);
+        free(path);
+    }
+    destroy_arena(&arena);
+    wal->generation = newest + 1;
+    *recovered = 1;
+    return wal;
+}
+
+/**
+ * Function to get the name of a deferrable verb
+ * @param verb - Deliver, Withdraw or Transfer
+ * @return the verb as sent in messages
+ */
+static const char *verb_name(Verb verb) {
+    switch (verb) {
+        case DELIVER:
+            return "Deliver";
+        case WITHDRAW:
+            return "Withdraw";
+        default:
+            return "Transfer";
+    }
+}
+
+/**
+ * Function to write a deferred command as a record
+ * @param out - buffer with room for the names and RECORD_EXTRA bytes
+ * @param key - key the command was deferred under
+ * @param verb - Deliver, Withdraw or Transfer
+ * @param quantity - quantity of the command
+ * @param item - Slice holding the item name
+ * @param target - Slice holding the Transfer destination
+ * @return number of bytes written
+ */
+static int format_defer(char *out, int key, Verb verb, int quantity,
+        Slice item, Slice target) {
+    int used = sprintf(out, "D:%d:%s:%d:%.*s", key, verb_name(verb),
+            quantity, item.length, item.start);
+    if (verb == TRANSFER) {
+        used += sprintf(out + used, ":%.*s", target.length, target.start);
+    }
+    out[used++] = '\n';
+    return used;
+}
+
+/**
+ * Function to write the depot's whole state as records. The caller holds
+ * whatever locks keep it still.
+ * @param info - Depot struct holding related data.
+ * @param out - stream to write to
+ */
+static void write_state(Depot *info, FILE *out) {
+    for (int s = 0; s < info->shardCount; s++) {
+        Inventory *inventory = &info->shards[s].inventory;
+        for (int slot = 0; slot < inventory->slotCount; slot++) {
+            const char *name = inventory_name(inventory, slot);
+            if (name != NULL) {
+                fprintf(out, "A:%d:%s\n", inventory_count(inventory, slot),
+                        name);
+            }
+        }
+    }
+
+    int position = 0;
+    DeferredGroup *group;
+    while ((group = next_deferred_group(&info->deferred, &position))
+            != NULL) {
+        for (int j = 0; j < group->count; j++) {
+            Deferred *command = &group->commands[j];
+            char *record = malloc(command->item.length
+                    + command->target.length + RECORD_EXTRA);
+            int length = format_defer(record, group->key, command->verb,
+                    command->quantity, command->item, command->target);
+            fwrite(record, 1, length, out);
+            free(record);
+        }
+    }
+}
+
+/**
+ * Function to write a snapshot, under a temporary name until it is complete
+ * @param wal - Wal the snapshot belongs to
+ * @param data - the snapshot's records
+ * @param size - number of bytes of records
+ * @param generation - generation of the snapshot
+ */
+static void write_snapshot(Wal *wal, const char *data, long size,
+        unsigned int generation) {
+    int pathSize = strlen(wal->directory) + 16;
+    char *temporary = malloc(pathSize);
+    snprintf(temporary, pathSize, "%s/snapshot.tmp", wal->directory);
+    char *path = wal_path(wal->directory, "snapshot", generation);
+    int fd = open(temporary, O_WRONLY | O_CREAT | O_TRUNC, 0666);
+    if (fd >= 0) {
+        write_all(fd, data, size);
+        fsync(fd);
+        close(fd);
+        rename(temporary, path);
+        sync_directory(wal);
+    }
+    free(temporary);
+    free(path);
+}
+
+/**
+ * Function to delete the snapshots and logs older than a generation
+ * @param wal - Wal the files belong to
+ * @param generation - oldest generation to keep
+ */
+static void remove_older(Wal *wal, unsigned int generation) {
+    DIR *directory = opendir(wal->directory);
+    if (directory == NULL) {
+        return;
+    }
+    struct dirent *entry;
+    while ((entry = readdir(directory)) != NULL) {
+        unsigned int found;
+        const char *kind = NULL;
+        if (file_generation(entry->d_name, "wal", &found)) {
+            kind = "wal";
+        } else if (file_generation(entry->d_name, "snapshot", &found)) {
+            kind = "snapshot";
+        }
+        if (kind != NULL && found < generation) {
+            char *path = wal_path(wal->directory, kind, found);
+            unlink(path);
+            free(path);
+        }
+    }
+    closedir(directory);
+}
+
+/**
+ * Function to create the log of a generation
+ * @param wal - Wal the log belongs to
+ * @param generation - generation of the log
+ * @return file descriptor to write the log to
+ */
+static int open_log(Wal *wal, unsigned int generation) {
+    char *path = wal_path(wal->directory, "wal", generation);
+    int fd = open(path, O_WRONLY | O_CREAT | O_TRUNC, 0666);
+    if (fd < 0) {
+        perror(path);
+    }
+    free(path);
+    sync_directory(wal);
+    return fd;
+}
+
+/**
+ * Function to write a snapshot of the depot and start a new log after it.
+ * Every lock guarding logged data is held while the state is copied and the
+ * log is switched, so the snapshot holds exactly the changes in older logs.
+ * Nothing is written to disk under the locks: the new log is created first,
+ * and the old log's last changes are written once they are let go.
+ * @param wal - Wal to snapshot (only called by the commit thread)
+ */
+static void take_snapshot(Wal *wal) {
+    Depot *info = wal->depot;
+    int fd = open_log(wal, wal->generation + 1);
+    char *state;
+    size_t size;
+    FILE *out = open_memstream(&state, &size);
+
+    pthread_mutex_lock(&info->deferredLock);
+    for (int i = 0; i < info->shardCount; i++) {
+        pthread_mutex_lock(&info->shards[i].lock);
+    }
+    write_state(info, out);
+    fclose(out);
+
+    // changes which have not been committed belong to the old log, and the
+    // commit thread's buffer is empty, so it takes over gathering changes
+    pthread_mutex_lock(&wal->lock);
+    WalBuffer *rest = &wal->buffers[wal->filling];
+    wal->filling ^= 1;
+    int oldFd = wal->fd;
+    wal->fd = fd;
+    wal->generation++;
+    wal->sinceSnapshot = 0;
+    pthread_mutex_unlock(&wal->lock);
+
+    for (int i = 0; i < info->shardCount; i++) {
+        pthread_mutex_unlock(&info->shards[i].lock);
+    }
+    pthread_mutex_unlock(&info->deferredLock);
+
+    write_all(oldFd, rest->data, rest->used);
+    fdatasync(oldFd);
+    close(oldFd);
+    rest->used = 0;
+    rest->records = 0;
+    write_snapshot(wal, state, size, wal->generation);
+    remove_older(wal, wal->generation);
+    free(state);
+    __atomic_add_fetch(&wal->snapshots, 1, __ATOMIC_RELAXED);
+}
+
+/**
+ * Function for the commit thread to write the log in groups, with one fsync
+ * for each group
+ * @param data - void pointer (parsed to Wal struct)
+ * @return void pointer
+ */
+static void *thread_commit(void *data) {
+    Wal *wal = (Wal *) data;
+    pthread_mutex_lock(&wal->lock);
+    while (1) {
+        while (wal->buffers[wal->filling].records == 0) {
+            pthread_cond_wait(&wal->ready, &wal->lock);
+        }
+
+        // let a batch gather, for no longer than the oldest record may wait
+        long until = wal->firstMicros + wal->micros;
+        struct timespec deadline;
+        deadline.tv_sec = until / 1000000;
+        deadline.tv_nsec = (until % 1000000) * 1000;
+        wal->gathering = 1;
+        while (wal->buffers[wal->filling].records < wal->batch
+                && pthread_cond_timedwait(&wal->ready, &wal->lock,
+                &deadline) != ETIMEDOUT) {
+        }
+        wal->gathering = 0;
+        WalBuffer *buffer = &wal->buffers[wal->filling];
+        wal->filling ^= 1;
+        pthread_mutex_unlock(&wal->lock);
+
+        write_all(wal->fd, buffer->data, buffer->used);
+        fdatasync(wal->fd);
+        __atomic_add_fetch(&wal->commits, 1, __ATOMIC_RELAXED);
+        wal->sinceSnapshot += buffer->records;
+        buffer->used = 0;
+        buffer->records = 0;
+        if (wal->sinceSnapshot >= wal->snapshotRecords) {
+            take_snapshot(wal);
+        }
+        pthread_mutex_lock(&wal->lock);
+    }
+    return NULL;
+}
+
+/**
+ * Function to start logging: the state the depot starts with (recovered or
+ * from the command line) is written as the first snapshot of a new
+ * generation, and the commit thread is started
+ * @param info - Depot struct holding related data.
+ * @param wal - Wal returned by recover_wal
+ */
+void start_wal(Depot *info, Wal *wal) {
+    wal->depot = info;
+    wal->batch = info->config.walBatch;
+    wal->micros = info->config.walMicros;
+    wal->snapshotRecords = info->config.walSnapshot;
+    pthread_mutex_init(&wal->lock, NULL);
+    pthread_condattr_t attributes;
+    pthread_condattr_init(&attributes);
+    pthread_condattr_setclock(&attributes, CLOCK_MONOTONIC);
+    pthread_cond_init(&wal->ready, &attributes);
+    for (int i = 0; i < 2; i++) {
+        wal->buffers[i].capacity = WAL_START;
+        wal->buffers[i].data = malloc(WAL_START);
+    }
+
+    char *state;
+    size_t size;
+    FILE *out = open_memstream(&state, &size);
+    write_state(info, out);
+    fclose(out);
+    write_snapshot(wal, state, size, wal->generation);
+    free(state);
+    wal->fd = open_log(wal, wal->generation);
+    remove_older(wal, wal->generation);
+    info->wal = wal;
+
+    pthread_t tid;
+    pthread_create(&tid, NULL, thread_commit, (void *) wal);
+    pthread_detach(tid);
+}
+
+/**
+ * Function to start adding records. The lock guarding the changed data must
+ * already be held.
+ * @param wal - Wal to add to
+ */
+void wal_lock(Wal *wal) {
+    pthread_mutex_lock(&wal->lock);
+}
+
+/**
+ * Function to finish adding records, waking the commit thread if it has
+ * something new to do
+ * @param wal - Wal added to
+ */
+void wal_unlock(Wal *wal) {
+    WalBuffer *buffer = &wal->buffers[wal->filling];
+    if (buffer->records > 0
+            && (!wal->gathering || buffer->records >= wal->batch)) {
+        pthread_cond_signal(&wal->ready);
+    }
+    pthread_mutex_unlock(&wal->lock);
+}
+
+/**
+ * Function to make room for a record, with the lock held
+ * @param wal - Wal to add to
+ * @param size - most bytes the record takes
+ * @return where to write the record
+ */
+static char *reserve(Wal *wal, int size) {
+    WalBuffer *buffer = &wal->buffers[wal->filling];
+    if (buffer->records == 0) {
+        wal->firstMicros = now_micros();
+    }
+    while (buffer->used + size > buffer->capacity) {
+        buffer->capacity *= 2;
+        buffer->data = realloc(buffer->data, buffer->capacity);
+    }
+    buffer->records++;
+    __atomic_add_fetch(&wal->records, 1, __ATOMIC_RELAXED);
+    return buffer->data + buffer->used;
+}
+
+/**
+ * Function to log a change to an item's count, with the lock held
+ * @param wal - Wal to add to
+ * @param name - item name (need not be terminated)
+ * @param length - number of characters in the name
+ * @param delta - amount the count changed by
+ */
+void wal_adjust(Wal *wal, const char *name, int length, int delta) {
+    char *out = reserve(wal, length + RECORD_EXTRA);
+    int used = sprintf(out, "A:%d:", delta);
+    memcpy(out + used, name, length);
+    out[used + length] = '\n';
+    wal->buffers[wal->filling].used += used + length + 1;
+}
+
+/**
+ * Function to log a deferred command, with the lock held
+ * @param wal - Wal to add to
+ * @param key - key the command was deferred under
+ * @param verb - Deliver, Withdraw or Transfer
+ * @param quantity - quantity of the command
+ * @param item - Slice holding the item name
+ * @param target - Slice holding the Transfer destination
+ */
+void wal_defer(Wal *wal, int key, Verb verb, int quantity, Slice item,
+        Slice target) {
+    int targetLength = verb == TRANSFER ? target.length : 0;
+    char *out = reserve(wal, item.length + targetLength + RECORD_EXTRA);
+    wal->buffers[wal->filling].used += format_defer(out, key, verb, quantity,
+            item, target);
+}
+
+/**
+ * Function to log the deferred commands of a key being taken, with the lock
+ * held. The changes they make must be logged straight after, before the lock
+ * is let go.
+ * @param wal - Wal to add to
+ * @param key - key whose commands were taken
+ * @param changes - number of wal_adjust records which follow
+ */
+void wal_execute(Wal *wal, int key, int changes) {
+    char *out = reserve(wal, RECORD_EXTRA);
+    wal->buffers[wal->filling].used += sprintf(out, "X:%d:%d\n", key,
+            changes);
+}
+
+/**
+ * Function to print the log's counters
+ * @param wal - Wal to report on
+ * @param out - stream to print to
+ */
+void wal_report(Wal *wal, FILE *out) {
+    fprintf(out, "wal generation %u records %lu commits %lu snapshots %lu\n",
+            wal->generation,
+            __atomic_load_n(&wal->records, __ATOMIC_RELAXED),
+            __atomic_load_n(&wal->commits, __ATOMIC_RELAXED),
+            __atomic_load_n(&wal->snapshots, __ATOMIC_RELAXED));
+}
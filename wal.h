@@ -0,0 +1,81 @@
+#ifndef WAL_H
+#define WAL_H
+
+#include <pthread.h>
+#include <stdio.h>
+#include "parse.h"
+
+// struct for the log records gathered between two commits
+typedef struct {
+    char *data;
+    int used;
+    int capacity;
+    int records;
+} WalBuffer;
+
+struct Depot;
+
+/*
+ * Write-ahead log of every change to the inventory and the deferred
+ * commands, kept in a directory when DEPOT_WAL is set. Each change is
+ * appended as a line while the lock guarding the changed data is still
+ * held, so the log holds each item's changes in the order they were made.
+ * A commit thread writes what has gathered and covers it with one fsync,
+ * once DEPOT_WAL_BATCH records are waiting or the oldest has waited
+ * DEPOT_WAL_US. After DEPOT_WAL_SNAPSHOT records the state is written out as
+ * a snapshot and the log starts again, so recovery replays the newest
+ * snapshot and only the log written since.
+ *
+ * Records are "A:delta:item" (an item's count changed), "D:key:command" (a
+ * command was deferred) and "X:key:n" (a key's deferred commands were taken,
+ * and the n "A" records after it are their effects). An Execute's records
+ * are added together, so recovery stops at one which was only partly
+ * written rather than keep half of it. Snapshots are made of the same
+ * records. Files are numbered by generation:
+ * snapshot.N holds the state when wal.N was started.
+ */
+typedef struct Wal {
+    struct Depot *depot;
+    const char *directory;
+    unsigned int generation; // generation of the log being written
+    int fd; // log being written (only used by the commit thread)
+
+    pthread_mutex_t lock;
+    pthread_cond_t ready; // signalled when there is something to commit
+    // changes are added to buffers[filling], the commit thread writes the
+    // other
+    WalBuffer buffers[2];
+    int filling;
+    int gathering; // 1 while the commit thread waits for a batch to fill
+    long firstMicros; // when the oldest waiting record was added
+
+    // commit policy
+    int batch;
+    int micros;
+    long snapshotRecords;
+    long sinceSnapshot; // records logged since the last snapshot
+
+    // counters, read without locking
+    unsigned long records;
+    unsigned long commits;
+    unsigned long snapshots;
+} Wal;
+
+Wal *recover_wal(struct Depot *info, int *recovered);
+
+void start_wal(struct Depot *info, Wal *wal);
+
+void wal_lock(Wal *wal);
+
+void wal_unlock(Wal *wal);
+
+void wal_adjust(Wal *wal, const char *name, int length, int delta);
+
+void wal_defer(Wal *wal, int key, Verb verb, int quantity, Slice item,
+        Slice target);
+
+void wal_execute(Wal *wal, int key, int changes);
+
+void wal_report(Wal *wal, FILE *out);
+
+#endif